@@ -16,6 +16,8 @@
 
 #include "log.h"
 #include "alsa.h"
+#include "probe.h"
+#include "seq.h"
 
 
 static const char *atest_conf_search[] = { "atest.conf", "~/.atest.conf", "/etc/atest.conf", NULL };
@@ -33,8 +35,13 @@ void alsa_config_init( struct alsa_config *config, const char *config_path )
     config->rate = 48000;
     config->period = 960;
     config->buffer_period_count = 2;
+    config->start_threshold = 0;
     config->linking_capture_playback = 0;
-    config->format = SND_PCM_FORMAT_S16_LE; // only supported format for the moment
+    config->tstamp = 0;
+    config->timer_sched = 0;
+    config->timer_target = 0;
+    config->format = SND_PCM_FORMAT_S16_LE;
+    config->access = SND_PCM_ACCESS_RW_INTERLEAVED;
     config->device[0] = '\0';
     config->priority[0] = '\0';
 
@@ -54,6 +61,7 @@ void alsa_config_init( struct alsa_config *config, const char *config_path )
                 char line[128];
                 char priority[32];
                 char device[64];
+                char format[32];
                 dbg("alsa_config_init: using %s", exp_result.we_wordv[0]);
 
                 while (fgets( line, sizeof(line), F) != NULL) {
@@ -66,12 +74,30 @@ void alsa_config_init( struct alsa_config *config, const char *config_path )
                         config->period = v;
                     else if (sscanf(line, "buffer_period_count=%d", &v)==1)
                         config->buffer_period_count = v;
+                    else if (sscanf(line, "start_threshold=%d", &v)==1)
+                        config->start_threshold = v;
                     else if (sscanf(line, "linking_capture_playback=%d", &v)==1)
                         config->linking_capture_playback = v;
+                    else if (sscanf(line, "tstamp=%d", &v)==1)
+                        config->tstamp = v;
+                    else if (sscanf(line, "timer_sched=%d", &v)==1)
+                        config->timer_sched = v;
+                    else if (sscanf(line, "timer_target=%d", &v)==1)
+                        config->timer_target = v;
+                    else if (sscanf(line, "mmap=%d", &v)==1)
+                        config->access = alsa_access( v, alsa_access_is_interleaved( config->access ));
+                    else if (sscanf(line, "interleaved=%d", &v)==1)
+                        config->access = alsa_access( alsa_access_is_mmap( config->access ), v );
                     else if (sscanf(line, "priority=%32s", priority)==1)
                         strcpy( config->priority, priority );
                     else if (sscanf(line, "device=%64s", device)==1)
                         strcpy( config->device, device );
+                    else if (sscanf(line, "format=%31s", format)==1) {
+                        if (seq_format_supported( snd_pcm_format_value( format ) ))
+                            config->format = snd_pcm_format_value( format );
+                        else
+                            warn("alsa_config_init: unsupported format '%s'", format);
+                    }
                 }
                 fclose(F);
                 stop_config_search = 1;
@@ -88,212 +114,260 @@ void alsa_config_dump( struct alsa_config *config ) {
     dbg("config:");
     dbg("  channels=%u", config->channels);
     dbg("  rate=%u", config->rate);
+    dbg("  format=%s", snd_pcm_format_name( config->format ));
+    dbg("  access=%s", snd_pcm_access_name( config->access ));
     dbg("  period=%u", config->period);
     dbg("  buffer_period_count=%u", config->buffer_period_count);
+    dbg("  start_threshold=%u", config->start_threshold);
     dbg("  linking_capture_playback=%u", config->linking_capture_playback);
+    dbg("  tstamp=%u", config->tstamp);
+    dbg("  timer_sched=%u", config->timer_sched);
+    dbg("  timer_target=%u", config->timer_target);
 }
 
 
 
 
 
-int alsa_device_open( const char *device_name, struct alsa_config *config,
-        snd_pcm_t **capture_handle, snd_pcm_t **playback_handle )
+snd_pcm_access_t alsa_access( int mmap, int interleaved ) {
+    if (mmap)
+        return interleaved ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_MMAP_NONINTERLEAVED;
+    else
+        return interleaved ? SND_PCM_ACCESS_RW_INTERLEAVED : SND_PCM_ACCESS_RW_NONINTERLEAVED;
+}
+
+
+int alsa_access_is_mmap( snd_pcm_access_t access ) {
+    return (access == SND_PCM_ACCESS_MMAP_INTERLEAVED) || (access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+}
+
+
+int alsa_access_is_interleaved( snd_pcm_access_t access ) {
+    return (access == SND_PCM_ACCESS_MMAP_INTERLEAVED) || (access == SND_PCM_ACCESS_RW_INTERLEAVED);
+}
+
+
+
+
+
+/*
+ * timer scheduled mode: no interrupt (nor poll wake up) at the period boundaries
+ */
+static int alsa_set_no_period_wakeup( const char *device_name, snd_pcm_t *pcm, snd_pcm_hw_params_t *hw_params )
 {
-    snd_pcm_hw_params_t *hw_params = NULL;
-    snd_pcm_sw_params_t *sw_params = NULL;
+    int r;
+    if ((r = snd_pcm_hw_params_set_period_wakeup (pcm, hw_params, 0)) < 0) {
+        err("%s: cannot disable the period wake ups (%s)", device_name, snd_strerror (r));
+        return r;
+    }
+    return 0;
+}
 
-    if (capture_handle) *capture_handle = NULL;
-    if (playback_handle) *playback_handle = NULL;
 
-    snd_pcm_uframes_t period_size = config->period;
-    int period_count = config->buffer_period_count;
-    snd_pcm_uframes_t buffer_size = period_count * period_size;
-    int dir, r;
+/*
+ * timer scheduled mode: the playback fill target, below the buffer size
+ */
+static snd_pcm_uframes_t alsa_timer_target( struct alsa_config *config, snd_pcm_uframes_t buffer_size )
+{
+    if (!config->timer_target || config->timer_target > buffer_size) {
+        if (config->timer_target)
+            warn("timer target %u larger than the buffer (%u frames). set to %u",
+                    config->timer_target, (unsigned)buffer_size, (unsigned)buffer_size / 2);
+        config->timer_target = buffer_size / 2;
+    }
+    return config->timer_target;
+}
 
-    if (capture_handle) {
-        /* open the capture */
 
-        if ((r = snd_pcm_open (capture_handle, device_name, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
-           err( "%s c: cannot open audio device(%s)", device_name, snd_strerror (r));
-           *capture_handle = NULL;
-           goto open_failed;
-        }
+/*
+ * enable the audio timestamps, taken from CLOCK_MONOTONIC
+ */
+static int alsa_set_tstamp( const char *device_name, snd_pcm_t *pcm, snd_pcm_sw_params_t *sw_params )
+{
+    int r;
+    if ((r = snd_pcm_sw_params_set_tstamp_mode (pcm, sw_params, SND_PCM_TSTAMP_ENABLE)) < 0) {
+        err("%s: cannot enable the timestamps (%s)", device_name, snd_strerror (r));
+        return r;
+    }
+    if ((r = snd_pcm_sw_params_set_tstamp_type (pcm, sw_params, SND_PCM_TSTAMP_TYPE_MONOTONIC)) < 0) {
+        err("%s: cannot set the monotonic timestamps (%s)", device_name, snd_strerror (r));
+        return r;
+    }
+    return 0;
+}
 
-        if ((r = snd_pcm_hw_params_malloc (&hw_params)) < 0) {
-           err("%s c: cannot allocate hardware parameter structure (%s)", device_name, snd_strerror (r));
-           goto open_failed;
-        }
 
-        if ((r = snd_pcm_hw_params_any (*capture_handle, hw_params)) < 0) {
-           err("%s c: cannot initialize hardware parameter structure (%s)", device_name, snd_strerror (r));
-           goto open_failed;
-        }
+/*
+ * playback start threshold: (period_count - 1) periods unless configured
+ */
+static snd_pcm_uframes_t alsa_start_threshold( struct alsa_config *config,
+        snd_pcm_uframes_t period_size, snd_pcm_uframes_t buffer_size )
+{
+    if (config->timer_sched)
+        return alsa_timer_target( config, buffer_size );
+    if (config->start_threshold > buffer_size) {
+        warn("start threshold %u larger than the buffer (%u frames). set to %u",
+                config->start_threshold, (unsigned)buffer_size, (unsigned)buffer_size);
+        config->start_threshold = buffer_size;
+    }
+    if (config->start_threshold)
+        return config->start_threshold;
+    return (config->buffer_period_count - 1) * period_size;
+}
 
-        if ((r = snd_pcm_hw_params_set_access (*capture_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-           err("%s c: cannot set access type (%s)", device_name, snd_strerror (r));
-           goto open_failed;
-        }
 
-        if ((r = snd_pcm_hw_params_set_format (*capture_handle, hw_params, SND_PCM_FORMAT_S16_LE)) < 0) {
-           err("%s c: cannot set sample format (%s)", device_name,snd_strerror (r));
-           goto open_failed;
-        }
+int alsa_device_setup( const char *device_name, struct alsa_config *config, snd_pcm_t *pcm,
+        const struct probe_caps *caps )
+{
+    snd_pcm_hw_params_t *hw_params = NULL;
+    snd_pcm_sw_params_t *sw_params = NULL;
 
-        if ((r = snd_pcm_hw_params_set_rate_near (*capture_handle, hw_params, &config->rate, 0)) < 0) {
-           err("%s c: cannot set sample rate (%s)", device_name,snd_strerror (r));
-           goto open_failed;
-        }
+    int playback = snd_pcm_stream( pcm ) == SND_PCM_STREAM_PLAYBACK;
+    char s = playback ? 'p' : 'c';
+    snd_pcm_uframes_t period_size = config->period;
+    int period_count = config->buffer_period_count;
+    snd_pcm_uframes_t buffer_size;
+    char reason[96];
+    int dir, r;
 
-        if ((r = snd_pcm_hw_params_set_channels (*capture_handle, hw_params, config->channels)) < 0) {
-           err("%s c: cannot set channel count (%s)", device_name,snd_strerror (r));
-           goto open_failed;
-        }
+    /* fail before the negotiation if the probe cache knows the config is impossible */
+    if (caps && !probe_caps_check( caps, config, 0, reason, sizeof(reason) )) {
+        err("%s %c: %s (probe cache)", device_name, s, reason);
+        return -1;
+    }
 
-        dir = 0;
-        if ((r = snd_pcm_hw_params_set_period_size_near (*capture_handle, hw_params, &period_size, &dir)) < 0) {
-           err("%s c: cannot set period size (%s)", device_name,snd_strerror (r));
-           goto open_failed;
-        }
-        if (period_size != config->period) {
-            warn("%s c: period size %u can't be used. set to %u instead",device_name, config->period, (unsigned)period_size  );
-            config->period = period_size;
-        }
-        buffer_size = period_size * period_count;
-        dir=0;
-        if ((r = snd_pcm_hw_params_set_buffer_size_near (*capture_handle, hw_params, &buffer_size)) < 0) {
-           err("%s c: cannot set buffer time (%s)", device_name,snd_strerror (r));
-           goto open_failed;
-        }
+    if ((r = snd_pcm_hw_params_malloc (&hw_params)) < 0) {
+       err("%s %c: cannot allocate hardware parameter structure (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
+    }
 
-        if ((r = snd_pcm_hw_params (*capture_handle, hw_params)) < 0) {
-           err("%s c: cannot set capture parameters (%s)", device_name,snd_strerror (r));
-           goto open_failed;
-        }
+    if ((r = snd_pcm_hw_params_any (pcm, hw_params)) < 0) {
+       err("%s %c: cannot initialize hardware parameter structure (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
+    }
 
-        if ((r = snd_pcm_sw_params_malloc (&sw_params)) < 0) {
-               err("%s c: cannot allocate software parameters structure (%s)", device_name, snd_strerror (r));
-               goto open_failed;
-            }
-        if ((r = snd_pcm_sw_params_current (*capture_handle, sw_params)) < 0) {
-           err("%s c: cannot initialize software parameters structure (%s)", device_name,snd_strerror (r));
-           goto open_failed;
-        }
-        if ((r = snd_pcm_sw_params_set_avail_min (*capture_handle, sw_params, period_size)) < 0) {
-           err("%s c: cannot set minimum available count (%s)", device_name ,snd_strerror (r));
-           goto open_failed;
-        }
-        /*
-        if ((r = snd_pcm_sw_params_set_start_threshold (*capture_handle, sw_params, period)) < 0) {
-           err("cannot set start mode (%s)",snd_strerror (r));
-           goto open_failed;
-        }
-        */
-        if ((r = snd_pcm_sw_params (*capture_handle, sw_params)) < 0) {
-           err("%s c: cannot set software parameters (%s)", device_name,snd_strerror (r));
-           goto open_failed;
-        }
+    if ((r = snd_pcm_hw_params_set_access (pcm, hw_params, config->access)) < 0) {
+       err("%s %c: cannot set access type (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
+    }
 
-        snd_pcm_hw_params_free(hw_params);
-        snd_pcm_sw_params_free(sw_params);
-        hw_params = NULL;
-        sw_params = NULL;
+    if ((r = snd_pcm_hw_params_set_format (pcm, hw_params, config->format)) < 0) {
+       err("%s %c: cannot set sample format (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
+    }
 
+    if ((r = snd_pcm_hw_params_set_rate_near (pcm, hw_params, &config->rate, 0)) < 0) {
+       err("%s %c: cannot set sample rate (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
     }
 
-    if (playback_handle) {
-        if ((r = snd_pcm_open (playback_handle, device_name, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-           err("%s p: cannot open audio device (%s)",device_name,snd_strerror (r));
-           *playback_handle = NULL;
-           goto open_failed;
-        }
+    if ((r = snd_pcm_hw_params_set_channels (pcm, hw_params, config->channels)) < 0) {
+       err("%s %c: cannot set channel count (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
+    }
 
-        if ((r = snd_pcm_hw_params_malloc (&hw_params)) < 0) {
-           err("%s p: cannot allocate hardware parameter structure (%s)",device_name,snd_strerror (r));
-           goto open_failed;
-        }
+    dir = 0;
+    dbg("set period size: %d", (int)period_size);
+    if ((r = snd_pcm_hw_params_set_period_size_near (pcm, hw_params, &period_size, &dir)) < 0) {
+       err("%s %c: cannot set period size (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
+    }
+    if (period_size != config->period) {
+        warn("%s %c: period size %u can't be used. set to %u instead", device_name, s, config->period, (unsigned)period_size );
+        config->period = period_size;
+    }
+    buffer_size = period_size * period_count;
+    if ((r = snd_pcm_hw_params_set_buffer_size_near (pcm, hw_params, &buffer_size)) < 0) {
+       err("%s %c: cannot set buffer time (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
+    }
+    if (config->timer_sched && alsa_set_no_period_wakeup( device_name, pcm, hw_params ) < 0)
+        goto setup_failed;
 
-        if ((r = snd_pcm_hw_params_any (*playback_handle, hw_params)) < 0) {
-           err("%s p: cannot initialize hardware parameter structure (%s)",device_name,snd_strerror (r));
-           goto open_failed;
-        }
+    if ((r = snd_pcm_hw_params (pcm, hw_params)) < 0) {
+       err("%s %c: cannot set %s parameters (%s)", device_name, s, playback ? "playback" : "capture", snd_strerror (r));
+       goto setup_failed;
+    }
 
-        if ((r = snd_pcm_hw_params_set_access (*playback_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
-           err("%s p: cannot set access type (%s)",device_name,snd_strerror (r));
-           goto open_failed;
-        }
+    /*snd_pcm_dump_setup(dev->playback_handle, jcd_out);*/
 
-        if ((r = snd_pcm_hw_params_set_format (*playback_handle, hw_params, SND_PCM_FORMAT_S16_LE)) < 0) {
-           err("%s p: cannot set sample format (%s)",device_name, snd_strerror (r));
-           goto open_failed;
-        }
+    if ((r = snd_pcm_sw_params_malloc (&sw_params)) < 0) {
+       err("%s %c: cannot allocate software parameters structure (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
+    }
+    if ((r = snd_pcm_sw_params_current (pcm, sw_params)) < 0) {
+       err("%s %c: cannot initialize software parameters structure (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
+    }
+    if ((r = snd_pcm_sw_params_set_avail_min (pcm, sw_params, period_size)) < 0) {
+       err("%s %c: cannot set minimum available count (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
+    }
+    if (playback && (r = snd_pcm_sw_params_set_start_threshold (pcm, sw_params,
+            alsa_start_threshold( config, period_size, buffer_size ))) < 0) {
+       err("%s %c: cannot set start mode (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
+    }
+    if (config->tstamp && alsa_set_tstamp( device_name, pcm, sw_params ) < 0)
+        goto setup_failed;
+    if ((r = snd_pcm_sw_params (pcm, sw_params)) < 0) {
+       err("%s %c: cannot set software parameters (%s)", device_name, s, snd_strerror (r));
+       goto setup_failed;
+    }
+    snd_pcm_hw_params_free(hw_params);
+    snd_pcm_sw_params_free(sw_params);
+    return 0;
 
-        if ((r = snd_pcm_hw_params_set_rate_near (*playback_handle, hw_params, &config->rate, 0)) < 0) {
-           err("%s p: cannot set sample rate (%s)",device_name,snd_strerror (r));
-           goto open_failed;
-        }
+setup_failed:
+    if (hw_params) snd_pcm_hw_params_free(hw_params);
+    if (sw_params) snd_pcm_sw_params_free(sw_params);
+    return -1;
+}
 
-        if ((r = snd_pcm_hw_params_set_channels (*playback_handle, hw_params, config->channels)) < 0) {
-           err("%s p: cannot set channel count (%s)",device_name, snd_strerror (r));
-           goto open_failed;
-        }
 
-        dir = 0;
-        dbg("set period size: %d", (int)period_size);
-        if ((r = snd_pcm_hw_params_set_period_size_near (*playback_handle, hw_params, &period_size, &dir)) < 0) {
-           err("%s p: cannot set period size (%s)",device_name,snd_strerror (r));
-           goto open_failed;
-        }
-        if (period_size != config->period) {
-             warn("%s p: period size %d can't be used. set to %d instead",device_name, config->period, (int)period_size );
-             config->period = period_size;
-        }
-        /*
-        if ((r = snd_pcm_hw_params_set_periods (*playback_handle, hw_params, 2, 0)) < 0) {
-           err("%s p: cannot set number of periods (%s)",device_name, snd_strerror (r));
-           goto open_failed;
-        }
-        */
-        buffer_size = period_size * period_count;
-        dir=0;
-        if ((r = snd_pcm_hw_params_set_buffer_size_near (*playback_handle, hw_params, &buffer_size)) < 0) {
-           err("%s p: cannot set buffer time (%s)",device_name, snd_strerror (r));
-           goto open_failed;
-        }
+int alsa_device_reconfigure( const char *device_name, struct alsa_config *config, snd_pcm_t *pcm,
+        const struct probe_caps *caps )
+{
+    int r;
 
+    snd_pcm_drop( pcm );
+    if ((r = snd_pcm_hw_free( pcm )) < 0) {
+        err("%s: cannot free the hardware parameters (%s)", device_name, snd_strerror (r));
+        return -1;
+    }
+    return alsa_device_setup( device_name, config, pcm, caps );
+}
 
-        if ((r = snd_pcm_hw_params (*playback_handle, hw_params)) < 0) {
-           err("%s p: cannot set playback parameters (%s)",device_name,snd_strerror (r));
-           goto open_failed;
-        }
 
-        /*snd_pcm_dump_setup(dev->playback_handle, jcd_out);*/
+int alsa_device_open( const char *device_name, struct alsa_config *config,
+        snd_pcm_t **capture_handle, snd_pcm_t **playback_handle )
+{
+    int mode = config->timer_sched ? SND_PCM_NO_PERIOD_WAKEUP : 0;
+    int r;
 
+    if (capture_handle) *capture_handle = NULL;
+    if (playback_handle) *playback_handle = NULL;
 
-        if ((r = snd_pcm_sw_params_malloc (&sw_params)) < 0) {
-           err("%s p: cannot allocate software parameters structure (%s)",device_name ,snd_strerror (r));
-           goto open_failed;
-        }
-        if ((r = snd_pcm_sw_params_current (*playback_handle, sw_params)) < 0) {
-           err("%s p: cannot initialize software parameters structure (%s)",device_name,snd_strerror (r));
-           goto open_failed;
-        }
-        if ((r = snd_pcm_sw_params_set_avail_min (*playback_handle, sw_params, period_size)) < 0) {
-           err("%s p: cannot set minimum available count (%s)",device_name,snd_strerror (r));
-           goto open_failed;
-        }
-        if ((r = snd_pcm_sw_params_set_start_threshold (*playback_handle, sw_params, (period_count -1) * period_size)) < 0) {
-           err("%s p: cannot set start mode (%s)",device_name,snd_strerror (r));
+    if (capture_handle) {
+        if ((r = snd_pcm_open (capture_handle, device_name, SND_PCM_STREAM_CAPTURE, mode)) < 0) {
+           err( "%s c: cannot open audio device(%s)", device_name, snd_strerror (r));
+           *capture_handle = NULL;
            goto open_failed;
         }
-        if ((r = snd_pcm_sw_params (*playback_handle, sw_params)) < 0) {
-           err("%s p: cannot set software parameters (%s)",device_name,snd_strerror (r));
+        if (alsa_device_setup( device_name, config, *capture_handle,
+                probe_cache_find( *capture_handle, device_name ) ) < 0)
+            goto open_failed;
+    }
+
+    if (playback_handle) {
+        if ((r = snd_pcm_open (playback_handle, device_name, SND_PCM_STREAM_PLAYBACK, mode)) < 0) {
+           err("%s p: cannot open audio device (%s)",device_name,snd_strerror (r));
+           *playback_handle = NULL;
            goto open_failed;
         }
-        snd_pcm_hw_params_free(hw_params);
-        snd_pcm_sw_params_free(sw_params);
-        hw_params = NULL;
-        sw_params = NULL;
+        if (alsa_device_setup( device_name, config, *playback_handle,
+                probe_cache_find( *playback_handle, device_name ) ) < 0)
+            goto open_failed;
     }
 
     if (capture_handle && playback_handle && config->linking_capture_playback) {
@@ -307,8 +381,6 @@ int alsa_device_open( const char *device_name, struct alsa_config *config,
     return 0;
 
 open_failed:
-    if (hw_params) snd_pcm_hw_params_free(hw_params);
-    if (sw_params) snd_pcm_sw_params_free(sw_params);
     if (capture_handle && *capture_handle) {
         snd_pcm_close(*capture_handle);
         *capture_handle = NULL;
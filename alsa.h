@@ -22,12 +22,30 @@ struct alsa_config {
     unsigned int rate;
     snd_pcm_format_t format;
 
+    /* SND_PCM_ACCESS_RW_INTERLEAVED (default), RW_NONINTERLEAVED, MMAP_INTERLEAVED or MMAP_NONINTERLEAVED */
+    snd_pcm_access_t access;
+
     unsigned int period;
     unsigned int buffer_period_count;
 
+    /* playback start threshold, in frames (0: buffer_period_count - 1 periods) */
+    unsigned int start_threshold;
+
     /* set to 1 to open the capture and playback in linked mode */
     unsigned linking_capture_playback;
 
+    /* set to 1 to enable the (CLOCK_MONOTONIC) audio timestamps, see snd_pcm_htimestamp() */
+    unsigned tstamp;
+
+    /*
+     * set to 1 for the timer scheduled mode: the PCM is opened without the period
+     * wake ups (SND_PCM_NO_PERIOD_WAKEUP), and the test wakes up from a timer every period.
+     * The playback keeps 'timer_target' frames queued (0: half the buffer), which is also
+     * its start threshold. The buffer should be large (buffer_period_count).
+     */
+    unsigned timer_sched;
+    unsigned timer_target;
+
 
     /*
      * scheduler priority to use
@@ -52,9 +70,14 @@ struct alsa_config {
  *    rate = 48000
  *    period = 960  (20ms)
  *    buffer_period_count = 2
- *    format = S16_LE
+ *    start_threshold = 0  (buffer_period_count - 1 periods)
+ *    format = S16_LE  (S24_LE, S32_LE, S24_3LE and FLOAT_LE are also supported)
+ *    access = RW_INTERLEAVED  ('mmap=1' for MMAP, 'interleaved=0' for NONINTERLEAVED)
  *
  *    linking_capture_playback = 0
+ *    tstamp = 0
+ *    timer_sched = 0
+ *    timer_target = 0
  *
  *
  */
@@ -65,6 +88,15 @@ void alsa_config_init( struct alsa_config *config, const char *config_path );
 void alsa_config_dump( struct alsa_config *config );
 
 
+/*
+ * access type helpers:
+ * alsa_access() returns the access type matching the mmap and interleaved flags
+ */
+snd_pcm_access_t alsa_access( int mmap, int interleaved );
+int alsa_access_is_mmap( snd_pcm_access_t access );
+int alsa_access_is_interleaved( snd_pcm_access_t access );
+
+
 
 /*
  * Open an alsa device for capture and/or playback.
@@ -73,6 +105,7 @@ void alsa_config_dump( struct alsa_config *config );
  *
  * use 'config' and try to use the provided parameters to setup the streams.
  * Parameters (rate, period) can be modified to match the possibilities of the hardware.
+ * In timer scheduled mode, timer_target is set to the actual fill target.
  *
  * return 0 on success
  */
@@ -80,5 +113,30 @@ int alsa_device_open( const char *device, struct alsa_config *config,
         snd_pcm_t **capture_handle, snd_pcm_t **playback_handle );
 
 
+struct probe_caps;
+
+/*
+ * setup the hw and sw params of an open PCM (capture or playback), as done by
+ * alsa_device_open(). 'config' is updated the same way.
+ * 'caps' are the cached capabilities of the PCM, looked up once after the open
+ * (see probe_cache_find()), to fail before the negotiation. NULL if unknown.
+ *
+ * return 0 on success
+ */
+int alsa_device_setup( const char *device, struct alsa_config *config, snd_pcm_t *pcm,
+        const struct probe_caps *caps );
+
+
+/*
+ * setup again an open PCM with a new config, without closing it:
+ * the stream is stopped, and its hw params released (snd_pcm_hw_free())
+ * before alsa_device_setup().
+ *
+ * return 0 on success
+ */
+int alsa_device_reconfigure( const char *device, struct alsa_config *config, snd_pcm_t *pcm,
+        const struct probe_caps *caps );
+
+
 
 #endif //__alsa_h__
@@ -12,7 +12,7 @@
 #include <errno.h>
 #include <string.h>
 #include <getopt.h>
-#include <sched.h>
+#include <unistd.h>
 #include <ev.h>
 
 
@@ -22,10 +22,35 @@
 #include "playback.h"
 #include "capture.h"
 #include "loopback_delay.h"
+#include "sync_capture.h"
+#include "latency_search.h"
+#include "matrix.h"
+#include "probe.h"
+#include "worker.h"
+#include "hist.h"
 
 
 struct ev_loop *loop = NULL;
 
+static struct test **tests = NULL;
+static int tests_count = 0;
+
+/* with -j, the tests run in the worker threads */
+static struct worker *workers = NULL;
+static int workers_count = 0;
+
+
+/* print the statistics of every test */
+static void report_tests( void ) {
+    int i;
+    for (i=0; i < tests_count; i++) {
+        struct test *t = tests[i];
+        if (t->ops->report)
+            t->ops->report( t );
+    }
+    /* the streams drift against each other */
+    stream_stats_print_relative();
+}
 
 
 
@@ -58,6 +83,20 @@ static void on_stdin( struct ev_loop *loop, struct ev_io *w, int revents ) {
             ev_unloop( loop, EVUNLOOP_ALL);
             return;
         }
+        if (!strcmp(pipecmd, "s")) {
+            if (workers_count) {
+                /*
+                 * the workers keep updating their tests: each one reports its own
+                 * tests from its thread. No relative drift, as it compares streams
+                 * of different workers
+                 */
+                int i;
+                for (i=0; i < workers_count; i++)
+                    worker_report( &workers[i] );
+            } else {
+                report_tests();
+            }
+        }
 
 
         /* reset the pipecmd */
@@ -89,53 +128,249 @@ static void on_duration_timer( struct ev_loop *loop, struct ev_timer *w, int rev
 }
 
 
+/*
+ * stop request coming from any thread (worker loop exit, assert)
+ */
+static ev_async evw_stop;
+static void on_stop_async( struct ev_loop *loop, struct ev_async *w, int revents ) {
+    ev_unloop(loop, EVUNLOOP_ALL);
+}
+
+static void worker_exited(void) {
+    ev_async_send(loop, &evw_stop);
+}
+
+
 static void seq_error_assert(void) {
     dbg("stop on first error");
-    ev_unloop(loop, EVUNLOOP_ALL);
+    ev_async_send(loop, &evw_stop);
 }
 
 void usage(void) {
     puts(
         "usage: atest OPTIONS -- TEST [test options] ...\n"
+        "       atest OPTIONS probe [NAME ...]\n"
         "OPTIONS:\n"
         "-r, --rate=#             sample rate\n"
-        "-c, --channels=#         channels (max 32)\n"
+        "-c, --channels=#         channels (max 256)\n"
         "-p, --period=FRAMES      period size in number of frames\n"
+        "-b, --buffer=N           buffer size in number of periods\n"
+        "-f, --format=FORMAT      sample format: S16_LE (default), S24_LE, S32_LE, S24_3LE, FLOAT_LE\n"
+        "-m, --mmap               use the mmap access (generate and check the frames in the DMA buffer)\n"
+        "-n, --non-interleaved    use non interleaved buffers (one buffer per channel)\n"
+        "-T, --timer=FRAMES       timer scheduled mode: no period wake up, the play and capture\n"
+        "                         tests wake up from a timer every period, and the playback\n"
+        "                         keeps FRAMES queued (0: half the buffer). use a large buffer\n"
         "-D, --device=NAME        select PCM by name\n"
         "-C, --config=FILE        use this particular config file\n"
+        "-K, --cache=FILE         probe cache file (default ~/.atest.cache)\n"
         "-P, --priority=PRIORITY  process priority to set ('fifo,N' 'rr,N' 'other,N')\n"
         "-d, --duration=SECONDS   stop the test after SECONDS\n"
         "-a, --assert             stop on first error detected\n"
         "-I, --invalid-log-size=N how many frames are logged on error (default 1)\n"
+        "-k, --track-channels     lock on the frame number of every channel, and report the\n"
+        "                         channels shifted relative to channel 0 (instead of invalid frames)\n"
+        "-X, --long-sequence      carry a 64 bits frame position in the sequence, to detect the\n"
+        "                         drops of a multiple of the frame number cycle (2048 frames)\n"
+        "                         (must be set on both the playback and the capture side)\n"
+        "-L, --async-log          log from a background thread, with timestamps (keeps printf\n"
+        "                         out of the audio path)\n"
+        "-l, --log-rate=N         print at most N messages per second from the same log call\n"
+        "-j, --threads=N          run the tests on N threads, each with its own event loop\n"
+        "                         and pinned to one CPU. tests are distributed round robin\n"
         "\n"
         "TEST\n"
+        "  every test accepts those options, overriding the global ones for this test only:\n"
+        "               -D NAME   select PCM by name\n"
+        "               -R N      sample rate (or --rate=N)\n"
+        "               -c N      channels\n"
+        "               -p N      period size in number of frames\n"
+        "\n"
+        "  every stream moves every available frame at each wake up, and reports its wake up\n"
+        "  interval, avail, callback duration and frames per wake up statistics,\n"
+        "  its measured sample rate and drift (ppm), and the relative drift between streams\n"
+        "  at exit, or when the 's' command is read on stdin. The capture side also reports\n"
+        "  the sequence errors by type: dropped or repeated frames, channel rotation, byte or\n"
+        "  word swap, stuck bits, truncation, or corrupted frames\n"
+        "\n"
         "  play      continuously generate the sequence steam\n"
         "     options:  -x N      simulate a xrun every N ms\n"
         "               -r N,M    stop after N ms of playback,  and restart after M ms\n"
+        "               -z        zero copy: write directly from the pre-generated sequence\n"
         "\n"
         "  capture   continuously check the received frame sequence\n"
         "     options:  -x N      simulate a xrun every N ms\n"
         "               -r N,M    stop after N ms of playback,  and restart after M ms\n"
+        "               -q N      check the frames from a low priority thread, through\n"
+        "                         a ring of N periods (dropped and reported on overrun)\n"
         "\n"
         "  loopback_delay   measure the loopback trip time\n"
         "     options:  -a N      assert that the loopback delay equal N frames\n"
         "               -s MODE   start mode: (capture)/play/link\n"
+        "               -x N      simulate a xrun every N ms\n"
+        "               -r N,M    stop after N ms,  and restart after M ms\n"
+        "                         the delay is measured again after every xrun or restart\n"
+        "               -C NAME   capture from the PCM NAME, wired to the output of the test PCM\n"
+        "                         (link mode falls back to 'play' if the PCMs can't be linked)\n"
+        "               -t        use the audio timestamps to split the round trip into\n"
+        "                         playback buffer, hardware and capture buffer latencies\n"
+        "\n"
+        "  sync_capture   capture the same sequence from several PCMs, and measure their\n"
+        "                 frame alignment (skew) against the first one\n"
+        "     options:  -C NAME   also capture from the PCM NAME (up to 8 PCMs)\n"
+        "               -l        start the PCMs at once with snd_pcm_link()\n"
+        "                         (started one after the other if they can't be linked)\n"
+        "               -a N      assert that the skews stay within +/-N frames\n"
+        "\n"
+        "  latency_search   run the playback with every combination of periods, buffer\n"
+        "                   sizes and start thresholds, from the smallest buffer, and report\n"
+        "                   the smallest buffer running without xrun. The PCM is set up again\n"
+        "                   between the points (snd_pcm_hw_free()), not reopened\n"
+        "     options:  -P N,..   period sizes, in frames (default: the test period)\n"
+        "               -B N,..   buffer sizes, in periods (default: the buffer size)\n"
+        "               -S N,..   playback start thresholds, in frames (0: buffer minus a period)\n"
+        "               -s N      run every point during N seconds (default 10)\n"
+        "               -x N      accept up to N xruns per minute (default 0)\n"
+        "               -i        search on the capture instead of the playback\n"
+        "               -f        stop at the first stable point\n"
+        "\n"
+        "  matrix   run the sequence with every combination of rates, channel counts and\n"
+        "           periods in one process: the PCMs stay open, and are set up again\n"
+        "           (snd_pcm_hw_free()) for every point. A point passes without xrun, and\n"
+        "           with the captured sequence received without error\n"
+        "     options:  -r N,..   sample rates (default: the test rate)\n"
+        "               -n N,..   channel counts (default: the test channels)\n"
+        "               -P N,..   period sizes, in frames (default: the test period)\n"
+        "               -s N      run every point during N seconds (default 5)\n"
+        "               -m MODE   (loop): play on the test PCM and capture from the PCM\n"
+        "                         wired to it, play: playback only, capture: capture only\n"
+        "               -C NAME   loop mode: capture from the PCM NAME (default: the test PCM)\n"
+        "\n"
+        "PROBE\n"
+        "  probe the formats, access types, rates, channels, period and buffer sizes supported\n"
+        "  by the PCMs NAME (default: the -D PCM), for playback and capture, and save them in\n"
+        "  the probe cache, keyed by card and device. The configs are then checked against the\n"
+        "  cache before being set up, and the matrix and latency_search tests skip the points\n"
+        "  not supported\n"
         );
     exit(1);
 
 }
 
 
+/*
+ * 'atest probe [NAME ...]': probe the capabilities of the PCMs (default: the
+ * test PCM), print them and update the cache.
+ * return the exit status: 1 if no PCM stream could be probed
+ */
+static int probe_command( int argc, char * const argv[], const char *default_device, const char *cache_path ) {
+    static const snd_pcm_stream_t streams[] = { SND_PCM_STREAM_PLAYBACK, SND_PCM_STREAM_CAPTURE };
+    const char *device = default_device;
+    unsigned probed = 0, i;
+    int n = 0;
+
+    do {
+        if (argc)
+            device = argv[n];
+        for (i = 0; i < 2; i++) {
+            struct probe_caps caps;
+            if (probe_device( device, streams[i], &caps ) < 0)
+                continue;
+            probe_caps_print( &caps, device );
+            if (probe_cache_update( &caps ) < 0)
+                return 1;
+            probed++;
+        }
+    } while (++n < argc);
+
+    if (!probed) {
+        err("no PCM could be probed");
+        return 1;
+    }
+    return probe_cache_save( cache_path ) < 0;
+}
+
+
+/*
+ * parse a comma separated list of at most 'max' values
+ * return the number of values, -1 on error
+ */
+static int parse_list( const char *arg, unsigned *values, unsigned max ) {
+    unsigned count = 0;
+    char *end;
+
+    while (*arg) {
+        if (count == max)
+            return -1;
+        values[count++] = strtoul( arg, &end, 0 );
+        if (end == arg || (*end && *end != ','))
+            return -1;
+        arg = *end ? end + 1 : end;
+    }
+    return count;
+}
+
+
+/*
+ * per test stream options, overriding the global config for one test
+ */
+#define TEST_STREAM_OPTS "D:R:c:p:"
+
+static const struct option test_stream_options[] = {
+    { "device", 1, NULL, 'D' },
+    { "rate", 1, NULL, 'R' },
+    { "channels", 1, NULL, 'c' },
+    { "period", 1, NULL, 'p' },
+    { NULL, 0, NULL, 0 }
+};
+
+/*
+ * apply the per test stream option 'opt' to 'config'
+ * return 0 if 'opt' is not a stream option
+ */
+static int parse_test_stream_opt( int opt, const char *arg, struct alsa_config *config ) {
+    switch (opt) {
+    case 'D':
+        strncpy( config->device, arg, sizeof(config->device)-1 );
+        config->device[ sizeof(config->device)-1 ] = '\0';
+        break;
+    case 'R':
+        config->rate = atoi(arg);
+        break;
+    case 'c':
+        config->channels = atoi(arg);
+        break;
+    case 'p':
+        config->period = atoi(arg);
+        break;
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+
 const struct option options[] = {
     { "rate", 1, NULL, 'r' },
     { "channels", 1, NULL, 'c' },
     { "period", 1, NULL, 'p' },
+    { "buffer", 1, NULL, 'b' },
+    { "format", 1, NULL, 'f' },
+    { "mmap", 0, NULL, 'm' },
+    { "non-interleaved", 0, NULL, 'n' },
+    { "timer", 1, NULL, 'T' },
     { "device", 1, NULL, 'D' },
     { "config", 1, NULL, 'C' },
+    { "cache", 1, NULL, 'K' },
     { "priority", 1, NULL, 'P' },
     { "duration", 1, NULL, 'd' },
     { "assert", 0, NULL, 'a' },
     { "invalid-log-size", 0, NULL, 'I' },
+    { "track-channels", 0, NULL, 'k' },
+    { "long-sequence", 0, NULL, 'X' },
+    { "threads", 1, NULL, 'j' },
+    { "async-log", 0, NULL, 'L' },
+    { "log-rate", 1, NULL, 'l' },
     { NULL, 0, NULL, 0 }
 };
 
@@ -146,11 +381,18 @@ int main(int argc, char * const argv[]) {
     int opt_rate = -1;
     int opt_channels = -1;
     int opt_period = 0;
+    int opt_buffer = 0;
+    int opt_timer = -1;
+    snd_pcm_format_t opt_format = SND_PCM_FORMAT_UNKNOWN;
+    int opt_mmap = 0;
+    int opt_non_interleaved = 0;
     int opt_duration = 0;
     int opt_assert = 0;
     int opt_invalid_log_size = 0;
+    int opt_threads = 0;
     const char *opt_device = NULL;
     const char *opt_config = NULL;
+    const char *opt_cache = PROBE_CACHE_DEFAULT;
     const char *opt_priority = NULL;
     const char *default_dev = "default";
     struct alsa_config config;
@@ -161,7 +403,7 @@ int main(int argc, char * const argv[]) {
     loop = ev_default_loop(0);
 
     while (1) {
-        if ((result = getopt_long( argc, argv, "+r:c:p:D:C:P:d:aI:", options, &opt_index )) == EOF) break;
+        if ((result = getopt_long( argc, argv, "+r:c:p:b:f:mnT:D:C:K:P:d:aI:kXj:Ll:", options, &opt_index )) == EOF) break;
         switch (result) {
         case '?':
             usage();
@@ -175,6 +417,25 @@ int main(int argc, char * const argv[]) {
         case 'p':
             opt_period = atoi(optarg);
             break;
+        case 'b':
+            opt_buffer = atoi(optarg);
+            break;
+        case 'T':
+            opt_timer = atoi(optarg);
+            break;
+        case 'f':
+            opt_format = snd_pcm_format_value(optarg);
+            if (!seq_format_supported(opt_format)) {
+                printf("unsupported format '%s'\n", optarg);
+                usage();
+            }
+            break;
+        case 'm':
+            opt_mmap = 1;
+            break;
+        case 'n':
+            opt_non_interleaved = 1;
+            break;
         case 'd':
             opt_duration = atoi(optarg);
             break;
@@ -184,6 +445,9 @@ int main(int argc, char * const argv[]) {
         case 'C':
             opt_config = optarg;
             break;
+        case 'K':
+            opt_cache = optarg;
+            break;
         case 'P':
             opt_priority = optarg;
             break;
@@ -193,6 +457,22 @@ int main(int argc, char * const argv[]) {
         case 'I':
             opt_invalid_log_size = atoi(optarg);
             break;
+        case 'k':
+            seq_channel_tracking = 1;
+            break;
+        case 'X':
+            seq_long_position = 1;
+            break;
+        case 'j':
+            opt_threads = atoi(optarg);
+            break;
+        case 'L':
+            if (log_async_start())
+                exit(1);
+            break;
+        case 'l':
+            log_rate_limit = atoi(optarg);
+            break;
         }
     }
 
@@ -201,6 +481,15 @@ int main(int argc, char * const argv[]) {
     if (opt_rate > 0) config.rate = opt_rate;
     if (opt_channels > 0) config.channels = opt_channels;
     if (opt_period > 0) config.period = opt_period;
+    if (opt_buffer > 0) config.buffer_period_count = opt_buffer;
+    if (opt_timer >= 0) {
+        config.timer_sched = 1;
+        config.timer_target = opt_timer;
+    }
+    if (opt_format != SND_PCM_FORMAT_UNKNOWN) config.format = opt_format;
+    if (opt_mmap || opt_non_interleaved)
+        config.access = alsa_access( opt_mmap || alsa_access_is_mmap( config.access ),
+                !opt_non_interleaved && alsa_access_is_interleaved( config.access ));
     if (opt_device) { strncpy( config.device, opt_device, sizeof(config.device)-1 ); config.device[ sizeof(config.device)-1 ] = '\0'; }
     if (opt_priority) { strncpy( config.priority, opt_priority, sizeof(config.priority)-1 ); config.priority[ sizeof(config.priority)-1 ] = '\0'; }
 
@@ -210,21 +499,25 @@ int main(int argc, char * const argv[]) {
 
     dbg("dev: '%s'", config.device);
 
-#define MAX_TESTS 2
-    struct test *tests[MAX_TESTS];
-    int tests_count = 0;
+    /* the known capabilities of the PCMs, see 'atest probe' */
+    if (probe_cache_load( opt_cache ) < 0)
+        exit(1);
 
     /* build the tests objects */
     argc -= optind;
     argv += optind;
 
+    if (argc && !strcmp( argv[0], "probe" ))
+        exit( probe_command( argc - 1, argv + 1, config.device, opt_cache ) );
+
     while (argc) {
         struct test *t = NULL;
+        struct alsa_config test_config = config;
         if (!strcmp( argv[0], "play" )) {
             struct playback_create_opts opts = {0};
             optind = 1;
             while (1) {
-                if ((result = getopt( argc, argv, "+x:r:" )) == EOF) break;
+                if ((result = getopt_long( argc, argv, "+x:r:z" TEST_STREAM_OPTS, test_stream_options, NULL )) == EOF) break;
                 switch (result) {
                 case '?':
                     printf("invalid option '%s' for test 'play'\n", optarg);
@@ -240,11 +533,17 @@ int main(int argc, char * const argv[]) {
                     }
                     dbg("%d,%d", opts.restart_play_time, opts.restart_pause_time);
                     break;
+                case 'z':
+                    opts.zero_copy = 1;
+                    break;
+                default:
+                    parse_test_stream_opt( result, optarg, &test_config );
+                    break;
                 }
             }
             argc -= optind-1;
             argv += optind-1;
-            t = playback_create( &config, &opts );
+            t = playback_create( &test_config, &opts );
             if (!t) {
                 err("failed to create a playback test");
                 exit(1);
@@ -253,7 +552,7 @@ int main(int argc, char * const argv[]) {
             struct capture_create_opts opts = {0};
             optind = 1;
             while (1) {
-                if ((result = getopt( argc, argv, "+x:r:" )) == EOF) break;
+                if ((result = getopt_long( argc, argv, "+x:r:q:" TEST_STREAM_OPTS, test_stream_options, NULL )) == EOF) break;
                 switch (result) {
                 case '?':
                     printf("invalid option '%s' for test 'capture'\n", optarg);
@@ -269,11 +568,17 @@ int main(int argc, char * const argv[]) {
                     }
                     dbg("%d,%d", opts.restart_play_time, opts.restart_pause_time);
                     break;
+                case 'q':
+                    opts.queue = atoi(optarg);
+                    break;
+                default:
+                    parse_test_stream_opt( result, optarg, &test_config );
+                    break;
                 }
             }
             argc -= optind-1;
             argv += optind-1;
-            t = capture_create( &config, &opts );
+            t = capture_create( &test_config, &opts );
             if (!t) {
                 err("failed to create a capture test");
                 exit(1);
@@ -282,7 +587,7 @@ int main(int argc, char * const argv[]) {
             struct loopback_delay_create_opts opts = {0};
             optind = 1;
             while (1) {
-                if ((result = getopt( argc, argv, "+a:s:x:" )) == EOF) break;
+                if ((result = getopt_long( argc, argv, "+a:s:x:r:tC:" TEST_STREAM_OPTS, test_stream_options, NULL )) == EOF) break;
                 switch (result) {
                 case '?':
                     printf("invalid option '%s' for test 'loopback_delay'\n", optarg);
@@ -304,20 +609,183 @@ int main(int argc, char * const argv[]) {
                         usage();
                     }
                     break;
+                case 't':
+                    opts.timestamps = 1;
+                    break;
+                case 'C':
+                    strncpy( opts.capture_device, optarg, sizeof(opts.capture_device)-1 );
+                    break;
+                case 'x':
+                    opts.xrun = atoi(optarg);
+                    break;
+                case 'r':
+                    if (sscanf(optarg, "%d,%d", &opts.restart_play_time, &opts.restart_pause_time) != 2) {
+                        printf("invalid value '%s' for test 'loopback_delay' option '-r'\n", optarg);
+                        usage();
+                    }
+                    break;
+                default:
+                    parse_test_stream_opt( result, optarg, &test_config );
+                    break;
                 }
             }
             argc -= optind-1;
             argv += optind-1;
-            t = loopback_delay_create( &config, &opts );
+            t = loopback_delay_create( &test_config, &opts );
             if (!t) {
                 err("failed to create a capture test");
                 exit(1);
             }
+        } else if (!strcmp( argv[0], "sync_capture" )) {
+            struct sync_capture_create_opts opts = {0};
+            optind = 1;
+            while (1) {
+                if ((result = getopt_long( argc, argv, "+C:la:" TEST_STREAM_OPTS, test_stream_options, NULL )) == EOF) break;
+                switch (result) {
+                case '?':
+                    printf("invalid option '%s' for test 'sync_capture'\n", optarg);
+                    usage();
+                    break;
+                case 'C':
+                    if (opts.devices_count >= SYNC_CAPTURE_MAX_STREAMS - 1) {
+                        printf("too many PCMs for test 'sync_capture' (max %d)\n", SYNC_CAPTURE_MAX_STREAMS);
+                        usage();
+                    }
+                    strncpy( opts.devices[opts.devices_count++], optarg, sizeof(opts.devices[0])-1 );
+                    break;
+                case 'l':
+                    opts.link = 1;
+                    break;
+                case 'a':
+                    opts.assert_skew = 1;
+                    opts.max_skew = atoi(optarg);
+                    break;
+                default:
+                    parse_test_stream_opt( result, optarg, &test_config );
+                    break;
+                }
+            }
+            argc -= optind-1;
+            argv += optind-1;
+            t = sync_capture_create( &test_config, &opts );
+            if (!t) {
+                err("failed to create a sync_capture test");
+                exit(1);
+            }
+        } else if (!strcmp( argv[0], "latency_search" )) {
+            struct latency_search_create_opts opts = {0};
+            int n;
+            optind = 1;
+            while (1) {
+                if ((result = getopt_long( argc, argv, "+P:B:S:s:x:if" TEST_STREAM_OPTS, test_stream_options, NULL )) == EOF) break;
+                switch (result) {
+                case '?':
+                    printf("invalid option '%s' for test 'latency_search'\n", optarg);
+                    usage();
+                    break;
+                case 'P':
+                case 'B':
+                case 'S': {
+                    unsigned *values = result == 'P' ? opts.periods : result == 'B' ? opts.counts : opts.thresholds;
+                    if ((n = parse_list( optarg, values, LATENCY_SEARCH_MAX_VALUES )) <= 0) {
+                        printf("invalid list '%s' for test 'latency_search' option '-%c' (max %d values)\n",
+                                optarg, result, LATENCY_SEARCH_MAX_VALUES);
+                        usage();
+                    }
+                    if (result == 'P')
+                        opts.periods_count = n;
+                    else if (result == 'B')
+                        opts.counts_count = n;
+                    else
+                        opts.thresholds_count = n;
+                } break;
+                case 's':
+                    opts.soak_time = atoi(optarg);
+                    break;
+                case 'x':
+                    opts.max_xrun_rate = atof(optarg);
+                    break;
+                case 'i':
+                    opts.capture = 1;
+                    break;
+                case 'f':
+                    opts.first_stable = 1;
+                    break;
+                default:
+                    parse_test_stream_opt( result, optarg, &test_config );
+                    break;
+                }
+            }
+            argc -= optind-1;
+            argv += optind-1;
+            t = latency_search_create( &test_config, &opts );
+            if (!t) {
+                err("failed to create a latency_search test");
+                exit(1);
+            }
+        } else if (!strcmp( argv[0], "matrix" )) {
+            struct matrix_create_opts opts = {0};
+            int n;
+            optind = 1;
+            while (1) {
+                if ((result = getopt_long( argc, argv, "+r:n:P:s:m:C:" TEST_STREAM_OPTS, test_stream_options, NULL )) == EOF) break;
+                switch (result) {
+                case '?':
+                    printf("invalid option '%s' for test 'matrix'\n", optarg);
+                    usage();
+                    break;
+                case 'r':
+                case 'n':
+                case 'P': {
+                    unsigned *values = result == 'r' ? opts.rates : result == 'n' ? opts.channels : opts.periods;
+                    if ((n = parse_list( optarg, values, MATRIX_MAX_VALUES )) <= 0) {
+                        printf("invalid list '%s' for test 'matrix' option '-%c' (max %d values)\n",
+                                optarg, result, MATRIX_MAX_VALUES);
+                        usage();
+                    }
+                    if (result == 'r')
+                        opts.rates_count = n;
+                    else if (result == 'n')
+                        opts.channels_count = n;
+                    else
+                        opts.periods_count = n;
+                } break;
+                case 's':
+                    opts.point_time = atoi(optarg);
+                    break;
+                case 'm':
+                    if (!strcmp(optarg, "loop"))
+                        opts.mode = MATRIX_LOOP;
+                    else if (!strcmp(optarg, "play"))
+                        opts.mode = MATRIX_PLAY;
+                    else if (!strcmp(optarg, "capture"))
+                        opts.mode = MATRIX_CAPTURE;
+                    else {
+                        printf("invalid value '%s' for test 'matrix' option '-m'\n", optarg);
+                        usage();
+                    }
+                    break;
+                case 'C':
+                    strncpy( opts.capture_device, optarg, sizeof(opts.capture_device)-1 );
+                    break;
+                default:
+                    parse_test_stream_opt( result, optarg, &test_config );
+                    break;
+                }
+            }
+            argc -= optind-1;
+            argv += optind-1;
+            t = matrix_create( &test_config, &opts );
+            if (!t) {
+                err("failed to create a matrix test");
+                exit(1);
+            }
         }
 
         if (t) {
-            if (tests_count >= MAX_TESTS) {
-                err("too many tests defined.");
+            tests = realloc( tests, (tests_count + 1) * sizeof(*tests) );
+            if (!tests) {
+                err("can't allocate the test list");
                 exit(1);
             }
             tests[tests_count++] = t;
@@ -334,43 +802,61 @@ int main(int argc, char * const argv[]) {
     }
 
     /* change the scheduling priority is required */
-    if (config.priority[0]) {
-        int p;
-        if (sscanf(config.priority, "fifo,%d", &p )==1) {
-            struct sched_param param;
-            param.sched_priority = p;
-
-            dbg("priority: fifo,%d", p);
-            if (sched_setscheduler(0, SCHED_FIFO, &param))
-               err("sched_setscheduler");
-        } else if (sscanf(config.priority, "rr,%d", &p )==1) {
-            struct sched_param param;
-            param.sched_priority = p;
-
-            dbg("priority: rr,%d", p);
-            if (sched_setscheduler(0, SCHED_RR, &param))
-                err("sched_setscheduler");
-        } else if (sscanf(config.priority, "other,%d", &p )==1) {
-            struct sched_param param;
-            param.sched_priority = p;
-
-            dbg("priority: other,%d", p);
-            if (sched_setscheduler(0, SCHED_OTHER, &param))
-                err("sched_setscheduler");
-        } else {
-            printf("Invalid priority '%s'\n", config.priority);
-        }
+    if (config.priority[0])
+        thread_set_priority( pthread_self(), config.priority );
+
+    /* the async stop watcher must be ready before any worker can run */
+    ev_async_init( &evw_stop, on_stop_async );
+    ev_async_start( loop, &evw_stop );
+
+    if (opt_assert) {
+        seq_error_notify = &seq_error_assert;
+    }
+    if (opt_invalid_log_size > 0) {
+        seq_consecutive_invalid_frames_log = opt_invalid_log_size;
     }
 
+    if (opt_threads > tests_count)
+        opt_threads = tests_count;
 
-    /* start the various tests */
-    for (i=0; i < tests_count; i++) {
-        struct test *t = tests[i];
-        r = t->ops->start( t );
-        if (r < 0) {
-            err("starting test %s failed", t->name );
+    if (opt_threads > 0) {
+        /* distribute the tests among the workers, one CPU each */
+        long cpus = sysconf( _SC_NPROCESSORS_ONLN );
+        if (cpus < 1) cpus = 1;
+
+        workers = calloc( opt_threads, sizeof(*workers) );
+        if (!workers) {
+            err("can't allocate the workers");
             exit(1);
         }
+        for (i=0; i < opt_threads; i++) {
+            if (worker_init( &workers[i], i, i % cpus, config.priority ) < 0)
+                exit(1);
+        }
+        for (i=0; i < tests_count; i++) {
+            if (worker_add_test( &workers[i % opt_threads], tests[i] ) < 0) {
+                err("can't allocate the worker test list");
+                exit(1);
+            }
+        }
+
+        worker_exit_notify = &worker_exited;
+        for (i=0; i < opt_threads; i++) {
+            if (worker_start( &workers[i] ) < 0)
+                exit(1);
+        }
+        workers_count = opt_threads;
+    } else {
+        /* start the various tests */
+        for (i=0; i < tests_count; i++) {
+            struct test *t = tests[i];
+            t->loop = loop;
+            r = t->ops->start( t );
+            if (r < 0) {
+                err("starting test %s failed", t->name );
+                exit(1);
+            }
+        }
     }
 
     /* setup signal handlers to exist cleanly */
@@ -383,13 +869,6 @@ int main(int argc, char * const argv[]) {
     ev_io_init(&stdin_watcher, on_stdin, 0, EV_READ);
     ev_io_start( loop, &stdin_watcher );
 
-    if (opt_assert) {
-        seq_error_notify = &seq_error_assert;
-    }
-    if (opt_invalid_log_size > 0) {
-        seq_consecutive_invalid_frames_log = opt_invalid_log_size;
-    }
-
     if (opt_duration > 0) {
         dbg("start a %d seconds duration timer", opt_duration);
         ev_timer_init( &duration_timer, on_duration_timer, opt_duration, 0 );
@@ -398,6 +877,23 @@ int main(int argc, char * const argv[]) {
 
     ev_run( loop, 0 );
 
+    /* the tests are closed once every worker loop is over */
+    for (i=0; i < opt_threads; i++)
+        worker_stop( &workers[i] );
+    workers_count = 0;
+    for (i=0; i < opt_threads; i++) {
+        if (workers[i].start_failed)
+            exit(1);
+    }
+
+    for (i=0; i < tests_count; i++) {
+        struct test *t = tests[i];
+        if (t->ops->stop)
+            t->ops->stop( t );
+    }
+
+    report_tests();
+
     int test_exit_status = 0;
     for (i=0; i < tests_count; i++) {
         struct test *t = tests[i];
@@ -407,7 +903,15 @@ int main(int argc, char * const argv[]) {
         }
     }
 
-    printf("total number of sequence errors: %u\n", seq_errors_total);
+    for (i=0; i < opt_threads; i++)
+        worker_release( &workers[i] );
+    free( workers );
+    free( tests );
+
+    /* print the pending logs before the summary */
+    log_async_stop();
+
+    printf("total number of sequence errors: %u\n", (unsigned)seq_errors_total);
     printf("global tests exit status: %s\n", test_exit_status ? "FAILED" : "OK");
     /* exit with a good status only if no error was detected */
     return (seq_errors_total || test_exit_status) ? 2 : 0;
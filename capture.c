@@ -7,30 +7,151 @@
  *  (at your option) any later version.
  */
 
+#include <errno.h>
+
 #include "capture.h"
+#include "io.h"
+#include "worker.h"
 #include "log.h"
 
 
+/*
+ * the checker thread: run the sequence state machine on the queued periods,
+ * out of the capture path, so logging or checking bursts never delay the reads.
+ */
+static void *capture_checker( void *arg ) {
+    struct test_capture *tp = (struct test_capture *)arg;
+    struct capture_period *p;
+
+    /* never compete with the real time I/O threads */
+    thread_set_priority( pthread_self(), "other,0" );
+
+    while (1) {
+        if (sem_wait( &tp->ring_sem ) && errno == EINTR)
+            continue;
+        p = ring_read_slot( &tp->ring );
+        if (!p) {
+            if (atomic_load( &tp->checker_stop ))
+                break;
+            continue;
+        }
+        if (p->jump)
+            seq_check_jump_notify( &tp->seq );
+        io_check_seq( &tp->seq, p + 1, p->buff_frames, p->frames );
+        ring_read_release( &tp->ring );
+    }
+    return NULL;
+}
+
+
+/*
+ * read up to 'n' frames (at most one period) into the ring. On ring overrun, the frames
+ * are read anyway (to keep the capture running) but dropped.
+ */
+static snd_pcm_sframes_t capture_read_slot( struct test_capture *tp, snd_pcm_uframes_t n ) {
+    struct capture_period *p = ring_write_slot( &tp->ring );
+    snd_pcm_sframes_t frames;
+
+    if (!p) {
+        frames = io_read( tp->pcm, &tp->t.config, &tp->seq, tp->periof_buff, n );
+        if (frames > 0)
+            tp->pending_jump = 1;
+        return frames;
+    }
+
+    frames = io_read( tp->pcm, &tp->t.config, &tp->seq, p + 1, n );
+    if (frames > 0) {
+        p->buff_frames = n;
+        p->frames = frames;
+        p->jump = tp->pending_jump;
+        tp->pending_jump = 0;
+        ring_write_commit( &tp->ring );
+        sem_post( &tp->ring_sem );
+        tp->queued_periods++;
+        tp->occupancy_sum += ring_occupancy( &tp->ring );
+    }
+    return frames;
+}
+
+
+/*
+ * read every available frame into the ring, one slot per period at most
+ */
+static snd_pcm_sframes_t capture_read_queue( struct test_capture *tp ) {
+    snd_pcm_sframes_t avail, done = 0;
+
+    avail = snd_pcm_avail_update( tp->pcm );
+    if (avail < 0)
+        return avail;
+
+    while (done < avail) {
+        snd_pcm_uframes_t n = avail - done < tp->t.config.period ? avail - done : tp->t.config.period;
+        snd_pcm_sframes_t frames = capture_read_slot( tp, n );
+        if (frames < 0)
+            return done ? done : frames;
+        done += frames;
+        if (frames < n)
+            break;
+    }
+    return done;
+}
+
+
+/*
+ * the frame sequence is expected to be broken (xrun, restart...)
+ */
+static void capture_jump( struct test_capture *tp ) {
+    if (tp->opts.queue)
+        tp->pending_jump = 1;
+    else
+        seq_check_jump_notify( &tp->seq );
+}
+
+
+/*
+ * wait for the PCM wake ups, or for the timer in timer scheduled mode
+ */
+static void capture_io_start( struct test_capture *tp ) {
+    if (tp->t.config.timer_sched)
+        ev_timer_again( tp->t.loop, &tp->sched_timer );
+    else
+        ev_io_start( tp->t.loop, &tp->io_watcher );
+}
+
+static void capture_io_stop( struct test_capture *tp ) {
+    ev_io_stop( tp->t.loop, &tp->io_watcher );
+    ev_timer_stop( tp->t.loop, &tp->sched_timer );
+}
+
+
 static int capture_start(struct test *t) {
     struct test_capture *tp = (struct test_capture *)t;
     int r;
     dbg("%s: capture_start", tp->t.device);
+    if (tp->opts.queue) {
+        r = pthread_create( &tp->checker, NULL, capture_checker, tp );
+        if (r) {
+            err("%s: can't create the checker thread: %s", tp->t.device, strerror(r));
+            return -1;
+        }
+        tp->checker_running = 1;
+    }
     r = snd_pcm_start( tp->pcm );
     if (r < 0) {
         warn("%s: capture start failed: %s", tp->t.device, snd_strerror(r));
         return -1;
     } else {
-        ev_io_start( loop, &tp->io_watcher );
+        capture_io_start( tp );
         if (tp->opts.xrun) {
             dbg("%s: will simulate xrun every %d ms", tp->t.device, tp->opts.xrun);
             tp->timer_state = CT_W4_XRUN;
             ev_timer_set( &tp->timer, tp->opts.xrun * 1e-3, 0);
-            ev_timer_start( loop, &tp->timer );
+            ev_timer_start( tp->t.loop, &tp->timer );
         } else if (tp->opts.restart_play_time && tp->opts.restart_pause_time) {
             dbg("%s: will stop every %d ms during %d ms", tp->t.device, tp->opts.restart_play_time, tp->opts.restart_pause_time);
             tp->timer_state = CT_W4_STOP;
             ev_timer_set( &tp->timer, tp->opts.restart_play_time * 1e-3, 0);
-            ev_timer_start( loop, &tp->timer );
+            ev_timer_start( tp->t.loop, &tp->timer );
         }
     }
 
@@ -48,7 +169,7 @@ static void capture_timer( struct ev_loop *loop, struct ev_timer *w, int revents
     case CT_W4_XRUN:
         warn("%s: force capture xrun", tp->t.device);
         /* simply stop handling the pcm handler during few ms */
-        ev_io_stop( loop, &tp->io_watcher );
+        capture_io_stop( tp );
         tp->timer_state = CT_W4_XRUN_END;
         ev_timer_set( &tp->timer, 0.5, 0);
         ev_timer_start( loop, &tp->timer );
@@ -56,7 +177,7 @@ static void capture_timer( struct ev_loop *loop, struct ev_timer *w, int revents
 
     case CT_W4_XRUN_END:
         warn("%s: CT_W4_XRUN_END", tp->t.device);
-        ev_io_start( loop, &tp->io_watcher );
+        capture_io_start( tp );
         tp->timer_state = CT_W4_XRUN;
         ev_timer_set( &tp->timer, tp->opts.xrun*1e-3, 0);
         ev_timer_start( loop, &tp->timer );
@@ -65,7 +186,7 @@ static void capture_timer( struct ev_loop *loop, struct ev_timer *w, int revents
     case CT_W4_STOP:
         warn("%s: CT_W4_STOP", tp->t.device);
         snd_pcm_drop( tp->pcm );
-        ev_io_stop( loop, &tp->io_watcher );
+        capture_io_stop( tp );
         tp->timer_state = CT_W4_RESTART;
         ev_timer_set( &tp->timer, tp->opts.restart_pause_time * 1e-3, 0);
         ev_timer_start( loop, &tp->timer );
@@ -74,11 +195,12 @@ static void capture_timer( struct ev_loop *loop, struct ev_timer *w, int revents
     case CT_W4_RESTART: {
         int r;
         warn("%s: CT_W4_RESTART", tp->t.device);
-        seq_check_jump_notify( &tp->seq );
+        capture_jump( tp );
         snd_pcm_prepare(tp->pcm);
+        stream_stats_break( &tp->stats );
         r = snd_pcm_start( tp->pcm );
         if (r >= 0) {
-            ev_io_start( loop, &tp->io_watcher );
+            capture_io_start( tp );
             tp->timer_state = CT_W4_STOP;
             ev_timer_set( &tp->timer, tp->opts.restart_play_time * 1e-3, 0);
             ev_timer_start( loop, &tp->timer );
@@ -93,12 +215,17 @@ static void capture_timer( struct ev_loop *loop, struct ev_timer *w, int revents
 
 
 
-static void capture_io_job( struct ev_loop *loop, struct ev_io *w, int revents ) {
-
-    struct test_capture *tp = (struct test_capture *)(w->data);
+static void capture_io( struct ev_loop *loop, struct test_capture *tp ) {
     snd_pcm_sframes_t frames;
 
-    frames = snd_pcm_readi(tp->pcm, tp->periof_buff, tp->t.config.period);
+    stream_stats_wakeup( &tp->stats, tp->pcm );
+
+    /* read and check the sequence, or queue it to the checker thread */
+    if (tp->opts.queue)
+        frames = capture_read_queue( tp );
+    else
+        frames = io_read_seq_avail( tp->pcm, &tp->t.config, &tp->seq, tp->periof_buff, tp->t.config.period );
+    stream_stats_transfer( &tp->stats, frames );
     if (frames < 0) {
         int r;
         warn("%s: capture read failed: %s", tp->t.device, snd_strerror(frames));
@@ -111,31 +238,79 @@ static void capture_io_job( struct ev_loop *loop, struct ev_io *w, int revents )
         if (r < 0) {
             err("%s: capture recover failed: %s", tp->t.device, snd_strerror(frames));
         }
+        stream_stats_break( &tp->stats );
         r = snd_pcm_start( tp->pcm );
         if (r < 0) {
             warn("%s: capture start failed after recover: %s", tp->t.device, snd_strerror(r));
             ev_unloop(loop, EVUNLOOP_ALL);
             return;
         }
-        seq_check_jump_notify( &tp->seq );
+        capture_jump( tp );
+    }
+    stream_stats_done( &tp->stats );
+}
 
-    } else if (frames != tp->t.config.period) {
-        err("%s: capture read less than the expected period size: %ld / %u", tp->t.device, frames, tp->t.config.period);
+static void capture_io_job( struct ev_loop *loop, struct ev_io *w, int revents ) {
+    capture_io( loop, (struct test_capture *)(w->data) );
+}
 
-    } else {
-        /* check the sequence */
-        seq_check_frames( &tp->seq, tp->periof_buff, tp->t.config.period );
+static void capture_sched_job( struct ev_loop *loop, struct ev_timer *w, int revents ) {
+    capture_io( loop, (struct test_capture *)(w->data) );
+}
+
+
+
+static void capture_report(struct test *t) {
+    struct test_capture *tp = (struct test_capture *)t;
+    stream_stats_print( &tp->stats );
+    if (tp->t.config.timer_sched)
+        printf("%s: timer scheduled: wake up every %.2f ms, buffer %lu frames\n",
+                tp->stats.name, tp->t.config.period * 1e3 / tp->t.config.rate,
+                (unsigned long)tp->stats.buffer_size);
+    if (tp->opts.queue) {
+        /* producer side statistics: the report runs on the capture thread */
+        printf("%s: checker ring: %u periods, %u queued, max occupancy %u, mean occupancy %.2f, overruns %u\n",
+                tp->stats.name, tp->ring.slots, ring_occupancy( &tp->ring ), tp->ring.max_occupancy,
+                tp->queued_periods ? (double)tp->occupancy_sum / tp->queued_periods : 0.,
+                tp->ring.overruns);
     }
+    if (tp->checker_running) {
+        /* the checker thread owns the sequence state until capture_stop() */
+        printf("%s: sequence checked by the checker thread, reported at exit\n", tp->stats.name);
+        return;
+    }
+    seq_channels_print( &tp->seq, tp->stats.name );
+    seq_events_print( &tp->seq.events, tp->stats.name );
 }
 
 
+/* stop the capture, and let the checker drain the ring before the report */
+static void capture_stop(struct test *t) {
+    struct test_capture *tp = (struct test_capture *)t;
+
+    capture_io_stop( tp );
+    if (tp->checker_running) {
+        atomic_store( &tp->checker_stop, 1 );
+        sem_post( &tp->ring_sem );
+        pthread_join( tp->checker, NULL );
+        tp->checker_running = 0;
+    }
+}
+
 
 static int capture_close(struct test *t) {
     struct test_capture *tp = (struct test_capture *)t;
 
-    ev_io_stop(loop, &tp->io_watcher);
+    capture_stop( t );
     snd_pcm_close( tp->pcm );
 
+    if (tp->opts.queue) {
+        ring_release( &tp->ring );
+        sem_destroy( &tp->ring_sem );
+    }
+
+    stream_stats_release( &tp->stats );
+    seq_release( &tp->seq );
     free( tp->periof_buff );
     free( tp );
     return 0;
@@ -145,7 +320,9 @@ static int capture_close(struct test *t) {
 
 const struct test_ops capture_ops = {
         .start = capture_start,
+        .stop = capture_stop,
         .close = capture_close,
+        .report = capture_report,
 };
 
 /*
@@ -154,6 +331,7 @@ const struct test_ops capture_ops = {
  */
 struct test *capture_create(struct alsa_config *config, struct capture_create_opts *opts) {
     struct test_capture *tp = calloc( 1, sizeof(*tp));
+    char name[96];
     int r;
 
     if (!tp) return NULL;
@@ -166,10 +344,25 @@ struct test *capture_create(struct alsa_config *config, struct capture_create_op
     r = alsa_device_open( tp->t.config.device, &tp->t.config, &tp->pcm, NULL );
     if (r) goto failed1;
 
-    seq_init( &tp->seq, tp->t.config.channels, tp->t.config.format );
+    if (seq_init( &tp->seq, tp->t.config.channels, tp->t.config.format,
+            alsa_access_is_interleaved( tp->t.config.access ))) goto failed;
     tp->periof_buff = malloc( snd_pcm_frames_to_bytes( tp->pcm, tp->t.config.period ));
     if (!tp->periof_buff) goto failed;
 
+    if (tp->opts.queue) {
+        /* keep every slot header aligned, whatever the period size in bytes (ie. S24_3LE) */
+        size_t align = _Alignof(struct capture_period);
+        size_t slot_bytes = sizeof(struct capture_period) +
+                snd_pcm_frames_to_bytes( tp->pcm, tp->t.config.period );
+        slot_bytes = (slot_bytes + align - 1) / align * align;
+        if (ring_init( &tp->ring, tp->opts.queue, slot_bytes )) {
+            err("%s: can't allocate the checker ring", tp->t.device);
+            goto failed;
+        }
+        sem_init( &tp->ring_sem, 0, 0 );
+        atomic_init( &tp->checker_stop, 0 );
+    }
+
     r = snd_pcm_poll_descriptors_count(tp->pcm);
     if (r != 1) {
         err("capture_create: expect only 1 fd to monitor (snd_pcm_poll_descriptors_count)");
@@ -188,8 +381,13 @@ struct test *capture_create(struct alsa_config *config, struct capture_create_op
             ((tp->pollfd.events & POLLOUT) ? EV_WRITE : 0)
             );
     tp->io_watcher.data = tp;
+    ev_timer_init( &tp->sched_timer, capture_sched_job, 0, (double)tp->t.config.period / tp->t.config.rate );
+    tp->sched_timer.data = tp;
     ev_timer_init( &tp->timer, capture_timer, 0, 0 );
     tp->timer.data = tp;
+    snprintf( name, sizeof(name), "%s capture", tp->t.device );
+    if (stream_stats_init( &tp->stats, tp->pcm, tp->t.config.rate, name ) < 0)
+        goto failed;
 
     tp->t.ops = &capture_ops;
 
@@ -197,6 +395,12 @@ struct test *capture_create(struct alsa_config *config, struct capture_create_op
 
 failed:
     snd_pcm_close( tp->pcm );
+    stream_stats_release( &tp->stats );
+    seq_release( &tp->seq );
+    if (tp->ring.data)
+        /* the semaphore is initialized with the ring */
+        sem_destroy( &tp->ring_sem );
+    ring_release( &tp->ring );
     free(tp->periof_buff);
 failed1:
     free(tp);
@@ -12,15 +12,20 @@
 #define __capture_h__
 
 #include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <ev.h>
 
 #include "test.h"
 #include "seq.h"
+#include "ring.h"
+#include "hist.h"
 
 struct capture_create_opts {
     int xrun;
     int restart_play_time;
     int restart_pause_time;
+    int queue;      /* if not 0, check the frames from a checker thread, through a ring of 'queue' periods */
 };
 
 
@@ -32,8 +37,11 @@ struct test_capture {
 
     struct pollfd pollfd;
     struct ev_io io_watcher;
+    struct ev_timer sched_timer;    /* replaces io_watcher in timer scheduled mode */
     struct ev_timer timer;
 
+    struct stream_stats stats;
+
     struct capture_create_opts opts;
     enum capture_timer_state_e {
         CT_IDLE = 0,
@@ -44,6 +52,24 @@ struct test_capture {
         CT_W4_RESTART
     } timer_state;
 
+    /* checker thread mode (opts.queue) */
+    struct ring ring;           /* of struct capture_period */
+    sem_t ring_sem;             /* posted on every committed period, and on stop */
+    pthread_t checker;
+    int checker_running;
+    atomic_int checker_stop;
+    int pending_jump;           /* the next queued period follows a discontinuity */
+    unsigned queued_periods;
+    unsigned long long occupancy_sum;
+};
+
+/*
+ * a period queued to the checker thread, followed by the frames
+ */
+struct capture_period {
+    snd_pcm_uframes_t buff_frames; /* size of the io_read() request (layout of the frames) */
+    snd_pcm_sframes_t frames;
+    int jump;                   /* call seq_check_jump_notify() before checking this period */
 };
 
 struct test *capture_create(struct alsa_config *config, struct capture_create_opts *opts);
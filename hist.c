@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "hist.h"
+
+
+static unsigned hist_index( uint64_t v ) {
+    unsigned shift;
+
+    if (v >= (1ull << HIST_MAX_BITS))
+        v = (1ull << HIST_MAX_BITS) - 1;
+    if (v < 2 * HIST_SUB)
+        return v;
+    shift = 63 - __builtin_clzll( v ) - HIST_SUB_BITS;
+    return HIST_SUB * (shift + 1) + (unsigned)(v >> shift) - HIST_SUB;
+}
+
+/* highest value recorded in the bucket 'index' */
+static uint64_t hist_value( unsigned index ) {
+    unsigned shift;
+
+    if (index < 2 * HIST_SUB)
+        return index;
+    shift = index / HIST_SUB - 1;
+    return ((uint64_t)(index % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
+
+
+void hist_reset( struct hist *h )
+{
+    memset( h, 0, sizeof(*h) );
+}
+
+
+void hist_add( struct hist *h, uint64_t v )
+{
+    if (!h->count || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->count++;
+    h->buckets[ hist_index( v ) ]++;
+}
+
+
+uint64_t hist_percentile( const struct hist *h, double p )
+{
+    uint64_t target, sum = 0;
+    uint64_t v;
+    unsigned i;
+
+    if (!h->count)
+        return 0;
+    target = (uint64_t)(p * h->count / 100. + 0.5);
+    if (target < 1)
+        target = 1;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        sum += h->buckets[i];
+        if (sum >= target)
+            break;
+    }
+    v = hist_value( i < HIST_BUCKETS ? i : HIST_BUCKETS - 1 );
+    if (v > h->max) v = h->max;
+    if (v < h->min) v = h->min;
+    return v;
+}
+
+
+void hist_print( const struct hist *h, const char *prefix, const char *name, double scale )
+{
+    if (!h->count) {
+        printf("%s: %-18s no sample\n", prefix, name);
+        return;
+    }
+    printf("%s: %-18s n %-8llu min %-9.1f p50 %-9.1f p99 %-9.1f p999 %-9.1f max %.1f\n",
+            prefix, name, (unsigned long long)h->count,
+            h->min / scale,
+            hist_percentile( h, 50. ) / scale,
+            hist_percentile( h, 99. ) / scale,
+            hist_percentile( h, 99.9 ) / scale,
+            h->max / scale );
+}
+
+
+static struct stream_stats *stream_stats_list = NULL;
+
+
+static uint64_t stats_now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+int stream_stats_init( struct stream_stats *s, snd_pcm_t *pcm, unsigned rate, const char *name )
+{
+    snd_pcm_uframes_t period_size;
+
+    snprintf( s->name, sizeof(s->name), "%s", name );
+    hist_reset( &s->interval );
+    hist_reset( &s->avail );
+    hist_reset( &s->duration );
+    hist_reset( &s->batch );
+    s->wakeup = 0;
+    s->last_wakeup = 0;
+
+    s->playback = snd_pcm_stream( pcm ) == SND_PCM_STREAM_PLAYBACK;
+    s->transferred = 0;
+    s->wakeup_frames = 0;
+    if (snd_pcm_get_params( pcm, &s->buffer_size, &period_size ) < 0)
+        return -1;
+    rate_init( &s->rate, rate );
+
+    s->next = stream_stats_list;
+    stream_stats_list = s;
+    return 0;
+}
+
+
+void stream_stats_release( struct stream_stats *s )
+{
+    struct stream_stats **p;
+    for (p = &stream_stats_list; *p; p = &(*p)->next) {
+        if (*p == s) {
+            *p = s->next;
+            break;
+        }
+    }
+}
+
+
+void stream_stats_wakeup( struct stream_stats *s, snd_pcm_t *pcm )
+{
+    snd_pcm_sframes_t avail;
+
+    s->wakeup = stats_now();
+    if (s->last_wakeup)
+        hist_add( &s->interval, s->wakeup - s->last_wakeup );
+    s->last_wakeup = s->wakeup;
+    s->wakeup_frames = 0;
+
+    avail = snd_pcm_avail( pcm );
+    if (avail < 0)
+        return;
+    hist_add( &s->avail, avail );
+
+    /* hardware position */
+    if (!s->playback)
+        rate_add( &s->rate, s->wakeup * 1e-9, (double)s->transferred + avail );
+    else if (avail <= s->buffer_size)
+        rate_add( &s->rate, s->wakeup * 1e-9, (double)s->transferred - (s->buffer_size - avail) );
+}
+
+
+void stream_stats_done( struct stream_stats *s )
+{
+    hist_add( &s->duration, stats_now() - s->wakeup );
+    hist_add( &s->batch, s->wakeup_frames );
+}
+
+
+void stream_stats_break( struct stream_stats *s )
+{
+    s->last_wakeup = 0;
+    s->transferred = 0;
+    rate_break( &s->rate );
+}
+
+
+int stream_stats_reset( struct stream_stats *s, snd_pcm_t *pcm, unsigned rate )
+{
+    snd_pcm_uframes_t period_size;
+
+    hist_reset( &s->interval );
+    hist_reset( &s->avail );
+    hist_reset( &s->duration );
+    hist_reset( &s->batch );
+    s->last_wakeup = 0;
+    s->transferred = 0;
+    s->wakeup_frames = 0;
+    if (snd_pcm_get_params( pcm, &s->buffer_size, &period_size ) < 0)
+        return -1;
+    rate_init( &s->rate, rate );
+    return 0;
+}
+
+
+void stream_stats_print( const struct stream_stats *s )
+{
+    hist_print( &s->interval, s->name, "interval (us)", 1e3 );
+    hist_print( &s->avail, s->name, "avail (frames)", 1. );
+    hist_print( &s->duration, s->name, "callback (us)", 1e3 );
+    hist_print( &s->batch, s->name, "frames / wake up", 1. );
+    rate_print( &s->rate, s->name );
+}
+
+
+void stream_stats_print_relative( void )
+{
+    const struct stream_stats *a, *b;
+
+    for (a = stream_stats_list; a; a = a->next) {
+        double ra = rate_estimate( &a->rate ) / a->rate.nominal;
+        if (!ra)
+            continue;
+        for (b = a->next; b; b = b->next) {
+            double rb = rate_estimate( &b->rate ) / b->rate.nominal;
+            if (!rb)
+                continue;
+            printf("relative drift: %s / %s: %+.1f ppm\n", a->name, b->name, (ra / rb - 1.) * 1e6);
+        }
+    }
+}
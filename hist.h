@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef __hist_h__
+#define __hist_h__
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+#include "rate.h"
+
+/*
+ * constant memory log-linear histogram (HDR histogram like).
+ * Values below 2*HIST_SUB are exact. Above, every power of 2 is split into
+ * HIST_SUB buckets, so the values are recorded with a relative error below
+ * 1/HIST_SUB. Values above 2^HIST_MAX_BITS are recorded in the last bucket.
+ */
+#define HIST_SUB_BITS   6
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS   40
+#define HIST_BUCKETS    ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint32_t buckets[HIST_BUCKETS];
+};
+
+void hist_reset( struct hist *h );
+void hist_add( struct hist *h, uint64_t v );
+
+/* return the value at percentile 'p' (0 to 100) */
+uint64_t hist_percentile( const struct hist *h, double p );
+
+/*
+ * print "prefix: name  n  min  p50  p99  p999  max" on one line,
+ * values being divided by 'scale'
+ */
+void hist_print( const struct hist *h, const char *prefix, const char *name, double scale );
+
+
+/*
+ * timings of the I/O callback of one stream, and estimation of its
+ * actual sample rate from the hardware position at every wake up
+ * (times from CLOCK_MONOTONIC_RAW)
+ */
+struct stream_stats {
+    char name[96];
+
+    struct hist interval;   /* between two consecutive wake ups, in ns */
+    struct hist avail;      /* snd_pcm_avail() at wake up, in frames */
+    struct hist duration;   /* time spent in the callback, in ns */
+    struct hist batch;      /* frames transferred per wake up */
+
+    uint64_t wakeup;        /* time of the current wake up */
+    uint64_t last_wakeup;   /* time of the previous one, 0 if none */
+
+    int playback;
+    snd_pcm_uframes_t buffer_size;
+    uint64_t transferred;   /* frames written or read since the stream (re)start */
+    uint64_t wakeup_frames; /* frames transferred since the current wake up */
+    struct rate_estimator rate;
+
+    struct stream_stats *next; /* every stream statistics, see stream_stats_print_relative() */
+};
+
+/* return 0 on success */
+int stream_stats_init( struct stream_stats *s, snd_pcm_t *pcm, unsigned rate, const char *name );
+void stream_stats_release( struct stream_stats *s );
+
+/* to call at the beginning and at the end of the I/O callback */
+void stream_stats_wakeup( struct stream_stats *s, snd_pcm_t *pcm );
+void stream_stats_done( struct stream_stats *s );
+
+/* to call after every frames transfer, in or out of the I/O callback */
+static inline void stream_stats_transfer( struct stream_stats *s, snd_pcm_sframes_t frames ) {
+    if (frames > 0) {
+        s->transferred += frames;
+        s->wakeup_frames += frames;
+    }
+}
+
+/*
+ * the stream was restarted (prepared again): the next wake up doesn't follow the
+ * previous one, and the stream position starts from 0
+ */
+void stream_stats_break( struct stream_stats *s );
+
+/*
+ * the PCM was set up again (see alsa_device_reconfigure()): forget every
+ * statistics, and take the new buffer size and rate. return 0 on success
+ */
+int stream_stats_reset( struct stream_stats *s, snd_pcm_t *pcm, unsigned rate );
+
+void stream_stats_print( const struct stream_stats *s );
+
+/* relative drift between each pair of streams */
+void stream_stats_print_relative( void );
+
+#endif //__hist_h__
@@ -0,0 +1,335 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <alsa/asoundlib.h>
+
+#include "io.h"
+#include "log.h"
+
+
+/*
+ * address of the sample 'offset' in a mmap area
+ */
+static void *area_sample( const snd_pcm_channel_area_t *area, snd_pcm_uframes_t offset ) {
+    return (unsigned char *)area->addr + (area->first + offset * area->step) / 8;
+}
+
+
+/*
+ * setup the array of channel buffers of a non interleaved RW transfer of 'frames' frames,
+ * packed one channel after the other in 'buff'
+ */
+static void rw_channel_bufs( const struct seq_info *seq, void *buff, snd_pcm_uframes_t frames, void **bufs ) {
+    unsigned ch;
+    for (ch = 0; ch < seq->channels; ch++)
+        bufs[ch] = (unsigned char *)buff + ch * frames * seq->sample_bytes;
+}
+
+static void mmap_channel_bufs( const struct seq_info *seq, const snd_pcm_channel_area_t *areas,
+        snd_pcm_uframes_t offset, void **bufs ) {
+    unsigned ch;
+    for (ch = 0; ch < seq->channels; ch++)
+        bufs[ch] = area_sample( &areas[ch], offset );
+}
+
+
+/*
+ * With mmap, nothing starts the playback implicitly: apply the start threshold
+ * the same way snd_pcm_writei() would do.
+ */
+static int mmap_autostart( snd_pcm_t *pcm ) {
+    snd_pcm_sw_params_t *sw_params;
+    snd_pcm_hw_params_t *hw_params;
+    snd_pcm_uframes_t threshold, buffer_size;
+    snd_pcm_sframes_t avail;
+
+    if (snd_pcm_state( pcm ) != SND_PCM_STATE_PREPARED)
+        return 0;
+
+    snd_pcm_sw_params_alloca( &sw_params );
+    snd_pcm_hw_params_alloca( &hw_params );
+    if ((snd_pcm_sw_params_current( pcm, sw_params ) < 0) ||
+        (snd_pcm_sw_params_get_start_threshold( sw_params, &threshold ) < 0) ||
+        (snd_pcm_hw_params_current( pcm, hw_params ) < 0) ||
+        (snd_pcm_hw_params_get_buffer_size( hw_params, &buffer_size ) < 0))
+        return 0;
+
+    avail = snd_pcm_avail_update( pcm );
+    if (avail < 0)
+        return avail;
+    if (buffer_size - avail >= threshold)
+        return snd_pcm_start( pcm );
+    return 0;
+}
+
+
+snd_pcm_sframes_t io_write_seq( snd_pcm_t *pcm, const struct alsa_config *config,
+        struct seq_info *seq, void *buff, snd_pcm_uframes_t frames )
+{
+    snd_pcm_sframes_t written = 0;
+
+    if (!alsa_access_is_mmap( config->access )) {
+        if (seq->interleaved) {
+            const void *data;
+            if (buff) {
+                seq_fill_frames( seq, buff, frames );
+                data = buff;
+            } else {
+                data = seq_frames_ptr( seq, frames );
+                if (!data) {
+                    err("io_write_seq: %lu frames can't be taken from the sequence table",
+                            (unsigned long)frames);
+                    return -EINVAL;
+                }
+            }
+            written = snd_pcm_writei( pcm, data, frames );
+        } else {
+            void *bufs[SEQ_MAX_CHANNELS];
+            if (buff) {
+                rw_channel_bufs( seq, buff, frames, bufs );
+                seq_fill_channels( seq, bufs, frames );
+            } else if (seq_channels_ptr( seq, (const void **)bufs, frames ) < 0) {
+                err("io_write_seq: %lu frames can't be taken from the sequence table",
+                        (unsigned long)frames);
+                return -EINVAL;
+            }
+            written = snd_pcm_writen( pcm, bufs, frames );
+        }
+        seq_fill_rewind( seq, written < 0 ? frames : frames - written );
+        return written;
+    }
+
+    snd_pcm_sframes_t avail = snd_pcm_avail_update( pcm );
+    if (avail < 0)
+        return avail;
+    if (frames > avail)
+        frames = avail;
+
+    while (written < frames) {
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t n = frames - written;
+        snd_pcm_sframes_t committed;
+        int r;
+
+        r = snd_pcm_mmap_begin( pcm, &areas, &offset, &n );
+        if (r < 0)
+            return written ? written : r;
+
+        if (seq->interleaved) {
+            seq_fill_frames( seq, area_sample( &areas[0], offset ), n );
+        } else {
+            void *bufs[SEQ_MAX_CHANNELS];
+            mmap_channel_bufs( seq, areas, offset, bufs );
+            seq_fill_channels( seq, bufs, n );
+        }
+        committed = snd_pcm_mmap_commit( pcm, offset, n );
+        if (committed < 0 || committed != n) {
+            seq_fill_rewind( seq, committed < 0 ? n : n - committed );
+            if (committed < 0)
+                return written ? written : committed;
+            written += committed;
+            break;
+        }
+        written += n;
+    }
+
+    int r = mmap_autostart( pcm );
+    if (r < 0)
+        return r;
+    return written;
+}
+
+
+snd_pcm_sframes_t io_read_seq( snd_pcm_t *pcm, const struct alsa_config *config,
+        struct seq_info *seq, void *buff, snd_pcm_uframes_t frames )
+{
+    snd_pcm_sframes_t read = 0;
+
+    if (!alsa_access_is_mmap( config->access )) {
+        if (seq->interleaved) {
+            read = snd_pcm_readi( pcm, buff, frames );
+            if (read > 0)
+                seq_check_frames( seq, buff, read );
+        } else {
+            void *bufs[SEQ_MAX_CHANNELS];
+            rw_channel_bufs( seq, buff, frames, bufs );
+            read = snd_pcm_readn( pcm, bufs, frames );
+            if (read > 0)
+                seq_check_channels( seq, (const void * const *)bufs, read );
+        }
+        return read;
+    }
+
+    snd_pcm_sframes_t avail = snd_pcm_avail_update( pcm );
+    if (avail < 0)
+        return avail;
+    if (frames > avail)
+        frames = avail;
+
+    while (read < frames) {
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t n = frames - read;
+        snd_pcm_sframes_t committed;
+        int r;
+
+        r = snd_pcm_mmap_begin( pcm, &areas, &offset, &n );
+        if (r < 0)
+            return read ? read : r;
+
+        /* check the frames in place, before giving the area back to the driver */
+        if (seq->interleaved) {
+            seq_check_frames( seq, area_sample( &areas[0], offset ), n );
+        } else {
+            void *bufs[SEQ_MAX_CHANNELS];
+            mmap_channel_bufs( seq, areas, offset, bufs );
+            seq_check_channels( seq, (const void * const *)bufs, n );
+        }
+        committed = snd_pcm_mmap_commit( pcm, offset, n );
+        if (committed < 0)
+            return read ? read : committed;
+        read += committed;
+        if (committed != n)
+            break;
+    }
+    return read;
+}
+
+
+/*
+ * move up to 'frames' frames with 'transfer' (io_write_seq() or io_read_seq()), without
+ * exceeding the available frames, by chunks of up to 'chunk' frames. In mmap mode,
+ * the chunks are only limited by the DMA buffer areas.
+ */
+static snd_pcm_sframes_t io_transfer( snd_pcm_t *pcm, const struct alsa_config *config,
+        struct seq_info *seq, void *buff, snd_pcm_uframes_t chunk, snd_pcm_uframes_t frames,
+        snd_pcm_sframes_t (*transfer)( snd_pcm_t *, const struct alsa_config *,
+                struct seq_info *, void *, snd_pcm_uframes_t ) )
+{
+    snd_pcm_sframes_t avail, done = 0;
+
+    avail = snd_pcm_avail_update( pcm );
+    if (avail < 0)
+        return avail;
+    if (avail > frames)
+        avail = frames;
+    if (alsa_access_is_mmap( config->access ))
+        chunk = avail;
+
+    while (done < avail) {
+        snd_pcm_uframes_t n = avail - done < chunk ? avail - done : chunk;
+        snd_pcm_sframes_t r = transfer( pcm, config, seq, buff, n );
+        if (r < 0)
+            return done ? done : r;
+        done += r;
+        if (r < n)
+            break;
+    }
+    return done;
+}
+
+
+snd_pcm_sframes_t io_write_seq_avail( snd_pcm_t *pcm, const struct alsa_config *config,
+        struct seq_info *seq, void *buff, snd_pcm_uframes_t chunk )
+{
+    return io_transfer( pcm, config, seq, buff, chunk, -1, io_write_seq );
+}
+
+
+snd_pcm_sframes_t io_write_seq_fill( snd_pcm_t *pcm, const struct alsa_config *config,
+        struct seq_info *seq, void *buff, snd_pcm_uframes_t chunk, snd_pcm_uframes_t target )
+{
+    snd_pcm_sframes_t delay;
+    int r;
+
+    r = snd_pcm_delay( pcm, &delay );
+    if (r < 0)
+        return r;
+    if (delay >= (snd_pcm_sframes_t)target)
+        return 0;
+    return io_transfer( pcm, config, seq, buff, chunk, target - delay, io_write_seq );
+}
+
+
+snd_pcm_sframes_t io_read_seq_avail( snd_pcm_t *pcm, const struct alsa_config *config,
+        struct seq_info *seq, void *buff, snd_pcm_uframes_t chunk )
+{
+    return io_transfer( pcm, config, seq, buff, chunk, -1, io_read_seq );
+}
+
+
+snd_pcm_sframes_t io_read( snd_pcm_t *pcm, const struct alsa_config *config,
+        const struct seq_info *seq, void *buff, snd_pcm_uframes_t frames )
+{
+    snd_pcm_sframes_t read = 0;
+    snd_pcm_uframes_t buff_frames = frames;
+    unsigned ch;
+
+    if (!alsa_access_is_mmap( config->access )) {
+        if (seq->interleaved) {
+            return snd_pcm_readi( pcm, buff, frames );
+        } else {
+            void *bufs[SEQ_MAX_CHANNELS];
+            rw_channel_bufs( seq, buff, frames, bufs );
+            return snd_pcm_readn( pcm, bufs, frames );
+        }
+    }
+
+    snd_pcm_sframes_t avail = snd_pcm_avail_update( pcm );
+    if (avail < 0)
+        return avail;
+    if (frames > avail)
+        frames = avail;
+
+    while (read < frames) {
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t n = frames - read;
+        snd_pcm_sframes_t committed;
+        int r;
+
+        r = snd_pcm_mmap_begin( pcm, &areas, &offset, &n );
+        if (r < 0)
+            return read ? read : r;
+
+        /* same layout as the RW transfers */
+        if (seq->interleaved) {
+            memcpy( (unsigned char *)buff + read * seq->frame_bytes,
+                    area_sample( &areas[0], offset ), n * seq->frame_bytes );
+        } else {
+            for (ch = 0; ch < seq->channels; ch++)
+                memcpy( (unsigned char *)buff + (ch * buff_frames + read) * seq->sample_bytes,
+                        area_sample( &areas[ch], offset ), n * seq->sample_bytes );
+        }
+        committed = snd_pcm_mmap_commit( pcm, offset, n );
+        if (committed < 0)
+            return read ? read : committed;
+        read += committed;
+        if (committed != n)
+            break;
+    }
+    return read;
+}
+
+
+void io_check_seq( struct seq_info *seq, const void *buff,
+        snd_pcm_uframes_t buff_frames, snd_pcm_uframes_t frames )
+{
+    if (seq->interleaved) {
+        seq_check_frames( seq, buff, frames );
+    } else {
+        void *bufs[SEQ_MAX_CHANNELS];
+        rw_channel_bufs( seq, (void *)buff, buff_frames, bufs );
+        seq_check_channels( seq, (const void * const *)bufs, frames );
+    }
+}
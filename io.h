@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef __io_h__
+#define __io_h__
+
+#include "alsa.h"
+#include "seq.h"
+
+/*
+ * PCM transfers of the frame sequence, shared by every tests.
+ * According to config->access, frames go through snd_pcm_writei()/snd_pcm_readi()
+ * (or their non interleaved flavors) and the intermediate buffer 'buff', or are
+ * generated/checked directly in the DMA area of the PCM (mmap mode).
+ * In non interleaved RW mode, 'buff' holds the samples of each channel one after the other.
+ */
+
+/*
+ * generate and queue 'frames' frames of 'seq'.
+ * In RW mode, the frames are generated into 'buff', or taken directly from the
+ * pre-generated sequence if 'buff' is NULL (see seq_frames_ptr() and
+ * seq_channels_ptr()): -EINVAL if this is not possible.
+ *
+ * return the number of frames written, or a negative error code.
+ * Frames which can't be written are given back to 'seq', so the next call
+ * generates them again (ie. after a snd_pcm_recover()).
+ */
+snd_pcm_sframes_t io_write_seq( snd_pcm_t *pcm, const struct alsa_config *config,
+        struct seq_info *seq, void *buff, snd_pcm_uframes_t frames );
+
+/*
+ * write every frame the PCM can take (snd_pcm_avail_update()) at once,
+ * by chunks of up to 'chunk' frames (the size of 'buff') in RW mode.
+ *
+ * return the number of frames written, or a negative error code if nothing
+ * could be written.
+ */
+snd_pcm_sframes_t io_write_seq_avail( snd_pcm_t *pcm, const struct alsa_config *config,
+        struct seq_info *seq, void *buff, snd_pcm_uframes_t chunk );
+
+/*
+ * timer scheduled mode: write the frames missing to have 'target' frames queued
+ * in the PCM (according to snd_pcm_delay()), by chunks of up to 'chunk' frames.
+ *
+ * return the number of frames written, or a negative error code.
+ */
+snd_pcm_sframes_t io_write_seq_fill( snd_pcm_t *pcm, const struct alsa_config *config,
+        struct seq_info *seq, void *buff, snd_pcm_uframes_t chunk, snd_pcm_uframes_t target );
+
+/*
+ * read and check up to 'frames' frames with 'seq'.
+ * 'buff' is only used in RW mode.
+ *
+ * return the number of frames read, or a negative error code.
+ */
+snd_pcm_sframes_t io_read_seq( snd_pcm_t *pcm, const struct alsa_config *config,
+        struct seq_info *seq, void *buff, snd_pcm_uframes_t frames );
+
+/*
+ * read and check every available frame at once, by chunks of up to 'chunk' frames
+ * (the size of 'buff') in RW mode. The sequence checker accepts any chunk length.
+ *
+ * return the number of frames read, or a negative error code if nothing could be read.
+ */
+snd_pcm_sframes_t io_read_seq_avail( snd_pcm_t *pcm, const struct alsa_config *config,
+        struct seq_info *seq, void *buff, snd_pcm_uframes_t chunk );
+
+/*
+ * read up to 'frames' frames into 'buff', without checking them (even in mmap mode).
+ * The frames are checked later with io_check_seq(), possibly from another thread.
+ *
+ * return the number of frames read, or a negative error code.
+ */
+snd_pcm_sframes_t io_read( snd_pcm_t *pcm, const struct alsa_config *config,
+        const struct seq_info *seq, void *buff, snd_pcm_uframes_t frames );
+
+/*
+ * check 'frames' frames read by io_read() into 'buff', 'buff_frames' being
+ * the size of the io_read() request.
+ */
+void io_check_seq( struct seq_info *seq, const void *buff,
+        snd_pcm_uframes_t buff_frames, snd_pcm_uframes_t frames );
+
+#endif //__io_h__
@@ -0,0 +1,432 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "latency_search.h"
+#include "io.h"
+#include "log.h"
+
+
+static double latency_point_xrun_rate( const struct latency_point *p ) {
+    return p->time > 0 ? p->xruns * 60. / p->time : 0.;
+}
+
+
+static int latency_point_stable( const struct test_latency_search *tp, const struct latency_point *p ) {
+    return p->state == LP_DONE && latency_point_xrun_rate( p ) <= tp->opts.max_xrun_rate;
+}
+
+
+/* smallest buffer first, then smallest start threshold */
+static int latency_point_cmp( const void *a, const void *b ) {
+    const struct latency_point *pa = a, *pb = b;
+    unsigned long la = (unsigned long)pa->period * pa->count;
+    unsigned long lb = (unsigned long)pb->period * pb->count;
+
+    if (la != lb)
+        return la < lb ? -1 : 1;
+    if (pa->threshold != pb->threshold)
+        return pa->threshold < pb->threshold ? -1 : 1;
+    if (pa->period != pb->period)
+        return pa->period < pb->period ? -1 : 1;
+    return 0;
+}
+
+
+/*
+ * return the stable point with the smallest buffer, -1 if none
+ */
+static int latency_search_best( const struct test_latency_search *tp ) {
+    int best = -1;
+    unsigned i;
+
+    for (i = 0; i < tp->points_count; i++) {
+        const struct latency_point *p = &tp->points[i];
+        if (!latency_point_stable( tp, p ))
+            continue;
+        if (best < 0 || p->buffer_size < tp->points[best].buffer_size)
+            best = i;
+    }
+    return best;
+}
+
+
+/*
+ * setup the PCM for the current point.
+ * The first point is the one the PCM was opened with: the others go
+ * through snd_pcm_hw_free() and new hw params, without closing the PCM.
+ */
+static int latency_search_setup( struct test_latency_search *tp ) {
+    struct latency_point *p = &tp->points[tp->current];
+    struct alsa_config *config = &tp->t.config;
+    snd_pcm_uframes_t buffer_size, period_size;
+    void *buff;
+    int r;
+
+    if (tp->current > 0) {
+        config->period = p->period;
+        config->buffer_period_count = p->count;
+        config->start_threshold = p->threshold;
+        if (alsa_device_reconfigure( tp->t.device, config, tp->pcm, tp->caps ) < 0)
+            return -1;
+    }
+    if (snd_pcm_get_params( tp->pcm, &buffer_size, &period_size ) < 0)
+        return -1;
+    p->actual_period = config->period;
+    p->buffer_size = buffer_size;
+
+    buff = realloc( tp->periof_buff, snd_pcm_frames_to_bytes( tp->pcm, config->period ));
+    if (!buff)
+        return -1;
+    tp->periof_buff = buff;
+
+    r = snd_pcm_poll_descriptors(tp->pcm, &tp->pollfd, 1);
+    if (r < 0) {
+        err("%s: snd_pcm_poll_descriptors failed", tp->t.device);
+        return -1;
+    }
+    ev_io_set( &tp->io_watcher,
+            tp->pollfd.fd,
+            ((tp->pollfd.events & POLLIN) ? EV_READ : 0) |
+            ((tp->pollfd.events & POLLOUT) ? EV_WRITE : 0)
+            );
+    return stream_stats_reset( &tp->stats, tp->pcm, config->rate );
+}
+
+
+/*
+ * queue the first period (playback), or start the capture
+ */
+static int latency_search_stream_start( struct test_latency_search *tp ) {
+    snd_pcm_sframes_t frames;
+    int r;
+
+    if (tp->opts.capture) {
+        seq_check_jump_notify( &tp->seq );
+        r = snd_pcm_start( tp->pcm );
+        if (r < 0) {
+            err("%s: capture start failed: %s", tp->t.device, snd_strerror(r));
+            return -1;
+        }
+        return 0;
+    }
+    frames = io_write_seq( tp->pcm, &tp->t.config, &tp->seq, tp->periof_buff, tp->t.config.period );
+    stream_stats_transfer( &tp->stats, frames );
+    if (frames < 0) {
+        err("%s: playback write failed: %s", tp->t.device, snd_strerror(frames));
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * check the point against the probe cache, to skip it without setting the PCM up
+ * if it is impossible
+ */
+static int latency_point_supported( struct test_latency_search *tp, struct latency_point *p ) {
+    struct alsa_config config = tp->t.config;
+
+    config.period = p->period;
+    config.buffer_period_count = p->count;
+    if (tp->caps && !probe_caps_check( tp->caps, &config, 1, p->reason, sizeof(p->reason) )) {
+        warn("%s: period %u x %u: %s (probe cache), skipped", tp->t.device, p->period, p->count, p->reason);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * run the next point which can be set up. Stop the test after the last one
+ */
+static void latency_search_run( struct test_latency_search *tp ) {
+    for (; tp->current < tp->points_count; tp->current++) {
+        struct latency_point *p = &tp->points[tp->current];
+
+        if (!latency_point_supported( tp, p )) {
+            p->state = LP_UNSUPPORTED;
+            continue;
+        }
+        if (latency_search_setup( tp ) < 0 || latency_search_stream_start( tp ) < 0) {
+            warn("%s: period %u x %u, start threshold %u: setup failed, skipped",
+                    tp->t.device, p->period, p->count, p->threshold);
+            p->state = LP_SETUP_FAILED;
+            continue;
+        }
+        dbg("%s: period %u x %u (%lu frames), start threshold %u", tp->t.device,
+                p->actual_period, p->count, p->buffer_size, p->threshold);
+        p->state = LP_RUNNING;
+        tp->point_start = ev_now( tp->t.loop );
+        ev_io_start( tp->t.loop, &tp->io_watcher );
+        ev_timer_set( &tp->soak_timer, tp->opts.soak_time, 0 );
+        ev_timer_start( tp->t.loop, &tp->soak_timer );
+        return;
+    }
+    dbg("%s: end of the latency search", tp->t.device);
+    ev_unloop( tp->t.loop, EVUNLOOP_ALL );
+}
+
+
+static void latency_search_io_job( struct ev_loop *loop, struct ev_io *w, int revents ) {
+    struct test_latency_search *tp = (struct test_latency_search *)(w->data);
+    struct latency_point *p = &tp->points[tp->current];
+    snd_pcm_sframes_t frames;
+    int r;
+
+    stream_stats_wakeup( &tp->stats, tp->pcm );
+
+    if (tp->opts.capture)
+        frames = io_read_seq_avail( tp->pcm, &tp->t.config, &tp->seq, tp->periof_buff, tp->t.config.period );
+    else
+        frames = io_write_seq_avail( tp->pcm, &tp->t.config, &tp->seq, tp->periof_buff, tp->t.config.period );
+    stream_stats_transfer( &tp->stats, frames );
+
+    if (frames < 0) {
+        warn("%s: [%.3f s] period %u x %u: %s", tp->t.device, ev_now( loop ) - tp->point_start,
+                p->actual_period, p->count, snd_strerror(frames));
+        if (frames == -EBADFD) {
+            err("unrecoverable alsa error");
+            ev_unloop(loop, EVUNLOOP_ALL);
+            return;
+        }
+        p->xruns++;
+        r = snd_pcm_recover(tp->pcm, frames, 0);
+        if (r < 0)
+            err("%s: recover failed: %s", tp->t.device, snd_strerror(r));
+        stream_stats_break( &tp->stats );
+        if (latency_search_stream_start( tp ) < 0) {
+            ev_unloop(loop, EVUNLOOP_ALL);
+            return;
+        }
+    }
+    stream_stats_done( &tp->stats );
+}
+
+
+/*
+ * end of the soak time of the current point
+ */
+static void latency_search_soak_end( struct ev_loop *loop, struct ev_timer *w, int revents ) {
+    struct test_latency_search *tp = (struct test_latency_search *)(w->data);
+    struct latency_point *p = &tp->points[tp->current];
+
+    ev_io_stop( loop, &tp->io_watcher );
+    snd_pcm_drop( tp->pcm );
+
+    p->time = ev_now( loop ) - tp->point_start;
+    p->interval = tp->stats.interval;
+    p->state = LP_DONE;
+    warn("%s: period %u x %u (%lu frames), start threshold %u: %u xruns in %.1f s",
+            tp->t.device, p->actual_period, p->count, p->buffer_size, p->threshold, p->xruns, p->time);
+
+    if (tp->opts.first_stable && latency_point_stable( tp, p )) {
+        dbg("%s: first stable point found", tp->t.device);
+        ev_unloop( loop, EVUNLOOP_ALL );
+        return;
+    }
+    tp->current++;
+    latency_search_run( tp );
+}
+
+
+static int latency_search_start(struct test *t) {
+    struct test_latency_search *tp = (struct test_latency_search *)t;
+    dbg("%s: latency_search_start, %u points of %d s", tp->t.device, tp->points_count, tp->opts.soak_time);
+
+    latency_search_run( tp );
+    return 0;
+}
+
+
+static void latency_point_print( const struct test_latency_search *tp, const struct latency_point *p, const char *prefix ) {
+    double ms = 1e3 / tp->t.config.rate;
+    char threshold[16] = "default";
+
+    if (p->threshold)
+        snprintf( threshold, sizeof(threshold), "%u", p->threshold );
+
+    switch (p->state) {
+    case LP_SETUP_FAILED:
+        printf("%s: period %u x %u, start threshold %s: setup failed\n", prefix, p->period, p->count, threshold);
+        break;
+    case LP_UNSUPPORTED:
+        printf("%s: period %u x %u, start threshold %s: not supported: %s\n",
+                prefix, p->period, p->count, threshold, p->reason);
+        break;
+    case LP_RUNNING:
+    case LP_DONE:
+        printf("%s: period %u x %u, buffer %lu frames (%.2f ms), start threshold %s: %u xruns in %.1f s (%.2f / min)%s\n",
+                prefix, p->actual_period, p->count, p->buffer_size, p->buffer_size * ms, threshold,
+                p->xruns, p->time, latency_point_xrun_rate( p ),
+                p->state == LP_RUNNING ? ", running" : "");
+        break;
+    }
+}
+
+
+static void latency_search_report(struct test *t) {
+    struct test_latency_search *tp = (struct test_latency_search *)t;
+    struct latency_point *p;
+    char prefix[128];
+    unsigned i;
+    int best;
+
+    /* the point in progress */
+    if (tp->current < tp->points_count && tp->points[tp->current].state == LP_RUNNING) {
+        p = &tp->points[tp->current];
+        p->time = ev_now( tp->t.loop ) - tp->point_start;
+        p->interval = tp->stats.interval;
+    }
+
+    for (i = 0; i < tp->points_count; i++)
+        latency_point_print( tp, &tp->points[i], tp->stats.name );
+
+    best = latency_search_best( tp );
+    if (best < 0) {
+        printf("%s: no stable configuration\n", tp->stats.name);
+        return;
+    }
+    p = &tp->points[best];
+    snprintf( prefix, sizeof(prefix), "%s: lowest stable", tp->stats.name );
+    latency_point_print( tp, p, prefix );
+    hist_print( &p->interval, prefix, "interval (us)", 1e3 );
+}
+
+
+static int latency_search_close(struct test *t) {
+    struct test_latency_search *tp = (struct test_latency_search *)t;
+    int exit_status = latency_search_best( tp ) < 0;
+
+    ev_io_stop( tp->t.loop, &tp->io_watcher );
+    ev_timer_stop( tp->t.loop, &tp->soak_timer );
+    snd_pcm_close( tp->pcm );
+
+    stream_stats_release( &tp->stats );
+    seq_release( &tp->seq );
+    free( tp->periof_buff );
+    free( tp->points );
+    free( tp );
+    return exit_status;
+}
+
+
+
+const struct test_ops latency_search_ops = {
+        .start = latency_search_start,
+        .close = latency_search_close,
+        .report = latency_search_report,
+};
+
+
+/*
+ * every combination of the swept values
+ */
+static int latency_search_points( struct test_latency_search *tp ) {
+    struct latency_search_create_opts *o = &tp->opts;
+    unsigned i, j, k, n = 0;
+
+    if (!o->periods_count)
+        o->periods[o->periods_count++] = tp->t.config.period;
+    if (!o->counts_count)
+        o->counts[o->counts_count++] = tp->t.config.buffer_period_count;
+    if (!o->thresholds_count || o->capture) {
+        /* no start threshold for the capture */
+        o->thresholds[0] = tp->t.config.start_threshold;
+        o->thresholds_count = 1;
+    }
+
+    tp->points_count = o->periods_count * o->counts_count * o->thresholds_count;
+    tp->points = calloc( tp->points_count, sizeof(*tp->points) );
+    if (!tp->points)
+        return -1;
+    for (i = 0; i < o->periods_count; i++) {
+        for (j = 0; j < o->counts_count; j++) {
+            for (k = 0; k < o->thresholds_count; k++) {
+                tp->points[n].period = o->periods[i];
+                tp->points[n].count = o->counts[j];
+                tp->points[n].threshold = o->thresholds[k];
+                n++;
+            }
+        }
+    }
+    qsort( tp->points, tp->points_count, sizeof(*tp->points), latency_point_cmp );
+    return 0;
+}
+
+
+/*
+ * do a latency_search test:
+ * - sweep the period size, the buffer size (in periods) and the playback start
+ *   threshold, from the smallest buffer to the largest
+ * - at every point, run the stream for the soak time and count the xruns
+ * - report the stable configuration with the smallest buffer
+ */
+struct test *latency_search_create(struct alsa_config *config, struct latency_search_create_opts *opts) {
+    struct test_latency_search *tp = calloc( 1, sizeof(*tp));
+    char name[96];
+    int r;
+
+    if (!tp) return NULL;
+
+    tp->t.name = "latency_search";
+    tp->opts = *opts;
+    if (tp->opts.soak_time <= 0)
+        tp->opts.soak_time = 10;
+    memcpy( &tp->t.config, config, sizeof(*config));
+    memcpy( tp->t.device, config->device, sizeof(tp->t.device) );
+    if (tp->t.config.timer_sched) {
+        warn("%s: timer scheduled mode not supported by latency_search: using the period wake ups", tp->t.device);
+        tp->t.config.timer_sched = 0;
+    }
+
+    if (latency_search_points( tp ) < 0)
+        goto failed1;
+
+    /* open with the first point */
+    tp->t.config.period = tp->points[0].period;
+    tp->t.config.buffer_period_count = tp->points[0].count;
+    tp->t.config.start_threshold = tp->points[0].threshold;
+    r = alsa_device_open( tp->t.config.device, &tp->t.config,
+            tp->opts.capture ? &tp->pcm : NULL, tp->opts.capture ? NULL : &tp->pcm );
+    if (r) goto failed1;
+    tp->caps = probe_cache_find( tp->pcm, tp->t.device );
+
+    if (seq_init( &tp->seq, tp->t.config.channels, tp->t.config.format,
+            alsa_access_is_interleaved( tp->t.config.access ))) goto failed;
+
+    r = snd_pcm_poll_descriptors_count(tp->pcm);
+    if (r != 1) {
+        err("latency_search_create: expect only 1 fd to monitor (snd_pcm_poll_descriptors_count)");
+        goto failed;
+    }
+
+    ev_io_init( &tp->io_watcher, latency_search_io_job, -1, 0 );
+    tp->io_watcher.data = tp;
+    ev_timer_init( &tp->soak_timer, latency_search_soak_end, 0, 0 );
+    tp->soak_timer.data = tp;
+    snprintf( name, sizeof(name), "%s latency search %s", tp->t.device, tp->opts.capture ? "capture" : "playback" );
+    if (stream_stats_init( &tp->stats, tp->pcm, tp->t.config.rate, name ) < 0)
+        goto failed;
+
+    tp->t.ops = &latency_search_ops;
+
+    return &tp->t;
+
+failed:
+    snd_pcm_close( tp->pcm );
+    stream_stats_release( &tp->stats );
+    seq_release( &tp->seq );
+failed1:
+    free( tp->points );
+    free( tp );
+    return NULL;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef __latency_search_h__
+#define __latency_search_h__
+
+#include <poll.h>
+#include <ev.h>
+
+#include "test.h"
+#include "seq.h"
+#include "hist.h"
+#include "probe.h"
+
+/* maximum number of values of every swept parameter */
+#define LATENCY_SEARCH_MAX_VALUES 8
+
+struct latency_search_create_opts {
+    /* swept values. Empty lists use the test config */
+    unsigned periods[LATENCY_SEARCH_MAX_VALUES];        /* frames */
+    unsigned periods_count;
+    unsigned counts[LATENCY_SEARCH_MAX_VALUES];         /* buffer size, in periods */
+    unsigned counts_count;
+    unsigned thresholds[LATENCY_SEARCH_MAX_VALUES];     /* playback start threshold, in frames (0: default) */
+    unsigned thresholds_count;
+
+    int soak_time;      /* seconds run at every point (default 10) */
+    double max_xrun_rate; /* xruns per minute of a stable point (default 0) */
+    int capture;        /* search on the capture stream instead of the playback */
+    int first_stable;   /* stop at the first stable point */
+};
+
+
+/*
+ * one configuration of the search, and its result
+ */
+struct latency_point {
+    unsigned period;            /* requested */
+    unsigned count;
+    unsigned threshold;
+
+    int state;                  /* LP_* */
+    unsigned actual_period;     /* as set up by the PCM */
+    unsigned long buffer_size;
+    unsigned xruns;
+    double time;                /* seconds run */
+    struct hist interval;       /* wake up intervals, in ns */
+    char reason[96];            /* LP_UNSUPPORTED */
+};
+
+enum {
+    LP_PENDING = 0,
+    LP_RUNNING,
+    LP_DONE,
+    LP_SETUP_FAILED,
+    LP_UNSUPPORTED,             /* impossible according to the probe cache: not set up */
+};
+
+
+struct test_latency_search {
+    struct test t;
+    snd_pcm_t *pcm;
+    const struct probe_caps *caps;  /* NULL if not in the probe cache */
+    struct seq_info seq;
+    void *periof_buff;
+
+    struct pollfd pollfd;
+    struct ev_io io_watcher;
+    struct ev_timer soak_timer;
+
+    struct stream_stats stats;
+
+    /* sorted by buffer size, then start threshold */
+    struct latency_point *points;
+    unsigned points_count;
+    unsigned current;
+    ev_tstamp point_start;
+
+    struct latency_search_create_opts opts;
+};
+
+struct test *latency_search_create(struct alsa_config *config, struct latency_search_create_opts *opts);
+
+#endif //__latency_search_h__
@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "log.h"
+
+
+int log_async = 0;
+unsigned log_rate_limit = 0;
+
+/*
+ * bounded multi producers / single consumer ring.
+ * A slot is free for the producer reserving position 'pos' when its seq equals 'pos',
+ * and ready for the consumer when its seq equals 'pos + 1'.
+ */
+static struct log_record *log_ring = NULL;
+static atomic_uint log_enqueue_pos;
+static unsigned log_dequeue_pos;
+static atomic_uint log_dropped;
+
+static pthread_t log_flusher;
+static atomic_int log_flusher_stop;
+
+
+static uint64_t log_now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+struct log_record *log_record_get( const struct log_site *site )
+{
+    unsigned pos = atomic_load_explicit( &log_enqueue_pos, memory_order_relaxed );
+    struct log_record *r;
+
+    while (1) {
+        r = &log_ring[ pos & (LOG_RING_SIZE - 1) ];
+        int diff = (int)(atomic_load_explicit( &r->seq, memory_order_acquire ) - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit( &log_enqueue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed ))
+                break;
+        } else if (diff < 0) {
+            /* full */
+            atomic_fetch_add_explicit( &log_dropped, 1, memory_order_relaxed );
+            return NULL;
+        } else {
+            pos = atomic_load_explicit( &log_enqueue_pos, memory_order_relaxed );
+        }
+    }
+
+    r->timestamp = log_now();
+    r->site = site;
+    r->nargs = 0;
+    r->str_len = 0;
+    return r;
+}
+
+
+void log_record_put( struct log_record *r )
+{
+    unsigned pos = atomic_load_explicit( &r->seq, memory_order_relaxed );
+    atomic_store_explicit( &r->seq, pos + 1, memory_order_release );
+}
+
+
+/*
+ * format one argument with the conversion specification 'spec'
+ * return the number of arguments used
+ */
+static int log_format_arg( FILE *f, const char *spec, char conv, const char *length,
+        const struct log_record *r, unsigned index )
+{
+    const union log_arg *a;
+
+    if (index >= r->nargs) {
+        fputs( spec, f );
+        return 0;
+    }
+    a = &r->args[index];
+
+    switch (conv) {
+    case 'd': case 'i':
+        if (!strcmp( length, "ll" )) fprintf( f, spec, (long long)a->i );
+        else if (!strcmp( length, "l" ) || !strcmp( length, "z" )) fprintf( f, spec, (long)a->i );
+        else fprintf( f, spec, (int)a->i );
+        break;
+    case 'u': case 'x': case 'X': case 'o':
+        if (!strcmp( length, "ll" )) fprintf( f, spec, (unsigned long long)a->i );
+        else if (!strcmp( length, "l" ) || !strcmp( length, "z" )) fprintf( f, spec, (unsigned long)a->i );
+        else fprintf( f, spec, (unsigned)a->i );
+        break;
+    case 'c':
+        fprintf( f, spec, (int)a->i );
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        fprintf( f, spec, a->d );
+        break;
+    case 's':
+        fprintf( f, spec, r->str + a->str );
+        break;
+    case 'p':
+        fprintf( f, spec, a->p );
+        break;
+    default:
+        fputs( spec, f );
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * print the line of a log_samples() call: "<prefix>:   <sample> <sample> ..."
+ */
+static void log_samples_print( FILE *f, const char *prefix, const unsigned char *sample,
+        unsigned sample_bytes, unsigned count )
+{
+    char line[LOG_SAMPLES_LINE];
+    unsigned i;
+    int pos;
+
+    strcpy( line, "  "); /* indentation */
+    pos = strlen(line);
+    for (i = 0; i < count; i++) {
+        uint32_t v = 0;
+        int b;
+        for (b = sample_bytes - 1; b >= 0; b--)
+            v = (v << 8) | sample[b];
+        if (pos < sizeof(line)-1)
+            pos += snprintf(line + pos, sizeof(line) - pos - 1, "%0*x ", sample_bytes * 2, (unsigned)v);
+        sample += sample_bytes;
+    }
+    fprintf( f, "%s: %s\n", prefix, line );
+}
+
+
+void log_samples_put( const struct log_site *site, const char *prefix,
+        const void *samples, unsigned sample_bytes, unsigned count )
+{
+    struct log_record *r;
+    unsigned max;
+
+    if (!log_async) {
+        log_samples_print( stdout, prefix, samples, sample_bytes, count );
+        return;
+    }
+    r = log_record_get( site );
+    if (!r)
+        return;
+    /* args: prefix, sample bytes, count, then the samples in log_record.str */
+    log_arg_str( r, prefix );
+    /* no more than the room left, and the samples shown on the line */
+    max = (LOG_STR_BYTES - r->str_len) / sample_bytes;
+    if (max > LOG_SAMPLES_LINE / (2 * sample_bytes + 1) + 1)
+        max = LOG_SAMPLES_LINE / (2 * sample_bytes + 1) + 1;
+    if (count > max)
+        count = max;
+    log_arg_int( r, sample_bytes );
+    log_arg_int( r, count );
+    r->args[r->nargs++].str = r->str_len;
+    memcpy( r->str + r->str_len, samples, count * sample_bytes );
+    r->str_len += count * sample_bytes;
+    log_record_put( r );
+}
+
+
+/*
+ * the printf() job, done by the flusher thread
+ * '*' width or precision are taken from the arguments as well.
+ */
+static void log_format( FILE *f, const struct log_record *r )
+{
+    const char *p = r->site->format;
+    unsigned index = 0;
+
+    fprintf( f, "[%5llu.%06llu] ", (unsigned long long)(r->timestamp / 1000000000ull),
+            (unsigned long long)(r->timestamp % 1000000000ull) / 1000 );
+
+    if (r->site->samples) {
+        log_samples_print( f, r->str + r->args[0].str, (const unsigned char *)r->str + r->args[3].str,
+                r->args[1].i, r->args[2].i );
+        return;
+    }
+
+    while (*p) {
+        char spec[32];
+        char length[3] = "";
+        unsigned n = 0, l = 0;
+
+        if (*p != '%') {
+            fputc( *p++, f );
+            continue;
+        }
+        if (p[1] == '%') {
+            fputc( '%', f );
+            p += 2;
+            continue;
+        }
+
+        /* %[flags][width][.precision][length]conversion */
+        spec[n++] = *p++;
+        while (*p && strchr( "-+ #0", *p ) && n < sizeof(spec) - 4)
+            spec[n++] = *p++;
+        while (*p && (strchr( "0123456789.", *p ) || *p == '*') && n < sizeof(spec) - 4) {
+            if (*p == '*') {
+                /* replace the '*' by its value */
+                int v = index < r->nargs ? (int)r->args[index++].i : 0;
+                n += snprintf( spec + n, sizeof(spec) - 4 - n, "%d", v );
+                if (n > sizeof(spec) - 4) n = sizeof(spec) - 4;
+                p++;
+            } else {
+                spec[n++] = *p++;
+            }
+        }
+        while (*p && strchr( "hlzjt", *p )) {
+            if (l < sizeof(length) - 1)
+                length[l++] = *p;
+            length[l] = '\0';
+            spec[n++] = *p++;
+        }
+        if (!*p)
+            break;
+        spec[n++] = *p;
+        spec[n] = '\0';
+        index += log_format_arg( f, spec, *p, length, r, index );
+        p++;
+    }
+}
+
+
+static void *log_flusher_thread( void *arg )
+{
+    struct timespec idle = { 0, 10000000 }; /* 10ms */
+
+    while (1) {
+        struct log_record *r = &log_ring[ log_dequeue_pos & (LOG_RING_SIZE - 1) ];
+        unsigned dropped;
+
+        if (atomic_load_explicit( &r->seq, memory_order_acquire ) == log_dequeue_pos + 1) {
+            log_format( stdout, r );
+            /* give the slot back, for the next ring turn */
+            atomic_store_explicit( &r->seq, log_dequeue_pos + LOG_RING_SIZE, memory_order_release );
+            log_dequeue_pos++;
+            continue;
+        }
+
+        /* empty */
+        dropped = atomic_exchange( &log_dropped, 0 );
+        if (dropped)
+            printf( "log: %u messages dropped (ring full)\n", dropped );
+        fflush( stdout );
+        if (atomic_load( &log_flusher_stop ))
+            break;
+        nanosleep( &idle, NULL );
+    }
+    return NULL;
+}
+
+
+int log_async_start( void )
+{
+    unsigned i;
+    int r;
+
+    if (log_async)
+        return 0;
+
+    log_ring = calloc( LOG_RING_SIZE, sizeof(*log_ring) );
+    if (!log_ring) {
+        printf( "err: can't allocate the log ring\n" );
+        return -1;
+    }
+    for (i = 0; i < LOG_RING_SIZE; i++)
+        atomic_init( &log_ring[i].seq, i );
+    atomic_init( &log_enqueue_pos, 0 );
+    atomic_init( &log_dropped, 0 );
+    atomic_init( &log_flusher_stop, 0 );
+    log_dequeue_pos = 0;
+
+    r = pthread_create( &log_flusher, NULL, log_flusher_thread, NULL );
+    if (r) {
+        printf( "err: can't create the log thread: %s\n", strerror(r) );
+        free( log_ring );
+        log_ring = NULL;
+        return -1;
+    }
+    log_async = 1;
+    /* flush the pending records on exit() as well */
+    atexit( log_async_stop );
+    return 0;
+}
+
+
+/*
+ * print every pending record and get back to synchronous logs
+ */
+void log_async_stop( void )
+{
+    if (!log_async)
+        return;
+    atomic_store( &log_flusher_stop, 1 );
+    pthread_join( log_flusher, NULL );
+    log_async = 0;
+    /* the ring is not freed: a late producer may still hold a record */
+}
+
+
+static void log_suppressed( const struct log_site *site, unsigned n )
+{
+    if (log_async) {
+        static const struct log_site suppressed_site = { "log: %u messages suppressed: %s" };
+        struct log_record *r = log_record_get( &suppressed_site );
+        if (r) {
+            log_arg_int( r, n );
+            log_arg_str( r, site->format );
+            log_record_put( r );
+        }
+    } else {
+        printf( "log: %u messages suppressed: %s", n, site->format );
+    }
+}
+
+
+int log_site_rate_check( struct log_site *site )
+{
+    unsigned now = (unsigned)(log_now() / 1000000000ull);
+    unsigned window = atomic_load_explicit( &site->window, memory_order_relaxed );
+
+    if (window != now &&
+        atomic_compare_exchange_strong( &site->window, &window, now )) {
+        /* new window */
+        unsigned suppressed = atomic_exchange( &site->suppressed, 0 );
+        atomic_store( &site->count, 0 );
+        if (suppressed)
+            log_suppressed( site, suppressed );
+    }
+
+    if (atomic_fetch_add_explicit( &site->count, 1, memory_order_relaxed ) < log_rate_limit)
+        return 1;
+    atomic_fetch_add_explicit( &site->suppressed, 1, memory_order_relaxed );
+    return 0;
+}
@@ -1,14 +1,195 @@
 
 
 
+#ifndef __log_h__
+#define __log_h__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
 enum log_level {
     LOG_WARN,
     LOG_ERR
 };
 
 
-#define warn(format, arg...) printf( "warn: " format "\n", ##arg )
-#define err(format, arg...)  printf( "err: " format "\n", ##arg )
-#define dbg(format, arg...)  printf( "dbg: " format "\n", ##arg )
+/*
+ * compile time log level: messages above LOG_LEVEL are compiled out
+ * (ie. CFLAGS="-DLOG_LEVEL=LOG_LEVEL_WARN" removes every dbg())
+ */
+#define LOG_LEVEL_ERR   0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_DBG   2
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DBG
+#endif
+
+
+#define warn(format, arg...) LOG_PRINTF( LOG_LEVEL_WARN, "warn: " format "\n", ##arg )
+#define err(format, arg...)  LOG_PRINTF( LOG_LEVEL_ERR,  "err: " format "\n", ##arg )
+#define dbg(format, arg...)  LOG_PRINTF( LOG_LEVEL_DBG,  "dbg: " format "\n", ##arg )
+
+#define log(level, format, arg...)  LOG_PRINTF( (level) == LOG_ERR ? LOG_LEVEL_ERR : LOG_LEVEL_WARN, \
+        "%s: " format "\n", (level) == LOG_ERR ? "err" : "warn", ##arg )
+
+
+/*
+ * By default, messages are printed synchronously with printf().
+ *
+ * Once log_async_start() is called, messages are stored as fixed size binary
+ * records (format, arguments, monotonic timestamp) into a preallocated lock free
+ * ring, and a background thread formats and prints them. The caller only pays
+ * a timestamp read and a few stores. Records are dropped (and counted) when
+ * the ring is full.
+ *
+ * Strings arguments are copied into the record (truncated to LOG_STR_BYTES overall).
+ */
+#define LOG_MAX_ARGS    10
+#define LOG_STR_BYTES   320
+#define LOG_RING_SIZE   1024    /* records, power of 2 */
+
+extern int log_async;
+
+/*
+ * per site rate limiting: if not 0, each log site prints at most
+ * 'log_rate_limit' messages per second, and reports how many were suppressed.
+ */
+extern unsigned log_rate_limit;
+
+/* one per warn()/err()/dbg()/log()/log_samples() call site */
+struct log_site {
+    const char *format;
+    int samples;                /* log_samples() site: the records hold raw samples */
+    atomic_uint window;         /* current rate limiting window (seconds) */
+    atomic_uint count;          /* messages in the current window */
+    atomic_uint suppressed;     /* messages suppressed in the current window */
+};
+
+union log_arg {
+    long long i;
+    double d;
+    const void *p;
+    unsigned str;               /* offset in log_record.str */
+};
+
+struct log_record {
+    atomic_uint seq;            /* ring slot sequence number */
+    uint64_t timestamp;         /* CLOCK_MONOTONIC, in ns */
+    const struct log_site *site;
+    unsigned nargs;
+    unsigned str_len;
+    union log_arg args[LOG_MAX_ARGS];
+    char str[LOG_STR_BYTES];
+};
+
+int log_async_start( void );
+void log_async_stop( void );
+
+/* return the record to fill, or NULL if the ring is full */
+struct log_record *log_record_get( const struct log_site *site );
+void log_record_put( struct log_record *r );
+
+int log_site_rate_check( struct log_site *site );
+
+static inline int log_site_allow( struct log_site *site ) {
+    return log_rate_limit ? log_site_rate_check( site ) : 1;
+}
+
+
+static inline void log_arg_int( struct log_record *r, long long v ) {
+    if (r->nargs < LOG_MAX_ARGS)
+        r->args[r->nargs++].i = v;
+}
+
+static inline void log_arg_double( struct log_record *r, double v ) {
+    if (r->nargs < LOG_MAX_ARGS)
+        r->args[r->nargs++].d = v;
+}
+
+static inline void log_arg_ptr( struct log_record *r, const void *v ) {
+    if (r->nargs < LOG_MAX_ARGS)
+        r->args[r->nargs++].p = v;
+}
+
+/*
+ * the strings are truncated to the room left in log_record.str. Once it is full,
+ * the next strings are empty: they point to the terminator of the last one.
+ */
+static inline void log_arg_str( struct log_record *r, const char *v ) {
+    unsigned offset = r->str_len;
+    if (r->nargs >= LOG_MAX_ARGS)
+        return;
+    if (r->str_len >= LOG_STR_BYTES) {
+        r->args[r->nargs++].str = LOG_STR_BYTES - 1;
+        return;
+    }
+    while (*v && r->str_len < LOG_STR_BYTES - 1)
+        r->str[r->str_len++] = *v++;
+    r->str[r->str_len++] = '\0';
+    r->args[r->nargs++].str = offset;
+}
+
+#define LOG_ARG(r, x) _Generic( (x),                            \
+        char *: log_arg_str,                                    \
+        const char *: log_arg_str,                              \
+        float: log_arg_double,                                  \
+        double: log_arg_double,                                 \
+        void *: log_arg_ptr,                                    \
+        const void *: log_arg_ptr,                              \
+        default: log_arg_int )( r, x )
+
+#define LOG_NARGS(arg...) LOG_NARGS_( 0, ##arg, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0 )
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, N, ...) N
+
+#define LOG_ARGS_0(r)
+#define LOG_ARGS_1(r, a)      LOG_ARG( r, a );
+#define LOG_ARGS_2(r, a, ...) LOG_ARG( r, a ); LOG_ARGS_1( r, __VA_ARGS__ )
+#define LOG_ARGS_3(r, a, ...) LOG_ARG( r, a ); LOG_ARGS_2( r, __VA_ARGS__ )
+#define LOG_ARGS_4(r, a, ...) LOG_ARG( r, a ); LOG_ARGS_3( r, __VA_ARGS__ )
+#define LOG_ARGS_5(r, a, ...) LOG_ARG( r, a ); LOG_ARGS_4( r, __VA_ARGS__ )
+#define LOG_ARGS_6(r, a, ...) LOG_ARG( r, a ); LOG_ARGS_5( r, __VA_ARGS__ )
+#define LOG_ARGS_7(r, a, ...) LOG_ARG( r, a ); LOG_ARGS_6( r, __VA_ARGS__ )
+#define LOG_ARGS_8(r, a, ...) LOG_ARG( r, a ); LOG_ARGS_7( r, __VA_ARGS__ )
+#define LOG_ARGS_9(r, a, ...) LOG_ARG( r, a ); LOG_ARGS_8( r, __VA_ARGS__ )
+#define LOG_ARGS_10(r, a, ...) LOG_ARG( r, a ); LOG_ARGS_9( r, __VA_ARGS__ )
+#define LOG_ARGS_CAT(a, b) a ## b
+#define LOG_ARGS_N(n) LOG_ARGS_CAT( LOG_ARGS_, n )
+#define LOG_ARGS(r, arg...) LOG_ARGS_N( LOG_NARGS( arg ) )( r, ##arg )
+
+/*
+ * hexadecimal dump of 'count' little endian samples of 'sample_bytes' bytes, on one
+ * line truncated to LOG_SAMPLES_LINE characters.
+ * With log_async, the raw samples are queued, and only formatted by the flusher thread.
+ */
+#define LOG_SAMPLES_LINE 160
+
+#define log_samples(level, samples, sample_bytes, count) do {                       \
+    static struct log_site __log_site = { "samples dump\n", 1 };                  \
+    if (((level) == LOG_ERR ? LOG_LEVEL_ERR : LOG_LEVEL_WARN) <= LOG_LEVEL &&        \
+        log_site_allow( &__log_site ))                                              \
+        log_samples_put( &__log_site, (level) == LOG_ERR ? "err" : "warn",          \
+                samples, sample_bytes, count );                                     \
+} while (0)
+
+void log_samples_put( const struct log_site *site, const char *prefix,
+        const void *samples, unsigned sample_bytes, unsigned count );
+
+
+#define LOG_PRINTF(level, format, arg...) do {                          \
+    static struct log_site __log_site = { format };                     \
+    if ((level) <= LOG_LEVEL && log_site_allow( &__log_site )) {        \
+        if (log_async) {                                                \
+            struct log_record *__log_r = log_record_get( &__log_site ); \
+            if (__log_r) {                                              \
+                LOG_ARGS( __log_r, ##arg )                              \
+                log_record_put( __log_r );                              \
+            }                                                           \
+        } else {                                                        \
+            printf( format, ##arg );                                    \
+        }                                                               \
+    }                                                                   \
+} while (0)
 
-#define log(level, format, arg...)  printf( "%s: " format "\n", level == LOG_ERR ? "err" : "warn", ##arg )
+#endif //__log_h__
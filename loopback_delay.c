@@ -7,19 +7,37 @@
  *  (at your option) any later version.
  */
 
+#include <time.h>
+
 #include "loopback_delay.h"
+#include "io.h"
 #include "log.h"
 
 
-static int loopback_delay_start(struct test *t) {
-    struct test_loopback_delay *tp = (struct test_loopback_delay *)t;
+static snd_pcm_sframes_t loopback_delay_write( struct test_loopback_delay *tp ) {
+    snd_pcm_sframes_t frames = io_write_seq( tp->pcm_p, &tp->t.config, &tp->seq_p,
+            tp->periof_buff, tp->t.config.period );
+    stream_stats_transfer( &tp->stats_p, frames );
+    return frames;
+}
+
+
+/*
+ * (re)start both streams from the first frame of the sequence,
+ * and measure the delay again
+ */
+static int loopback_delay_run( struct test_loopback_delay *tp ) {
     int r;
-    dbg("%s: loopback_delay_start", tp->t.device);
 
     /* first, prepare both streams at once */
     tp->delay_detected = 0;
     tp->measured_delay = 0;
+    tp->captured_frames = 0;
     tp->exit_status = 1; /* consider the test as failed until the first valid frame is received */
+    seq_reset( &tp->seq_p );
+    seq_reset( &tp->seq_c );
+    stream_stats_break( &tp->stats_p );
+    stream_stats_break( &tp->stats_c );
     r = snd_pcm_prepare(tp->pcm_c);
     if (r < 0) {
         warn("%s: loopback_delay capture prepare failed: %s", tp->t.device, snd_strerror(r));
@@ -29,7 +47,6 @@ static int loopback_delay_start(struct test *t) {
         warn("%s: loopback_delay playback prepare failed: %s", tp->t.device, snd_strerror(r));
     }
 
-    seq_fill_frames( &tp->seq_p, tp->periof_buff, tp->t.config.period );
     switch (tp->opts.start_sync_mode) {
     case LSM_PREPARE_CAPTURE_PLAYBACK:
         /* start the capture explicitly */
@@ -41,7 +58,7 @@ static int loopback_delay_start(struct test *t) {
         }
         /* playback is start by writing the first period */
         dbg("start playback");
-        snd_pcm_sframes_t frames = snd_pcm_writei(tp->pcm_p, tp->periof_buff, tp->t.config.period);
+        snd_pcm_sframes_t frames = loopback_delay_write( tp );
         if (frames < 0) {
             warn("%s: loopback_delay start playback failed: %s", tp->t.device, snd_strerror(r));
             return -1;
@@ -61,7 +78,7 @@ static int loopback_delay_start(struct test *t) {
          */
         /* playback is start by writing the first period */
         dbg("start playback");
-        snd_pcm_sframes_t frames = snd_pcm_writei(tp->pcm_p, tp->periof_buff, tp->t.config.period);
+        snd_pcm_sframes_t frames = loopback_delay_write( tp );
         if (frames < 0) {
             warn("%s: loopback_delay start playback failed: %s", tp->t.device, snd_strerror(r));
             return -1;
@@ -80,12 +97,136 @@ static int loopback_delay_start(struct test *t) {
     } break;
     }
 
-    ev_io_start( loop, &tp->io_watcher_p );
-    ev_io_start( loop, &tp->io_watcher_c );
+    ev_io_start( tp->t.loop, &tp->io_watcher_p );
+    ev_io_start( tp->t.loop, &tp->io_watcher_c );
+    return 0;
+}
+
+
+static void loopback_delay_halt( struct test_loopback_delay *tp ) {
+    ev_io_stop( tp->t.loop, &tp->io_watcher_p );
+    ev_io_stop( tp->t.loop, &tp->io_watcher_c );
+    snd_pcm_drop( tp->pcm_p );
+    snd_pcm_drop( tp->pcm_c );
+}
+
+
+/*
+ * recover from a xrun on any side: restart both streams, so the delay is measured again
+ */
+static void loopback_delay_recover( struct ev_loop *loop, struct test_loopback_delay *tp ) {
+    tp->xruns++;
+    loopback_delay_halt( tp );
+    if (loopback_delay_run( tp ) < 0) {
+        err("%s: loopback_delay restart after xrun failed", tp->t.device);
+        ev_unloop(loop, EVUNLOOP_ALL);
+    }
+}
+
+
+static int loopback_delay_start(struct test *t) {
+    struct test_loopback_delay *tp = (struct test_loopback_delay *)t;
+    dbg("%s: loopback_delay_start", tp->t.device);
+
+    tp->delay_periods = 0;
+    tp->delay_changes = 0;
+    tp->delay_sum = 0;
+    tp->start_time = ev_now( tp->t.loop );
+
+    if (loopback_delay_run( tp ) < 0)
+        return -1;
+
+    if (tp->opts.xrun) {
+        dbg("%s: will simulate xrun every %d ms", tp->t.device, tp->opts.xrun);
+        tp->timer_state = LT_W4_XRUN;
+        ev_timer_set( &tp->timer, tp->opts.xrun * 1e-3, 0);
+        ev_timer_start( tp->t.loop, &tp->timer );
+    } else if (tp->opts.restart_play_time && tp->opts.restart_pause_time) {
+        dbg("%s: will stop every %d ms during %d ms", tp->t.device, tp->opts.restart_play_time, tp->opts.restart_pause_time);
+        tp->timer_state = LT_W4_STOP;
+        ev_timer_set( &tp->timer, tp->opts.restart_play_time * 1e-3, 0);
+        ev_timer_start( tp->t.loop, &tp->timer );
+    }
     return 0;
 }
 
 
+static void loopback_delay_timer( struct ev_loop *loop, struct ev_timer *w, int revents) {
+    struct test_loopback_delay *tp = (struct test_loopback_delay *)(w->data);
+
+    switch (tp->timer_state) {
+    case LT_IDLE:
+        break;
+    case LT_W4_XRUN:
+        warn("%s: force loopback_delay xrun", tp->t.device);
+        /* simply stop handling both pcm handlers during few ms */
+        ev_io_stop( loop, &tp->io_watcher_p );
+        ev_io_stop( loop, &tp->io_watcher_c );
+        tp->timer_state = LT_W4_XRUN_END;
+        ev_timer_set( &tp->timer, 0.5, 0);
+        ev_timer_start( loop, &tp->timer );
+        break;
+
+    case LT_W4_XRUN_END:
+        warn("%s: LT_W4_XRUN_END", tp->t.device);
+        ev_io_start( loop, &tp->io_watcher_p );
+        ev_io_start( loop, &tp->io_watcher_c );
+        tp->timer_state = LT_W4_XRUN;
+        ev_timer_set( &tp->timer, tp->opts.xrun*1e-3, 0);
+        ev_timer_start( loop, &tp->timer );
+        break;
+
+    case LT_W4_STOP:
+        warn("%s: LT_W4_STOP", tp->t.device);
+        loopback_delay_halt( tp );
+        tp->timer_state = LT_W4_RESTART;
+        ev_timer_set( &tp->timer, tp->opts.restart_pause_time * 1e-3, 0);
+        ev_timer_start( loop, &tp->timer );
+        break;
+
+    case LT_W4_RESTART:
+        warn("%s: LT_W4_RESTART", tp->t.device);
+        if (loopback_delay_run( tp ) >= 0) {
+            tp->timer_state = LT_W4_STOP;
+            ev_timer_set( &tp->timer, tp->opts.restart_play_time * 1e-3, 0);
+            ev_timer_start( loop, &tp->timer );
+        } else {
+            err("%s: loopback_delay restart failure", tp->t.device);
+            ev_unloop(loop, EVUNLOOP_ALL);
+        }
+        break;
+    }
+}
+
+
+/*
+ * a new delay measurement: the first one, or after a xrun or restart
+ */
+static void loopback_delay_measured( struct test_loopback_delay *tp, int delay ) {
+    unsigned i;
+
+    if (!tp->measurements++) {
+        tp->first_delay = delay;
+    } else {
+        warn("%s: delay after restart #%u: %d frames, %s the first one (%d)", tp->t.device,
+                tp->measurements - 1, delay, delay == tp->first_delay ? "same as" : "different from",
+                tp->first_delay);
+    }
+
+    for (i = 0; i < tp->distinct_delays; i++) {
+        if (tp->delays[i].delay == delay) {
+            tp->delays[i].count++;
+            return;
+        }
+    }
+    if (i < sizeof(tp->delays) / sizeof(tp->delays[0])) {
+        tp->delays[i].delay = delay;
+        tp->delays[i].count = 1;
+        tp->distinct_delays++;
+    }
+}
+
+
 
 
 /*
@@ -95,9 +236,10 @@ static void loopback_delay_play_job( struct ev_loop *loop, struct ev_io *w, int
 
     struct test_loopback_delay *tp = (struct test_loopback_delay *)(w->data);
 
+    stream_stats_wakeup( &tp->stats_p, tp->pcm_p );
+
     /* simply fill a first period */
-    seq_fill_frames( &tp->seq_p, tp->periof_buff, tp->t.config.period );
-    snd_pcm_sframes_t frames = snd_pcm_writei(tp->pcm_p, tp->periof_buff, tp->t.config.period);
+    snd_pcm_sframes_t frames = loopback_delay_write( tp );
 
     if (frames < 0) {
         warn("%s: loopback_delay write failed: %s", tp->t.device, snd_strerror(frames));
@@ -106,56 +248,129 @@ static void loopback_delay_play_job( struct ev_loop *loop, struct ev_io *w, int
             ev_unloop(loop, EVUNLOOP_ALL);
             return;
         }
-        snd_pcm_recover(tp->pcm_p, frames, 0);
-
-        /* write again the period to start the stream again */
-        frames = snd_pcm_writei(tp->pcm_p, tp->periof_buff, tp->t.config.period);
-        if (frames < 0) {
-            err("%s: loopback_delay write failed after recover: %s", tp->t.device, snd_strerror(frames));
-            ev_unloop(loop, EVUNLOOP_ALL);
-            return;
-        }
+        loopback_delay_recover( loop, tp );
+        return;
     } else if (frames != tp->t.config.period) {
         err("%s: loopback_delay write less than the expected period size: %ld / %u", tp->t.device, frames, tp->t.config.period);
 
     }
+    stream_stats_done( &tp->stats_p );
     return;
 }
 
 
+/*
+ * delay tracking, for every valid period after the first delay detection
+ */
+static void loopback_delay_track( struct test_loopback_delay *tp ) {
+    unsigned cycle = tp->seq_c.table_frames;
+    unsigned pos = (tp->captured_frames - tp->seq_c.frame_num) % cycle;
+    int offset = (pos + cycle - tp->delay_ref) % cycle;
+    int delay;
+
+    if (offset >= (int)cycle / 2)
+        offset -= cycle;
+    delay = tp->measured_delay + offset;
+
+    if (delay != tp->current_delay) {
+        tp->delay_changes++;
+        warn("%s: [%.3f s] loopback delay changed: %d -> %d frames", tp->t.device,
+                ev_now( tp->t.loop ) - tp->start_time, tp->current_delay, delay);
+        if (tp->opts.assert_delay && delay != tp->opts.expected_delay) {
+            err("assert: delay %d doesn't match the expected one %d", delay, tp->opts.expected_delay);
+            tp->delay_errors++;
+        }
+        tp->current_delay = delay;
+    }
+    if (delay < tp->min_delay) tp->min_delay = delay;
+    if (delay > tp->max_delay) tp->max_delay = delay;
+    tp->delay_sum += delay;
+    tp->delay_periods++;
+}
+
+
+static double timespec_to_s( const struct timespec *ts ) {
+    return ts->tv_sec + ts->tv_nsec * 1e-9;
+}
+
+/*
+ * timestamps mode: split the round trip of the last captured frame into
+ * - the playback buffer latency: frames currently queued in the playback PCM (snd_pcm_delay())
+ * - the hardware latency: from the time the frame was played to the time it was captured,
+ *   according to the audio timestamps of both PCMs
+ * - the capture buffer latency: from its capture to now
+ */
+static void loopback_delay_timestamps( struct test_loopback_delay *tp ) {
+    snd_pcm_uframes_t avail_p, avail_c;
+    snd_htimestamp_t ts_p, ts_c;
+    snd_pcm_sframes_t delay_p;
+    struct timespec now;
+    double rate = tp->t.config.rate;
+    double t_play, t_cap, hw, capture_buffer;
+    unsigned s;
+    int played_ahead;
+
+    if ((snd_pcm_htimestamp( tp->pcm_p, &avail_p, &ts_p ) < 0) ||
+        (snd_pcm_htimestamp( tp->pcm_c, &avail_c, &ts_c ) < 0) ||
+        (snd_pcm_delay( tp->pcm_p, &delay_p ) < 0))
+        return;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    /* the last captured frame carries the playback frame 's' */
+    s = (unsigned)(tp->captured_frames - 1 - tp->current_delay);
+
+    /* at ts_p, the playback pointer was 'played_ahead' frames after 's' */
+    played_ahead = (int)(tp->seq_p.frame_num - (tp->buffer_size_p - avail_p) - s);
+    t_play = timespec_to_s( &ts_p ) - played_ahead / rate;
+
+    /* at ts_c, 'avail_c' frames were captured after the last one read */
+    t_cap = timespec_to_s( &ts_c ) - avail_c / rate;
+
+    hw = t_cap - t_play;
+    capture_buffer = timespec_to_s( &now ) - t_cap;
+    if ((hw < 0) || (capture_buffer < 0) || (delay_p < 0)) {
+        tp->latency_inconsistent++;
+        return;
+    }
+    hist_add( &tp->latency_play_buffer, delay_p * 1e9 / rate );
+    hist_add( &tp->latency_hw, hw * 1e9 );
+    hist_add( &tp->latency_capture_buffer, capture_buffer * 1e9 );
+}
+
+
 static void loopback_delay_capture_job( struct ev_loop *loop, struct ev_io *w, int revents ) {
 
     struct test_loopback_delay *tp = (struct test_loopback_delay *)(w->data);
     snd_pcm_sframes_t frames;
 
-    frames = snd_pcm_readi(tp->pcm_c, tp->periof_buff, tp->t.config.period);
+    stream_stats_wakeup( &tp->stats_c, tp->pcm_c );
+
+    /* read and check the sequence */
+    frames = io_read_seq( tp->pcm_c, &tp->t.config, &tp->seq_c, tp->periof_buff, tp->t.config.period );
+    stream_stats_transfer( &tp->stats_c, frames );
     if (frames < 0) {
-        int r;
         warn("%s: loopback_delay read failed: %s", tp->t.device, snd_strerror(frames));
         if (frames == -EBADFD) {
             err("unrecoverable alsa error");
             ev_unloop(loop, EVUNLOOP_ALL);
             return;
         }
-        r = snd_pcm_recover(tp->pcm_c, frames, 0);
-        if (r < 0) {
-            err("%s: loopback_delay recover failed: %s", tp->t.device, snd_strerror(frames));
-        }
-        r = snd_pcm_start( tp->pcm_c );
-        if (r < 0) {
-            warn("%s: loopback_delay start failed after recover: %s", tp->t.device, snd_strerror(r));
-            ev_unloop(loop, EVUNLOOP_ALL);
-            return;
-        }
-        seq_check_jump_notify( &tp->seq_c );
+        loopback_delay_recover( loop, tp );
+        return;
 
     } else if (frames != tp->t.config.period) {
         err("%s: loopback_delay read less than the expected period size: %ld / %u", tp->t.device, frames, tp->t.config.period);
+        tp->captured_frames += frames;
 
     } else {
-        /* check the sequence */
-        seq_check_frames( &tp->seq_c, tp->periof_buff, tp->t.config.period );
-        if (!tp->delay_detected) {
+        tp->captured_frames += frames;
+        if (tp->delay_detected) {
+            if (tp->seq_c.state == VALID_FRAME) {
+                loopback_delay_track( tp );
+                if (tp->opts.timestamps)
+                    loopback_delay_timestamps( tp );
+            }
+        } else {
             switch (tp->seq_c.state) {
             case NULL_FRAME:
                 /* we received a full NULL frame. add period_size to the measured delay */
@@ -183,6 +398,7 @@ static void loopback_delay_capture_job( struct ev_loop *loop, struct ev_io *w, i
                     if (tp->measured_delay != tp->opts.expected_delay) {
                         err("assert: delay %d doesn't match the expected one %d", tp->measured_delay, tp->opts.expected_delay);
                         tp->exit_status = 1;
+                        tp->delay_errors++;
                     } else {
                         warn("good loopback delay");
                         tp->exit_status = 0;
@@ -190,6 +406,11 @@ static void loopback_delay_capture_job( struct ev_loop *loop, struct ev_io *w, i
                 } else {
                     tp->exit_status = 0;
                 }
+                tp->delay_ref = (tp->captured_frames - tp->seq_c.frame_num) % tp->seq_c.table_frames;
+                if (!tp->delay_periods)
+                    tp->min_delay = tp->max_delay = tp->measured_delay;
+                tp->current_delay = tp->measured_delay;
+                loopback_delay_measured( tp, tp->measured_delay );
                 break;
             case INVALID_FRAME:
                 /* log for this frame was already generated by seq_check_frames() */
@@ -198,20 +419,69 @@ static void loopback_delay_capture_job( struct ev_loop *loop, struct ev_io *w, i
             }
         }
     }
+    stream_stats_done( &tp->stats_c );
 }
 
 
 
 
+static void loopback_delay_report(struct test *t) {
+    struct test_loopback_delay *tp = (struct test_loopback_delay *)t;
+    char prefix[96];
+
+    stream_stats_print( &tp->stats_p );
+    stream_stats_print( &tp->stats_c );
+    seq_channels_print( &tp->seq_c, tp->stats_c.name );
+    seq_events_print( &tp->seq_c.events, tp->stats_c.name );
+
+    if (tp->delay_periods)
+        printf("%s: loopback delay: min %d max %d mean %.2f frames, %u changes over %u periods\n",
+                tp->t.device, tp->min_delay, tp->max_delay,
+                (double)tp->delay_sum / tp->delay_periods, tp->delay_changes, tp->delay_periods);
+    else if (tp->delay_detected)
+        printf("%s: loopback delay: %d frames\n", tp->t.device, tp->measured_delay);
+    else
+        printf("%s: loopback delay: not detected\n", tp->t.device);
+
+    if (tp->measurements > 1) {
+        unsigned i, same = 0;
+        for (i = 0; i < tp->distinct_delays; i++) {
+            if (tp->delays[i].delay == tp->first_delay)
+                same = tp->delays[i].count - 1;
+        }
+        printf("%s: %u xruns, %u restarts measured, %u with the first delay (%d frames). delays:",
+                tp->t.device, tp->xruns, tp->measurements - 1, same, tp->first_delay);
+        for (i = 0; i < tp->distinct_delays; i++)
+            printf(" %d (x%u)", tp->delays[i].delay, tp->delays[i].count);
+        printf("\n");
+    }
+
+    if (tp->opts.timestamps) {
+        snprintf( prefix, sizeof(prefix), "%s loopback latency", tp->t.device );
+        hist_print( &tp->latency_play_buffer, prefix, "play buffer (us)", 1e3 );
+        hist_print( &tp->latency_hw, prefix, "hardware (us)", 1e3 );
+        hist_print( &tp->latency_capture_buffer, prefix, "capture buffer (us)", 1e3 );
+        if (tp->latency_inconsistent)
+            printf("%s: %u inconsistent timestamps (negative latency) ignored\n",
+                    tp->t.device, tp->latency_inconsistent);
+    }
+}
+
+
 static int loopback_delay_close(struct test *t) {
     struct test_loopback_delay *tp = (struct test_loopback_delay *)t;
-    int exit_status = tp->exit_status;
+    int exit_status = tp->exit_status || tp->delay_errors;
 
-    ev_io_stop(loop, &tp->io_watcher_c);
-    ev_io_stop(loop, &tp->io_watcher_p);
+    ev_timer_stop(tp->t.loop, &tp->timer);
+    ev_io_stop(tp->t.loop, &tp->io_watcher_c);
+    ev_io_stop(tp->t.loop, &tp->io_watcher_p);
     snd_pcm_close( tp->pcm_c );
     snd_pcm_close( tp->pcm_p );
 
+    stream_stats_release( &tp->stats_c );
+    stream_stats_release( &tp->stats_p );
+    seq_release( &tp->seq_c );
+    seq_release( &tp->seq_p );
     free( tp->periof_buff );
     free( tp );
     return exit_status;
@@ -222,6 +492,7 @@ static int loopback_delay_close(struct test *t) {
 const struct test_ops loopback_delay_ops = {
         .start = loopback_delay_start,
         .close = loopback_delay_close,
+        .report = loopback_delay_report,
 };
 
 /*
@@ -234,6 +505,7 @@ const struct test_ops loopback_delay_ops = {
  */
 struct test *loopback_delay_create(struct alsa_config *config, struct loopback_delay_create_opts *opts) {
     struct test_loopback_delay *tp = calloc( 1, sizeof(*tp));
+    char name[96];
     int r;
 
     if (!tp) return NULL;
@@ -242,23 +514,40 @@ struct test *loopback_delay_create(struct alsa_config *config, struct loopback_d
     memcpy( &tp->t.config, config, sizeof(*config));
     memcpy( tp->t.device, config->device, sizeof(tp->t.device) );
     tp->opts = *opts;
+    if (tp->opts.capture_device[0])
+        snprintf( tp->t.device, sizeof(tp->t.device), "%.29s -> %.29s", config->device, tp->opts.capture_device );
+    else
+        strcpy( tp->opts.capture_device, tp->t.config.device );
+    if (opts->timestamps)
+        tp->t.config.tstamp = 1;
+    if (tp->t.config.timer_sched) {
+        warn("%s: timer scheduled mode not supported by loopback_delay: using the period wake ups", tp->t.device);
+        tp->t.config.timer_sched = 0;
+    }
 
     r = alsa_device_open( tp->t.config.device, &tp->t.config, NULL, &tp->pcm_p);
     if (r) goto failed1;
 
-    r = alsa_device_open( tp->t.config.device, &tp->t.config, &tp->pcm_c, NULL);
-    if (r) goto failed1;
+    r = alsa_device_open( tp->opts.capture_device, &tp->t.config, &tp->pcm_c, NULL);
+    if (r) goto failed;
 
     if (opts->start_sync_mode == LSM_LINK) {
         r = snd_pcm_link( tp->pcm_p, tp->pcm_c );
-        if (r) {
+        if (r && strcmp( tp->opts.capture_device, tp->t.config.device )) {
+            /* two devices: they may not share the same clock or driver */
+            warn("%s: snd_pcm_link failed: %s. starting the playback, then the capture instead",
+                    tp->t.device, snd_strerror(r));
+            tp->opts.start_sync_mode = LSM_PREPARE_PLAYBACK_CAPTURE;
+        } else if (r) {
             err("%s: snd_pcm_link failed: %s", tp->t.device, snd_strerror(r));
-            goto failed1;
+            goto failed;
         }
     }
 
-    seq_init( &tp->seq_c, tp->t.config.channels, tp->t.config.format );
-    seq_init( &tp->seq_p, tp->t.config.channels, tp->t.config.format );
+    if (seq_init( &tp->seq_c, tp->t.config.channels, tp->t.config.format,
+            alsa_access_is_interleaved( tp->t.config.access ))) goto failed;
+    if (seq_init( &tp->seq_p, tp->t.config.channels, tp->t.config.format,
+            alsa_access_is_interleaved( tp->t.config.access ))) goto failed;
     tp->periof_buff = malloc( snd_pcm_frames_to_bytes( tp->pcm_c, tp->t.config.period ));
     if (!tp->periof_buff) goto failed;
 
@@ -297,6 +586,24 @@ struct test *loopback_delay_create(struct alsa_config *config, struct loopback_d
             ((tp->pollfd_p.events & POLLOUT) ? EV_WRITE : 0)
             );
     tp->io_watcher_p.data = tp;
+    ev_timer_init( &tp->timer, loopback_delay_timer, 0, 0 );
+    tp->timer.data = tp;
+    snprintf( name, sizeof(name), "%s loopback playback", tp->t.device );
+    if (stream_stats_init( &tp->stats_p, tp->pcm_p, tp->t.config.rate, name ) < 0)
+        goto failed;
+    snprintf( name, sizeof(name), "%s loopback capture", tp->t.device );
+    if (stream_stats_init( &tp->stats_c, tp->pcm_c, tp->t.config.rate, name ) < 0)
+        goto failed;
+    if (opts->timestamps) {
+        snd_pcm_uframes_t period_size;
+        if (snd_pcm_get_params( tp->pcm_p, &tp->buffer_size_p, &period_size ) < 0) {
+            err("%s: can't get the playback buffer size", tp->t.device);
+            goto failed;
+        }
+        hist_reset( &tp->latency_play_buffer );
+        hist_reset( &tp->latency_hw );
+        hist_reset( &tp->latency_capture_buffer );
+    }
 
     tp->t.ops = &loopback_delay_ops;
 
@@ -305,6 +612,10 @@ struct test *loopback_delay_create(struct alsa_config *config, struct loopback_d
 failed:
     if (tp->pcm_p) snd_pcm_close( tp->pcm_p );
     if (tp->pcm_c) snd_pcm_close( tp->pcm_c );
+    stream_stats_release( &tp->stats_c );
+    stream_stats_release( &tp->stats_p );
+    seq_release( &tp->seq_c );
+    seq_release( &tp->seq_p );
     free(tp->periof_buff);
 failed1:
     free(tp);
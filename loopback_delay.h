@@ -16,6 +16,7 @@
 
 #include "test.h"
 #include "seq.h"
+#include "hist.h"
 
 struct loopback_delay_create_opts {
 
@@ -46,7 +47,20 @@ struct loopback_delay_create_opts {
     int expected_delay;
 
     int xrun; /* if > 0, number of ms between every xrun emulation */
+    int restart_play_time;  /* if not 0, stop both streams after 'restart_play_time' ms */
+    int restart_pause_time; /* and restart them after 'restart_pause_time' ms */
 
+    /*
+     * if not zero, use the audio timestamps to split the round trip into
+     * playback buffer, hardware and capture buffer latencies
+     */
+    int timestamps;
+
+    /*
+     * if not empty, capture from this device instead of the test device
+     * (the playback device output being wired to this device input)
+     */
+    char capture_device[64];
 };
 
 
@@ -62,12 +76,61 @@ struct test_loopback_delay {
     int delay_detected; /* true we have detected the delay */
     int measured_delay; /* valid if delay_detected is true */
     int exit_status;
+    unsigned delay_errors;  /* delay assertions failed */
+
+    /*
+     * continuous delay tracking, once the delay is detected:
+     * the delay is 'captured_frames - seq_c.frame_num' (modulo the sequence cycle),
+     * relative to its value when the delay was detected.
+     */
+    unsigned long long captured_frames; /* frames read since the start */
+    unsigned delay_ref;
+    int current_delay;
+    int min_delay;
+    int max_delay;
+    long long delay_sum;
+    unsigned delay_periods;
+    unsigned delay_changes;
+    ev_tstamp start_time;
+
+    /*
+     * the delay is measured again after every xrun or restart.
+     * distinct measured values, and how many times they were measured
+     */
+    unsigned measurements;
+    unsigned xruns;
+    int first_delay;
+    unsigned distinct_delays;
+    struct {
+        int delay;
+        unsigned count;
+    } delays[8];
+
+    struct ev_timer timer;
+    enum loopback_delay_timer_state_e {
+        LT_IDLE = 0,
+        LT_W4_XRUN,
+        LT_W4_XRUN_END,
+
+        LT_W4_STOP,
+        LT_W4_RESTART
+    } timer_state;
+
+    /* timestamps mode */
+    snd_pcm_uframes_t buffer_size_p;
+    struct hist latency_play_buffer;    /* in ns */
+    struct hist latency_hw;
+    struct hist latency_capture_buffer;
+    unsigned latency_inconsistent;      /* measurements ignored: negative latency */
 
     struct pollfd pollfd_p;
     struct pollfd pollfd_c;
     struct ev_io io_watcher_p;
     struct ev_io io_watcher_c;
 
+    struct stream_stats stats_p;
+    struct stream_stats stats_c;
+
     struct loopback_delay_create_opts opts;
 };
 
@@ -0,0 +1,459 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "matrix.h"
+#include "io.h"
+#include "log.h"
+
+
+static int matrix_point_passed( const struct test_matrix *tp, const struct matrix_point *p ) {
+    if (p->state != MP_DONE || p->xruns)
+        return 0;
+    if (tp->opts.mode != MATRIX_PLAY && (!p->received || p->errors))
+        return 0;
+    return 1;
+}
+
+
+/*
+ * check the point against the probe cache (with the exact rate),
+ * to skip it without setting the PCMs up if it is impossible
+ */
+static int matrix_point_supported( struct test_matrix *tp, struct matrix_point *p ) {
+    struct alsa_config config = tp->t.config;
+    unsigned i;
+
+    config.rate = p->rate;
+    config.channels = p->channels;
+    config.period = p->period;
+    for (i = 0; i < tp->streams_count; i++) {
+        const struct matrix_stream *s = &tp->streams[i];
+        if (s->caps && !probe_caps_check( s->caps, &config, 1, p->reason, sizeof(p->reason) )) {
+            warn("%s: %u Hz, %u channels, period %u: %s (probe cache), skipped",
+                    s->device, p->rate, p->channels, p->period, p->reason);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * setup the sequence, the buffer and the watcher of a stream for the
+ * current point (the PCM being set up)
+ */
+static int matrix_stream_setup( struct matrix_stream *s, const struct alsa_config *config ) {
+    void *buff;
+    int r;
+
+    seq_release( &s->seq );
+    if (seq_init( &s->seq, config->channels, config->format,
+            alsa_access_is_interleaved( config->access )))
+        return -1;
+
+    buff = realloc( s->periof_buff, snd_pcm_frames_to_bytes( s->pcm, config->period ));
+    if (!buff)
+        return -1;
+    s->periof_buff = buff;
+
+    r = snd_pcm_poll_descriptors(s->pcm, &s->pollfd, 1);
+    if (r < 0) {
+        err("%s: snd_pcm_poll_descriptors failed", s->device);
+        return -1;
+    }
+    ev_io_set( &s->io_watcher,
+            s->pollfd.fd,
+            ((s->pollfd.events & POLLIN) ? EV_READ : 0) |
+            ((s->pollfd.events & POLLOUT) ? EV_WRITE : 0)
+            );
+    return stream_stats_reset( &s->stats, s->pcm, config->rate );
+}
+
+
+/*
+ * setup every PCM for the current point: they go through snd_pcm_hw_free()
+ * and new hw params, without closing them.
+ */
+static int matrix_setup( struct test_matrix *tp ) {
+    struct matrix_point *p = &tp->points[tp->current];
+    struct alsa_config config = tp->t.config;
+    unsigned i;
+
+    config.rate = p->rate;
+    config.channels = p->channels;
+    config.period = p->period;
+    for (i = 0; i < tp->streams_count; i++) {
+        struct matrix_stream *s = &tp->streams[i];
+        if (alsa_device_reconfigure( s->device, &config, s->pcm, s->caps ) < 0)
+            return -1;
+        if (config.rate != p->rate) {
+            warn("%s: %u Hz not supported (%u Hz)", s->device, p->rate, config.rate);
+            return -1;
+        }
+        if (matrix_stream_setup( s, &config ) < 0)
+            return -1;
+    }
+    tp->t.config = config;
+    p->actual_rate = config.rate;
+    p->actual_period = config.period;
+    return 0;
+}
+
+
+/*
+ * start the capture, or queue the first period of the playback
+ */
+static int matrix_stream_start( struct test_matrix *tp, struct matrix_stream *s ) {
+    snd_pcm_sframes_t frames;
+    int r;
+
+    if (!s->playback) {
+        seq_check_jump_notify( &s->seq );
+        r = snd_pcm_start( s->pcm );
+        if (r < 0) {
+            err("%s: capture start failed: %s", s->device, snd_strerror(r));
+            return -1;
+        }
+        return 0;
+    }
+    frames = io_write_seq( s->pcm, &tp->t.config, &s->seq, s->periof_buff, tp->t.config.period );
+    stream_stats_transfer( &s->stats, frames );
+    if (frames < 0) {
+        err("%s: playback write failed: %s", s->device, snd_strerror(frames));
+        return -1;
+    }
+    return 0;
+}
+
+
+static void matrix_stop( struct test_matrix *tp ) {
+    unsigned i;
+
+    for (i = 0; i < tp->streams_count; i++) {
+        ev_io_stop( tp->t.loop, &tp->streams[i].io_watcher );
+        snd_pcm_drop( tp->streams[i].pcm );
+    }
+}
+
+
+/*
+ * run the next point which can be set up. Stop the test after the last one
+ */
+static void matrix_run( struct test_matrix *tp ) {
+    unsigned i;
+
+    for (; tp->current < tp->points_count; tp->current++) {
+        struct matrix_point *p = &tp->points[tp->current];
+
+        if (!matrix_point_supported( tp, p )) {
+            p->state = MP_UNSUPPORTED;
+            continue;
+        }
+        if (matrix_setup( tp ) < 0)
+            goto skip;
+        for (i = 0; i < tp->streams_count; i++) {
+            if (matrix_stream_start( tp, &tp->streams[i] ) < 0)
+                goto skip;
+        }
+        dbg("%s: %u Hz, %u channels, period %u", tp->t.device, p->actual_rate, p->channels, p->actual_period);
+        p->state = MP_RUNNING;
+        tp->point_start = ev_now( tp->t.loop );
+        for (i = 0; i < tp->streams_count; i++)
+            ev_io_start( tp->t.loop, &tp->streams[i].io_watcher );
+        ev_timer_set( &tp->point_timer, tp->opts.point_time, 0 );
+        ev_timer_start( tp->t.loop, &tp->point_timer );
+        return;
+
+    skip:
+        warn("%s: %u Hz, %u channels, period %u: setup failed, skipped",
+                tp->t.device, p->rate, p->channels, p->period);
+        p->state = MP_SETUP_FAILED;
+        matrix_stop( tp );
+    }
+    dbg("%s: end of the matrix", tp->t.device);
+    ev_unloop( tp->t.loop, EVUNLOOP_ALL );
+}
+
+
+static void matrix_io_job( struct ev_loop *loop, struct ev_io *w, int revents ) {
+    struct matrix_stream *s = (struct matrix_stream *)(w->data);
+    struct test_matrix *tp = s->tp;
+    struct matrix_point *p = &tp->points[tp->current];
+    snd_pcm_sframes_t frames;
+    int r;
+
+    stream_stats_wakeup( &s->stats, s->pcm );
+
+    if (s->playback)
+        frames = io_write_seq_avail( s->pcm, &tp->t.config, &s->seq, s->periof_buff, tp->t.config.period );
+    else
+        frames = io_read_seq_avail( s->pcm, &tp->t.config, &s->seq, s->periof_buff, tp->t.config.period );
+    stream_stats_transfer( &s->stats, frames );
+
+    if (frames < 0) {
+        warn("%s: [%.3f s] %s failed: %s", s->device, ev_now( loop ) - tp->point_start,
+                s->playback ? "playback write" : "capture read", snd_strerror(frames));
+        if (frames == -EBADFD) {
+            err("unrecoverable alsa error");
+            ev_unloop(loop, EVUNLOOP_ALL);
+            return;
+        }
+        p->xruns++;
+        r = snd_pcm_recover(s->pcm, frames, 0);
+        if (r < 0)
+            err("%s: recover failed: %s", s->device, snd_strerror(r));
+        stream_stats_break( &s->stats );
+        if (matrix_stream_start( tp, s ) < 0) {
+            ev_unloop(loop, EVUNLOOP_ALL);
+            return;
+        }
+    } else if (!s->playback || tp->opts.mode == MATRIX_PLAY) {
+        p->frames += frames;
+        if (!s->playback && s->seq.state == VALID_FRAME)
+            p->received = 1;
+    }
+    stream_stats_done( &s->stats );
+}
+
+
+/*
+ * end of the current point
+ */
+static void matrix_point_end( struct ev_loop *loop, struct ev_timer *w, int revents ) {
+    struct test_matrix *tp = (struct test_matrix *)(w->data);
+    struct matrix_point *p = &tp->points[tp->current];
+    unsigned i;
+
+    matrix_stop( tp );
+
+    p->time = ev_now( loop ) - tp->point_start;
+    p->state = MP_DONE;
+    for (i = 0; i < tp->streams_count; i++) {
+        struct matrix_stream *s = &tp->streams[i];
+        char prefix[128];
+        if (s->playback)
+            continue;
+        p->errors = s->seq.error_count;
+        snprintf( prefix, sizeof(prefix), "%s: %u Hz, %u channels, period %u",
+                s->stats.name, p->actual_rate, p->channels, p->actual_period );
+        seq_events_print( &s->seq.events, prefix );
+    }
+    warn("%s: %u Hz, %u channels, period %u: %s", tp->t.device, p->actual_rate, p->channels,
+            p->actual_period, matrix_point_passed( tp, p ) ? "passed" : "failed");
+
+    tp->current++;
+    matrix_run( tp );
+}
+
+
+static int matrix_start(struct test *t) {
+    struct test_matrix *tp = (struct test_matrix *)t;
+    dbg("%s: matrix_start, %u points of %d s", tp->t.device, tp->points_count, tp->opts.point_time);
+
+    matrix_run( tp );
+    return 0;
+}
+
+
+static void matrix_report(struct test *t) {
+    struct test_matrix *tp = (struct test_matrix *)t;
+    unsigned i, passed = 0, failed = 0, skipped = 0, unsupported = 0;
+
+    for (i = 0; i < tp->points_count; i++) {
+        const struct matrix_point *p = &tp->points[i];
+
+        switch (p->state) {
+        case MP_PENDING:
+            break;
+        case MP_SETUP_FAILED:
+            printf("%s matrix: %u Hz, %u channels, period %u: setup failed\n",
+                    tp->t.device, p->rate, p->channels, p->period);
+            skipped++;
+            break;
+        case MP_UNSUPPORTED:
+            printf("%s matrix: %u Hz, %u channels, period %u: not supported: %s\n",
+                    tp->t.device, p->rate, p->channels, p->period, p->reason);
+            unsupported++;
+            break;
+        case MP_RUNNING:
+            printf("%s matrix: %u Hz, %u channels, period %u: running, %llu frames, %u xruns\n",
+                    tp->t.device, p->actual_rate, p->channels, p->actual_period, p->frames, p->xruns);
+            break;
+        case MP_DONE:
+            printf("%s matrix: %u Hz, %u channels, period %u: %s, %llu frames in %.1f s, %u xruns, %u errors%s\n",
+                    tp->t.device, p->actual_rate, p->channels, p->actual_period,
+                    matrix_point_passed( tp, p ) ? "PASS" : "FAIL", p->frames, p->time, p->xruns, p->errors,
+                    (tp->opts.mode != MATRIX_PLAY && !p->received) ? ", sequence not received" : "");
+            if (matrix_point_passed( tp, p ))
+                passed++;
+            else
+                failed++;
+            break;
+        }
+    }
+    printf("%s matrix: %u points: %u passed, %u failed, %u not set up, %u not supported\n",
+            tp->t.device, tp->points_count, passed, failed, skipped, unsupported);
+}
+
+
+static int matrix_close(struct test *t) {
+    struct test_matrix *tp = (struct test_matrix *)t;
+    int exit_status = 0;
+    unsigned i;
+
+    for (i = 0; i < tp->points_count; i++) {
+        if (tp->points[i].state == MP_DONE && !matrix_point_passed( tp, &tp->points[i] ))
+            exit_status = 1;
+    }
+
+    ev_timer_stop( tp->t.loop, &tp->point_timer );
+    for (i = 0; i < tp->streams_count; i++) {
+        struct matrix_stream *s = &tp->streams[i];
+        ev_io_stop( tp->t.loop, &s->io_watcher );
+        snd_pcm_close( s->pcm );
+        stream_stats_release( &s->stats );
+        seq_release( &s->seq );
+        free( s->periof_buff );
+    }
+    free( tp->points );
+    free( tp );
+    return exit_status;
+}
+
+
+
+const struct test_ops matrix_ops = {
+        .start = matrix_start,
+        .close = matrix_close,
+        .report = matrix_report,
+};
+
+
+/*
+ * every combination of the matrix values
+ */
+static int matrix_points( struct test_matrix *tp ) {
+    struct matrix_create_opts *o = &tp->opts;
+    unsigned i, j, k, n = 0;
+
+    if (!o->rates_count)
+        o->rates[o->rates_count++] = tp->t.config.rate;
+    if (!o->channels_count)
+        o->channels[o->channels_count++] = tp->t.config.channels;
+    if (!o->periods_count)
+        o->periods[o->periods_count++] = tp->t.config.period;
+
+    tp->points_count = o->rates_count * o->channels_count * o->periods_count;
+    tp->points = calloc( tp->points_count, sizeof(*tp->points) );
+    if (!tp->points)
+        return -1;
+    for (i = 0; i < o->rates_count; i++) {
+        for (j = 0; j < o->channels_count; j++) {
+            for (k = 0; k < o->periods_count; k++) {
+                tp->points[n].rate = o->rates[i];
+                tp->points[n].channels = o->channels[j];
+                tp->points[n].period = o->periods[k];
+                n++;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * open one of the PCMs
+ */
+static int matrix_stream_open( struct test_matrix *tp, const char *device, int playback ) {
+    struct matrix_stream *s = &tp->streams[tp->streams_count];
+    char name[96];
+    int r;
+
+    s->tp = tp;
+    s->playback = playback;
+    snprintf( s->device, sizeof(s->device), "%s", device );
+
+    r = alsa_device_open( s->device, &tp->t.config, playback ? NULL : &s->pcm, playback ? &s->pcm : NULL );
+    if (r)
+        return -1;
+    tp->streams_count++;
+    s->caps = probe_cache_find( s->pcm, s->device );
+
+    r = snd_pcm_poll_descriptors_count(s->pcm);
+    if (r != 1) {
+        err("matrix_create: expect only 1 fd to monitor (snd_pcm_poll_descriptors_count)");
+        return -1;
+    }
+    ev_io_init( &s->io_watcher, matrix_io_job, -1, 0 );
+    s->io_watcher.data = s;
+
+    snprintf( name, sizeof(name), "%s matrix %s", s->device, playback ? "playback" : "capture" );
+    return stream_stats_init( &s->stats, s->pcm, tp->t.config.rate, name );
+}
+
+
+/*
+ * do a matrix test:
+ * - run the sequence with every combination of the rates, channel counts
+ *   and period sizes, keeping the PCMs open (only their hw and sw params
+ *   are set up again between the points)
+ * - every point passes if it runs without xrun, and if the captured sequence
+ *   is received without error
+ */
+struct test *matrix_create(struct alsa_config *config, struct matrix_create_opts *opts) {
+    struct test_matrix *tp = calloc( 1, sizeof(*tp));
+    unsigned i;
+
+    if (!tp) return NULL;
+
+    tp->t.name = "matrix";
+    tp->opts = *opts;
+    if (tp->opts.point_time <= 0)
+        tp->opts.point_time = 5;
+    memcpy( &tp->t.config, config, sizeof(*config));
+    memcpy( tp->t.device, config->device, sizeof(tp->t.device) );
+    if (tp->t.config.timer_sched) {
+        warn("%s: timer scheduled mode not supported by matrix: using the period wake ups", tp->t.device);
+        tp->t.config.timer_sched = 0;
+    }
+
+    if (matrix_points( tp ) < 0)
+        goto failed;
+
+    /* open with the test config: every point sets the PCMs up again */
+    if (tp->opts.mode != MATRIX_PLAY) {
+        const char *device = tp->opts.mode == MATRIX_LOOP && tp->opts.capture_device[0] ?
+                tp->opts.capture_device : tp->t.device;
+        if (matrix_stream_open( tp, device, 0 ) < 0)
+            goto failed;
+    }
+    if (tp->opts.mode != MATRIX_CAPTURE) {
+        if (matrix_stream_open( tp, tp->t.device, 1 ) < 0)
+            goto failed;
+    }
+
+    ev_timer_init( &tp->point_timer, matrix_point_end, 0, 0 );
+    tp->point_timer.data = tp;
+
+    tp->t.ops = &matrix_ops;
+
+    return &tp->t;
+
+failed:
+    for (i = 0; i < tp->streams_count; i++) {
+        snd_pcm_close( tp->streams[i].pcm );
+        stream_stats_release( &tp->streams[i].stats );
+    }
+    free( tp->points );
+    free( tp );
+    return NULL;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef __matrix_h__
+#define __matrix_h__
+
+#include <poll.h>
+#include <ev.h>
+
+#include "test.h"
+#include "seq.h"
+#include "hist.h"
+#include "probe.h"
+
+/* maximum number of values of every parameter of the matrix */
+#define MATRIX_MAX_VALUES 16
+
+enum matrix_mode {
+    MATRIX_LOOP = 0,    /* play on the test PCM, and check the capture PCM (wired to it) */
+    MATRIX_PLAY,        /* only play the sequence */
+    MATRIX_CAPTURE,     /* only check the captured sequence */
+};
+
+struct matrix_create_opts {
+    /* the matrix values. Empty lists use the test config */
+    unsigned rates[MATRIX_MAX_VALUES];
+    unsigned rates_count;
+    unsigned channels[MATRIX_MAX_VALUES];
+    unsigned channels_count;
+    unsigned periods[MATRIX_MAX_VALUES];
+    unsigned periods_count;
+
+    int point_time;     /* seconds run at every point (default 5) */
+    enum matrix_mode mode;
+    char capture_device[64]; /* MATRIX_LOOP: capture PCM, the test PCM if empty */
+};
+
+
+/*
+ * one point of the matrix, and its result
+ */
+struct matrix_point {
+    unsigned rate;              /* requested */
+    unsigned channels;
+    unsigned period;
+
+    int state;                  /* MP_* */
+    unsigned actual_rate;       /* as set up by the PCMs */
+    unsigned actual_period;
+    double time;                /* seconds run */
+    unsigned xruns;             /* of every stream */
+    unsigned long long frames;  /* captured, or played without capture */
+    unsigned errors;            /* sequence errors */
+    int received;               /* the capture received the sequence */
+    char reason[96];            /* MP_UNSUPPORTED */
+};
+
+enum {
+    MP_PENDING = 0,
+    MP_RUNNING,
+    MP_DONE,
+    MP_SETUP_FAILED,
+    MP_UNSUPPORTED,             /* impossible according to the probe cache: not set up */
+};
+
+
+struct test_matrix;
+
+struct matrix_stream {
+    struct test_matrix *tp;
+    char device[64];
+    int playback;
+
+    snd_pcm_t *pcm;
+    const struct probe_caps *caps;  /* NULL if not in the probe cache */
+    struct seq_info seq;
+    void *periof_buff;
+
+    struct pollfd pollfd;
+    struct ev_io io_watcher;
+    struct stream_stats stats;
+};
+
+
+struct test_matrix {
+    struct test t;
+
+    /* capture first, so it is started before the playback */
+    struct matrix_stream streams[2];
+    unsigned streams_count;
+
+    struct ev_timer point_timer;
+
+    /* rates, then channels, then periods */
+    struct matrix_point *points;
+    unsigned points_count;
+    unsigned current;
+    ev_tstamp point_start;
+
+    struct matrix_create_opts opts;
+};
+
+struct test *matrix_create(struct alsa_config *config, struct matrix_create_opts *opts);
+
+#endif //__matrix_h__
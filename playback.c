@@ -9,19 +9,69 @@
 
 
 #include "playback.h"
+#include "io.h"
 #include "log.h"
 
 
+/*
+ * generate and write as many frames as the PCM can take, so a late
+ * wake up catches up at once.
+ * In timer scheduled mode, only fill the PCM up to the target.
+ */
+static snd_pcm_sframes_t playback_write_avail( struct test_playback *tp ) {
+    void *buff = tp->opts.zero_copy ? NULL : tp->periof_buff;
+    snd_pcm_sframes_t frames;
+
+    if (tp->t.config.timer_sched)
+        frames = io_write_seq_fill( tp->pcm, &tp->t.config, &tp->seq, buff,
+                tp->t.config.period, tp->t.config.timer_target );
+    else
+        frames = io_write_seq_avail( tp->pcm, &tp->t.config, &tp->seq, buff, tp->t.config.period );
+    stream_stats_transfer( &tp->stats, frames );
+    return frames;
+}
+
+
+/*
+ * generate and write the next period of the sequence (to start the stream).
+ * In timer scheduled mode, fill up to the target (ie. the start threshold)
+ */
+static snd_pcm_sframes_t playback_write_period( struct test_playback *tp ) {
+    snd_pcm_sframes_t frames;
+
+    if (tp->t.config.timer_sched)
+        return playback_write_avail( tp );
+    frames = io_write_seq( tp->pcm, &tp->t.config, &tp->seq,
+            tp->opts.zero_copy ? NULL : tp->periof_buff, tp->t.config.period );
+    stream_stats_transfer( &tp->stats, frames );
+    return frames;
+}
+
+
+/*
+ * wait for the PCM wake ups, or for the timer in timer scheduled mode
+ */
+static void playback_io_start( struct test_playback *tp ) {
+    if (tp->t.config.timer_sched)
+        ev_timer_again( tp->t.loop, &tp->sched_timer );
+    else
+        ev_io_start( tp->t.loop, &tp->io_watcher );
+}
+
+static void playback_io_stop( struct test_playback *tp ) {
+    ev_io_stop( tp->t.loop, &tp->io_watcher );
+    ev_timer_stop( tp->t.loop, &tp->sched_timer );
+}
+
+
 /*
  * feed the PCM with new samples
  */
-static void playback_io_job( struct ev_loop *loop, struct ev_io *w, int revents ) {
+static void playback_io( struct ev_loop *loop, struct test_playback *tp ) {
 
-    struct test_playback *tp = (struct test_playback *)(w->data);
+    stream_stats_wakeup( &tp->stats, tp->pcm );
 
-    /* simply fill a first period */
-    seq_fill_frames( &tp->seq, tp->periof_buff, tp->t.config.period );
-    snd_pcm_sframes_t frames = snd_pcm_writei(tp->pcm, tp->periof_buff, tp->t.config.period);
+    snd_pcm_sframes_t frames = playback_write_avail( tp );
 
     if (frames < 0) {
         warn("%s: playback write failed: %s", tp->t.device, snd_strerror(frames));
@@ -31,21 +81,28 @@ static void playback_io_job( struct ev_loop *loop, struct ev_io *w, int revents
             return;
         }
         snd_pcm_recover(tp->pcm, frames, 0);
+        stream_stats_break( &tp->stats );
 
         /* write again the period to start the stream again */
-        frames = snd_pcm_writei(tp->pcm, tp->periof_buff, tp->t.config.period);
+        frames = playback_write_period( tp );
         if (frames < 0) {
             err("%s: playback write failed after recover: %s", tp->t.device, snd_strerror(frames));
             ev_unloop(loop, EVUNLOOP_ALL);
             return;
         }
-    } else if (frames != tp->t.config.period) {
-        err("%s: playback write less than the expected period size: %ld / %u", tp->t.device, frames, tp->t.config.period);
-
     }
+    stream_stats_done( &tp->stats );
     return;
 }
 
+static void playback_io_job( struct ev_loop *loop, struct ev_io *w, int revents ) {
+    playback_io( loop, (struct test_playback *)(w->data) );
+}
+
+static void playback_sched_job( struct ev_loop *loop, struct ev_timer *w, int revents ) {
+    playback_io( loop, (struct test_playback *)(w->data) );
+}
+
 
 static void playback_timer( struct ev_loop *loop, struct ev_timer *w, int revents) {
     struct test_playback *tp = (struct test_playback *)(w->data);
@@ -56,7 +113,7 @@ static void playback_timer( struct ev_loop *loop, struct ev_timer *w, int revent
     case PT_W4_XRUN:
         warn("%s: force playback xrun", tp->t.device);
         /* simply stop handling the pcm handler during few ms */
-        ev_io_stop( loop, &tp->io_watcher );
+        playback_io_stop( tp );
         tp->timer_state = PT_W4_XRUN_END;
         ev_timer_set( &tp->timer, 0.5, 0);
         ev_timer_start( loop, &tp->timer );
@@ -64,7 +121,7 @@ static void playback_timer( struct ev_loop *loop, struct ev_timer *w, int revent
 
     case PT_W4_XRUN_END:
         warn("%s: PT_W4_XRUN_END", tp->t.device);
-        ev_io_start( loop, &tp->io_watcher );
+        playback_io_start( tp );
         tp->timer_state = PT_W4_XRUN;
         ev_timer_set( &tp->timer, tp->opts.xrun*1e-3, 0);
         ev_timer_start( loop, &tp->timer );
@@ -73,7 +130,7 @@ static void playback_timer( struct ev_loop *loop, struct ev_timer *w, int revent
     case PT_W4_STOP:
         warn("%s: PT_W4_STOP", tp->t.device);
         snd_pcm_drop( tp->pcm );
-        ev_io_stop( loop, &tp->io_watcher );
+        playback_io_stop( tp );
         tp->timer_state = PT_W4_RESTART;
         ev_timer_set( &tp->timer, tp->opts.restart_pause_time * 1e-3, 0);
         ev_timer_start( loop, &tp->timer );
@@ -82,11 +139,11 @@ static void playback_timer( struct ev_loop *loop, struct ev_timer *w, int revent
     case PT_W4_RESTART: {
         warn("%s: PT_W4_RESTART", tp->t.device);
         /* simply fill a first period */
-        seq_fill_frames( &tp->seq, tp->periof_buff, tp->t.config.period );
         snd_pcm_prepare(tp->pcm);
-        snd_pcm_sframes_t frames = snd_pcm_writei(tp->pcm, tp->periof_buff, tp->t.config.period);
+        stream_stats_break( &tp->stats );
+        snd_pcm_sframes_t frames = playback_write_period( tp );
         if (frames > 0) {
-            ev_io_start( loop, &tp->io_watcher );
+            playback_io_start( tp );
             tp->timer_state = PT_W4_STOP;
             ev_timer_set( &tp->timer, tp->opts.restart_play_time * 1e-3, 0);
             ev_timer_start( loop, &tp->timer );
@@ -103,39 +160,50 @@ static int playback_start(struct test *t) {
     struct test_playback *tp = (struct test_playback *)t;
     /* simply fill a first period */
     dbg("%s: playback_start", tp->t.device);
-    seq_fill_frames( &tp->seq, tp->periof_buff, tp->t.config.period );
-    snd_pcm_sframes_t frames = snd_pcm_writei(tp->pcm, tp->periof_buff, tp->t.config.period);
+    snd_pcm_sframes_t frames = playback_write_period( tp );
 
     if (frames > 0) {
-        ev_io_start( loop, &tp->io_watcher );
+        playback_io_start( tp );
         if (tp->opts.xrun) {
             dbg("%s: will simulate xrun every %d ms", tp->t.device, tp->opts.xrun);
             tp->timer_state = PT_W4_XRUN;
             ev_timer_set( &tp->timer, tp->opts.xrun * 1e-3, 0);
-            ev_timer_start( loop, &tp->timer );
+            ev_timer_start( tp->t.loop, &tp->timer );
         } else if (tp->opts.restart_play_time && tp->opts.restart_pause_time) {
             dbg("%s: will stop every %d ms during %d ms", tp->t.device, tp->opts.restart_play_time, tp->opts.restart_pause_time);
             tp->timer_state = PT_W4_STOP;
             ev_timer_set( &tp->timer, tp->opts.restart_play_time * 1e-3, 0);
-            ev_timer_start( loop, &tp->timer );
+            ev_timer_start( tp->t.loop, &tp->timer );
         }
 
     } else {
         err("%s: playback_start failure (%s)", tp->t.device, snd_strerror(frames));
-        ev_unloop(loop, EVUNLOOP_ALL);
+        ev_unloop(tp->t.loop, EVUNLOOP_ALL);
     }
 
 
     return frames > 0 ? 0 : -1;
 }
 
+static void playback_report(struct test *t) {
+    struct test_playback *tp = (struct test_playback *)t;
+    stream_stats_print( &tp->stats );
+    if (tp->t.config.timer_sched)
+        printf("%s: timer scheduled: wake up every %.2f ms, fill target %u frames (%.2f ms), buffer %lu frames\n",
+                tp->stats.name, tp->t.config.period * 1e3 / tp->t.config.rate,
+                tp->t.config.timer_target, tp->t.config.timer_target * 1e3 / tp->t.config.rate,
+                (unsigned long)tp->stats.buffer_size);
+}
+
 static int playback_close(struct test *t) {
     struct test_playback *tp = (struct test_playback *)t;
 
-    ev_io_stop( loop, &tp->io_watcher );
-    ev_timer_stop( loop, &tp->timer );
+    playback_io_stop( tp );
+    ev_timer_stop( tp->t.loop, &tp->timer );
     snd_pcm_close( tp->pcm );
 
+    stream_stats_release( &tp->stats );
+    seq_release( &tp->seq );
     free( tp->periof_buff );
     free( tp );
     return 0;
@@ -146,6 +214,7 @@ static int playback_close(struct test *t) {
 const struct test_ops playback_ops = {
         .start = playback_start,
         .close = playback_close,
+        .report = playback_report,
 };
 
 
@@ -155,6 +224,7 @@ const struct test_ops playback_ops = {
  */
 struct test *playback_create(struct alsa_config *config, struct playback_create_opts *opts) {
     struct test_playback *tp = calloc( 1, sizeof(*tp));
+    char name[96];
     int r;
 
     if (!tp) return NULL;
@@ -167,10 +237,20 @@ struct test *playback_create(struct alsa_config *config, struct playback_create_
     r = alsa_device_open( tp->t.config.device, &tp->t.config, NULL, &tp->pcm );
     if (r) goto failed1;
 
-    seq_init( &tp->seq, tp->t.config.channels, tp->t.config.format );
+    if (seq_init( &tp->seq, tp->t.config.channels, tp->t.config.format,
+            alsa_access_is_interleaved( tp->t.config.access ))) goto failed;
     tp->periof_buff = malloc( snd_pcm_frames_to_bytes( tp->pcm, tp->t.config.period ));
     if (!tp->periof_buff) goto failed;
 
+    if (tp->opts.zero_copy && (!tp->seq.table || (tp->t.config.period > tp->seq.table_frames))) {
+        warn("%s: zero copy not possible with a period of %u frames", tp->t.device, tp->t.config.period);
+        tp->opts.zero_copy = 0;
+    }
+    if (tp->opts.zero_copy && tp->seq.long_bits) {
+        warn("%s: zero copy not possible with a long sequence", tp->t.device);
+        tp->opts.zero_copy = 0;
+    }
+
     r = snd_pcm_poll_descriptors_count(tp->pcm);
     if (r != 1) {
         err("playback_create: expect only 1 fd to monitor (snd_pcm_poll_descriptors_count)");
@@ -189,8 +269,13 @@ struct test *playback_create(struct alsa_config *config, struct playback_create_
             ((tp->pollfd.events & POLLOUT) ? EV_WRITE : 0)
             );
     tp->io_watcher.data = tp;
+    ev_timer_init( &tp->sched_timer, playback_sched_job, 0, (double)tp->t.config.period / tp->t.config.rate );
+    tp->sched_timer.data = tp;
     ev_timer_init( &tp->timer, playback_timer, 0, 0 );
     tp->timer.data = tp;
+    snprintf( name, sizeof(name), "%s playback", tp->t.device );
+    if (stream_stats_init( &tp->stats, tp->pcm, tp->t.config.rate, name ) < 0)
+        goto failed;
 
     tp->t.ops = &playback_ops;
 
@@ -198,6 +283,8 @@ struct test *playback_create(struct alsa_config *config, struct playback_create_
 
 failed:
     snd_pcm_close( tp->pcm );
+    stream_stats_release( &tp->stats );
+    seq_release( &tp->seq );
     free(tp->periof_buff);
 failed1:
     free(tp);
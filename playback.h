@@ -15,11 +15,13 @@
 
 #include "test.h"
 #include "seq.h"
+#include "hist.h"
 
 struct playback_create_opts {
     int xrun;
     int restart_play_time;
     int restart_pause_time;
+    int zero_copy; /* write the periods directly from the pre-generated sequence table */
 };
 
 
@@ -32,8 +34,11 @@ struct test_playback {
 
     struct pollfd pollfd;
     struct ev_io io_watcher;
+    struct ev_timer sched_timer;    /* replaces io_watcher in timer scheduled mode */
     struct ev_timer timer;
 
+    struct stream_stats stats;
+
     struct playback_create_opts opts;
     enum playback_timer_state_e {
         PT_IDLE = 0,
@@ -0,0 +1,325 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wordexp.h>
+#include <alsa/asoundlib.h>
+
+#include "probe.h"
+#include "log.h"
+
+
+static const unsigned probe_rates[] = PROBE_RATES;
+#define PROBE_RATES_COUNT (sizeof(probe_rates) / sizeof(probe_rates[0]))
+
+/* the capabilities loaded from the cache file, and probed since */
+static struct probe_caps *cache;
+static unsigned cache_count;
+
+
+static const char *probe_stream_name( snd_pcm_stream_t stream ) {
+    return stream == SND_PCM_STREAM_PLAYBACK ? "playback" : "capture";
+}
+
+
+/*
+ * the cache key of the PCM, see probe_caps.key
+ */
+static int probe_key( snd_pcm_t *pcm, const char *device, char *key, size_t size ) {
+    snd_pcm_info_t *info;
+    snd_ctl_card_info_t *card_info;
+    snd_ctl_t *ctl;
+    char name[16];
+    int card, r;
+
+    snd_pcm_info_alloca( &info );
+    if (snd_pcm_info( pcm, info ) < 0 || (card = snd_pcm_info_get_card( info )) < 0) {
+        snprintf( key, size, "%s", device );
+        return 0;
+    }
+
+    snprintf( name, sizeof(name), "hw:%d", card );
+    if ((r = snd_ctl_open( &ctl, name, 0 )) < 0) {
+        warn("%s: cannot open the control of card %d (%s)", device, card, snd_strerror(r));
+        return -1;
+    }
+    snd_ctl_card_info_alloca( &card_info );
+    r = snd_ctl_card_info( ctl, card_info );
+    snd_ctl_close( ctl );
+    if (r < 0) {
+        warn("%s: cannot get the info of card %d (%s)", device, card, snd_strerror(r));
+        return -1;
+    }
+    snprintf( key, size, "%s,%u,%s", snd_ctl_card_info_get_id( card_info ),
+            snd_pcm_info_get_device( info ), snd_pcm_type_name( snd_pcm_type( pcm ) ) );
+    return 0;
+}
+
+
+int probe_pcm( snd_pcm_t *pcm, const char *device, struct probe_caps *caps )
+{
+    snd_pcm_hw_params_t *hw_params;
+    int f, a, dir = 0, r;
+    unsigned i;
+
+    memset( caps, 0, sizeof(*caps) );
+    caps->stream = snd_pcm_stream( pcm );
+    if (probe_key( pcm, device, caps->key, sizeof(caps->key) ) < 0)
+        return -1;
+
+    snd_pcm_hw_params_alloca( &hw_params );
+    if ((r = snd_pcm_hw_params_any( pcm, hw_params )) < 0) {
+        err("%s: cannot initialize hardware parameter structure (%s)", device, snd_strerror(r));
+        return -1;
+    }
+
+    for (f = 0; f <= SND_PCM_FORMAT_LAST && f < 64; f++) {
+        if (!snd_pcm_hw_params_test_format( pcm, hw_params, (snd_pcm_format_t)f ))
+            caps->formats |= 1ull << f;
+    }
+    for (a = 0; a <= SND_PCM_ACCESS_LAST; a++) {
+        if (!snd_pcm_hw_params_test_access( pcm, hw_params, (snd_pcm_access_t)a ))
+            caps->access |= 1u << a;
+    }
+    for (i = 0; i < PROBE_RATES_COUNT; i++) {
+        if (!snd_pcm_hw_params_test_rate( pcm, hw_params, probe_rates[i], 0 ))
+            caps->rates |= 1u << i;
+    }
+
+    if (snd_pcm_hw_params_get_rate_min( hw_params, &caps->rate_min, &dir ) < 0 ||
+            snd_pcm_hw_params_get_rate_max( hw_params, &caps->rate_max, &dir ) < 0 ||
+            snd_pcm_hw_params_get_channels_min( hw_params, &caps->channels_min ) < 0 ||
+            snd_pcm_hw_params_get_channels_max( hw_params, &caps->channels_max ) < 0 ||
+            snd_pcm_hw_params_get_period_size_min( hw_params, &caps->period_min, &dir ) < 0 ||
+            snd_pcm_hw_params_get_period_size_max( hw_params, &caps->period_max, &dir ) < 0 ||
+            snd_pcm_hw_params_get_buffer_size_min( hw_params, &caps->buffer_min ) < 0 ||
+            snd_pcm_hw_params_get_buffer_size_max( hw_params, &caps->buffer_max ) < 0) {
+        err("%s: cannot get the hardware parameter ranges", device);
+        return -1;
+    }
+    return 0;
+}
+
+
+int probe_device( const char *device, snd_pcm_stream_t stream, struct probe_caps *caps )
+{
+    snd_pcm_t *pcm;
+    int r;
+
+    /* don't wait for a busy device */
+    if ((r = snd_pcm_open( &pcm, device, stream, SND_PCM_NONBLOCK )) < 0) {
+        warn("%s: cannot open the %s (%s)", device, probe_stream_name( stream ), snd_strerror(r));
+        return -1;
+    }
+    r = probe_pcm( pcm, device, caps );
+    snd_pcm_close( pcm );
+    return r;
+}
+
+
+void probe_caps_print( const struct probe_caps *caps, const char *prefix )
+{
+    unsigned i;
+    int f, a;
+
+    printf("%s: %s %s\n", prefix, caps->key, probe_stream_name( caps->stream ));
+    printf("%s:   formats:", prefix);
+    for (f = 0; f < 64; f++) {
+        if (caps->formats & (1ull << f))
+            printf(" %s", snd_pcm_format_name( (snd_pcm_format_t)f ));
+    }
+    printf("\n%s:   access:", prefix);
+    for (a = 0; a <= SND_PCM_ACCESS_LAST; a++) {
+        if (caps->access & (1u << a))
+            printf(" %s", snd_pcm_access_name( (snd_pcm_access_t)a ));
+    }
+    printf("\n%s:   rates:", prefix);
+    for (i = 0; i < PROBE_RATES_COUNT; i++) {
+        if (caps->rates & (1u << i))
+            printf(" %u", probe_rates[i]);
+    }
+    printf(" (%u to %u Hz)\n", caps->rate_min, caps->rate_max);
+    printf("%s:   channels: %u to %u\n", prefix, caps->channels_min, caps->channels_max);
+    printf("%s:   period: %lu to %lu frames\n", prefix, caps->period_min, caps->period_max);
+    printf("%s:   buffer: %lu to %lu frames\n", prefix, caps->buffer_min, caps->buffer_max);
+}
+
+
+int probe_caps_check( const struct probe_caps *caps, const struct alsa_config *config,
+        int exact, char *reason, size_t size )
+{
+    unsigned long buffer = (unsigned long)config->period * config->buffer_period_count;
+    unsigned i;
+
+    if (config->format < 0 || config->format >= 64 || !(caps->formats & (1ull << config->format))) {
+        snprintf( reason, size, "format %s not supported", snd_pcm_format_name( config->format ));
+        return 0;
+    }
+    if (!(caps->access & (1u << config->access))) {
+        snprintf( reason, size, "access %s not supported", snd_pcm_access_name( config->access ));
+        return 0;
+    }
+    if (config->channels < caps->channels_min || config->channels > caps->channels_max) {
+        snprintf( reason, size, "%u channels not supported (%u to %u)",
+                config->channels, caps->channels_min, caps->channels_max );
+        return 0;
+    }
+    if (!exact)
+        return 1;
+    for (i = 0; i < PROBE_RATES_COUNT; i++) {
+        if (probe_rates[i] == config->rate && !(caps->rates & (1u << i))) {
+            snprintf( reason, size, "%u Hz not supported", config->rate );
+            return 0;
+        }
+    }
+    if (config->rate < caps->rate_min || config->rate > caps->rate_max) {
+        snprintf( reason, size, "%u Hz not supported (%u to %u Hz)", config->rate, caps->rate_min, caps->rate_max );
+        return 0;
+    }
+    if (config->period < caps->period_min || config->period > caps->period_max) {
+        snprintf( reason, size, "period %u not supported (%lu to %lu frames)",
+                config->period, caps->period_min, caps->period_max );
+        return 0;
+    }
+    if (buffer < caps->buffer_min || buffer > caps->buffer_max) {
+        snprintf( reason, size, "buffer %lu not supported (%lu to %lu frames)",
+                buffer, caps->buffer_min, caps->buffer_max );
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * expand the cache path (ie. '~'). return 0 on success
+ */
+static int probe_cache_path( const char *path, char *expanded, size_t size )
+{
+    wordexp_t exp_result;
+    int r = -1;
+
+    if (!wordexp( path, &exp_result, WRDE_NOCMD )) {
+        if (exp_result.we_wordc == 1) {
+            snprintf( expanded, size, "%s", exp_result.we_wordv[0] );
+            r = 0;
+        }
+        wordfree( &exp_result );
+    }
+    if (r)
+        err("invalid probe cache path '%s'", path);
+    return r;
+}
+
+
+int probe_cache_update( const struct probe_caps *caps )
+{
+    struct probe_caps *c;
+    unsigned i;
+
+    for (i = 0; i < cache_count; i++) {
+        if (cache[i].stream == caps->stream && !strcmp( cache[i].key, caps->key )) {
+            cache[i] = *caps;
+            return 0;
+        }
+    }
+    c = realloc( cache, (cache_count + 1) * sizeof(*cache) );
+    if (!c) {
+        err("can't allocate the probe cache");
+        return -1;
+    }
+    cache = c;
+    cache[cache_count++] = *caps;
+    return 0;
+}
+
+
+int probe_cache_load( const char *path )
+{
+    char file[256];
+    char line[512];
+    FILE *F;
+
+    if (probe_cache_path( path, file, sizeof(file) ) < 0)
+        return -1;
+    F = fopen( file, "r" );
+    if (!F)
+        return 0;
+    dbg("probe_cache_load: using %s", file);
+
+    while (fgets( line, sizeof(line), F ) != NULL) {
+        struct probe_caps caps;
+        unsigned long long formats;
+        char stream[16];
+
+        line[strcspn( line, "\n" )] = '\0';
+        if (line[0] == '#' || line[0] == '\0')
+            continue;
+        memset( &caps, 0, sizeof(caps) );
+        if (sscanf( line, "%95s %15s formats=%llx access=%x rates=%x rate=%u-%u channels=%u-%u period=%lu-%lu buffer=%lu-%lu",
+                caps.key, stream, &formats, &caps.access, &caps.rates, &caps.rate_min, &caps.rate_max,
+                &caps.channels_min, &caps.channels_max, &caps.period_min, &caps.period_max,
+                &caps.buffer_min, &caps.buffer_max ) != 13) {
+            warn("probe_cache_load: invalid line '%s' ignored", line);
+            continue;
+        }
+        caps.stream = strcmp( stream, "capture" ) ? SND_PCM_STREAM_PLAYBACK : SND_PCM_STREAM_CAPTURE;
+        caps.formats = formats;
+        if (probe_cache_update( &caps ) < 0)
+            break;
+    }
+    fclose(F);
+    return 0;
+}
+
+
+int probe_cache_save( const char *path )
+{
+    char file[256];
+    unsigned i;
+    FILE *F;
+
+    if (probe_cache_path( path, file, sizeof(file) ) < 0)
+        return -1;
+    F = fopen( file, "w" );
+    if (!F) {
+        err("cannot write the probe cache %s", file);
+        return -1;
+    }
+    fprintf( F, "# atest probe cache: one PCM stream per line\n" );
+    for (i = 0; i < cache_count; i++) {
+        const struct probe_caps *c = &cache[i];
+        fprintf( F, "%s %s formats=0x%llx access=0x%x rates=0x%x rate=%u-%u channels=%u-%u period=%lu-%lu buffer=%lu-%lu\n",
+                c->key, probe_stream_name( c->stream ), (unsigned long long)c->formats, c->access, c->rates,
+                c->rate_min, c->rate_max, c->channels_min, c->channels_max,
+                c->period_min, c->period_max, c->buffer_min, c->buffer_max );
+    }
+    fclose(F);
+    dbg("probe_cache_save: %u PCM streams saved in %s", cache_count, file);
+    return 0;
+}
+
+
+const struct probe_caps *probe_cache_find( snd_pcm_t *pcm, const char *device )
+{
+    snd_pcm_stream_t stream = snd_pcm_stream( pcm );
+    char key[96];
+    unsigned i;
+
+    if (!cache_count)
+        return NULL;
+    if (probe_key( pcm, device, key, sizeof(key) ) < 0)
+        return NULL;
+    for (i = 0; i < cache_count; i++) {
+        if (cache[i].stream == stream && !strcmp( cache[i].key, key ))
+            return &cache[i];
+    }
+    return NULL;
+}
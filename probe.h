@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef __probe_h__
+#define __probe_h__
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+#include "alsa.h"
+
+/*
+ * Hardware capabilities of the PCMs, enumerated with snd_pcm_hw_params_test_*()
+ * by 'atest probe', and kept in a cache file.
+ * Once loaded, the cache is used to check a config before the hw params
+ * negotiation (see alsa_device_setup()), and by the matrix test to skip the
+ * impossible points without setting the PCMs up.
+ */
+#define PROBE_CACHE_DEFAULT "~/.atest.cache"
+
+/* the rates tested one by one. The others are only checked against the rate range */
+#define PROBE_RATES { 8000, 11025, 16000, 22050, 24000, 32000, 44100, 48000, 64000, 88200, 96000, 176400, 192000 }
+
+struct probe_caps {
+    /*
+     * "<card id>,<device>,<PCM type>", as the capabilities of a plugin (plughw) differ
+     * from the ones of the device. The PCM name for PCMs without card (ie. pulse)
+     */
+    char key[96];
+    snd_pcm_stream_t stream;
+
+    uint64_t formats;           /* bit N set if the snd_pcm_format_t N is supported */
+    unsigned access;            /* bit N set if the snd_pcm_access_t N is supported */
+    unsigned rates;             /* bit N set if the rate N of PROBE_RATES is supported */
+    unsigned rate_min, rate_max;
+    unsigned channels_min, channels_max;
+    unsigned long period_min, period_max;   /* frames */
+    unsigned long buffer_min, buffer_max;
+};
+
+
+/*
+ * probe the capabilities of the PCM 'device', opened by probe_device() for 'stream'
+ * return 0 on success
+ */
+int probe_pcm( snd_pcm_t *pcm, const char *device, struct probe_caps *caps );
+int probe_device( const char *device, snd_pcm_stream_t stream, struct probe_caps *caps );
+
+void probe_caps_print( const struct probe_caps *caps, const char *prefix );
+
+/*
+ * return 1 if 'config' can be used with 'caps', otherwise 0, with the reason in 'reason'.
+ * The rate, period and buffer sizes are only checked if 'exact' is set (they are set
+ * to the nearest values otherwise)
+ */
+int probe_caps_check( const struct probe_caps *caps, const struct alsa_config *config,
+        int exact, char *reason, size_t size );
+
+
+/*
+ * the cache: a text file with the capabilities of one PCM stream per line.
+ * probe_cache_load() returns 0 on success, or if the file doesn't exist.
+ * probe_cache_update() adds (or replaces) the capabilities of a PCM stream.
+ * probe_cache_save() returns 0 on success.
+ * probe_cache_find() returns the cached capabilities of the PCM, NULL if unknown
+ * (valid until the next probe_cache_update()).
+ */
+int probe_cache_load( const char *path );
+int probe_cache_update( const struct probe_caps *caps );
+int probe_cache_save( const char *path );
+const struct probe_caps *probe_cache_find( snd_pcm_t *pcm, const char *device );
+
+#endif //__probe_h__
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "rate.h"
+
+
+void linreg_reset( struct linreg *l )
+{
+    memset( l, 0, sizeof(*l) );
+}
+
+
+void linreg_add( struct linreg *l, double x, double y )
+{
+    double dx = x - l->mean_x;
+
+    l->n++;
+    l->mean_x += dx / l->n;
+    l->mean_y += (y - l->mean_y) / l->n;
+    l->cxy += dx * (y - l->mean_y);
+    l->cxx += dx * (x - l->mean_x);
+}
+
+
+int linreg_slope( const struct linreg *l, double *slope )
+{
+    if (l->n < 2 || l->cxx <= 0)
+        return 0;
+    *slope = l->cxy / l->cxx;
+    return 1;
+}
+
+
+void rate_init( struct rate_estimator *r, double nominal )
+{
+    memset( r, 0, sizeof(*r) );
+    r->nominal = nominal;
+    r->t0 = -1;
+    r->window_start = -1;
+}
+
+
+static void rate_window_reset( struct rate_estimator *r, double t )
+{
+    linreg_reset( &r->window );
+    r->window_start = t;
+}
+
+
+void rate_add( struct rate_estimator *r, double t, double position )
+{
+    double slope;
+
+    if (r->t0 < 0)
+        r->t0 = t;
+    t -= r->t0;
+    if (r->window_start < 0)
+        rate_window_reset( r, t );
+
+    linreg_add( &r->segment, t, position );
+
+    if (t - r->window_start >= RATE_WINDOW) {
+        /* close the window */
+        if (linreg_slope( &r->window, &slope )) {
+            double ppm = (slope / r->nominal - 1.) * 1e6;
+            if (!r->windows || ppm < r->window_ppm_min) r->window_ppm_min = ppm;
+            if (!r->windows || ppm > r->window_ppm_max) r->window_ppm_max = ppm;
+            r->windows++;
+            linreg_add( &r->drift, r->window.mean_x, ppm );
+        }
+        rate_window_reset( r, t );
+    }
+    linreg_add( &r->window, t, position );
+}
+
+
+void rate_break( struct rate_estimator *r )
+{
+    r->cxy_total += r->segment.cxy;
+    r->cxx_total += r->segment.cxx;
+    linreg_reset( &r->segment );
+    /* the current window restarts with the next sample */
+    r->window_start = -1;
+}
+
+
+double rate_estimate( const struct rate_estimator *r )
+{
+    double cxx = r->cxx_total + r->segment.cxx;
+    if (cxx <= 0)
+        return 0;
+    return (r->cxy_total + r->segment.cxy) / cxx;
+}
+
+
+double rate_ppm( const struct rate_estimator *r )
+{
+    double rate = rate_estimate( r );
+    return rate ? (rate / r->nominal - 1.) * 1e6 : 0;
+}
+
+
+void rate_print( const struct rate_estimator *r, const char *prefix )
+{
+    double rate = rate_estimate( r );
+    double drift;
+
+    if (!rate) {
+        printf("%s: rate: not enough samples\n", prefix);
+        return;
+    }
+    printf("%s: rate: %.3f Hz (%+.1f ppm)", prefix, rate, rate_ppm( r ));
+    if (r->windows)
+        printf(", %.0fs windows: min %+.1f max %+.1f ppm", RATE_WINDOW, r->window_ppm_min, r->window_ppm_max);
+    if (linreg_slope( &r->drift, &drift ))
+        printf(", drift %+.2f ppm/h", drift * 3600.);
+    printf("\n");
+}
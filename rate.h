@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef __rate_h__
+#define __rate_h__
+
+#include <stdint.h>
+
+/*
+ * online least squares regression of y against x (Welford like updates,
+ * numerically stable over days of samples)
+ */
+struct linreg {
+    uint64_t n;
+    double mean_x;
+    double mean_y;
+    double cxy;
+    double cxx;
+};
+
+void linreg_reset( struct linreg *l );
+void linreg_add( struct linreg *l, double x, double y );
+/* return 0 if there is not enough samples */
+int linreg_slope( const struct linreg *l, double *slope );
+
+
+/*
+ * actual sample rate estimation: regression of the stream position (in frames)
+ * against the time.
+ * The stream can be restarted (rate_break()): the slope is then the pooled
+ * slope of every segment.
+ * The rate is also estimated over consecutive windows of RATE_WINDOW seconds,
+ * to measure how the rate drifts over the run.
+ */
+#define RATE_WINDOW 10.
+
+struct rate_estimator {
+    double nominal;
+    double t0;                  /* time of the first sample */
+
+    struct linreg segment;      /* since the last rate_break() */
+    double cxy_total;           /* previous segments */
+    double cxx_total;
+
+    struct linreg window;
+    double window_start;
+    unsigned windows;
+    double window_ppm_min;
+    double window_ppm_max;
+    struct linreg drift;        /* window ppm against time */
+};
+
+void rate_init( struct rate_estimator *r, double nominal );
+
+/* 'position' frames were transferred by the hardware at time 't' (seconds) */
+void rate_add( struct rate_estimator *r, double t, double position );
+void rate_break( struct rate_estimator *r );
+
+/* return the estimated rate, or 0 if unknown */
+double rate_estimate( const struct rate_estimator *r );
+
+/* error of the estimated rate against the nominal one, in ppm */
+double rate_ppm( const struct rate_estimator *r );
+
+/* "prefix: rate ... Hz (ppm), windows min/max, drift ppm/h" */
+void rate_print( const struct rate_estimator *r, const char *prefix );
+
+#endif //__rate_h__
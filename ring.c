@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+
+int ring_init( struct ring *r, unsigned slots, size_t slot_bytes )
+{
+    unsigned n = 1;
+
+    memset( r, 0, sizeof(*r) );
+    if (slots == 0)
+        return -1;
+    /* a power of 2, so the slot index stays continuous when the counters wrap */
+    while (n < slots)
+        n <<= 1;
+    slots = n;
+    r->data = malloc( slots * slot_bytes );
+    if (!r->data)
+        return -1;
+    r->slots = slots;
+    r->slot_bytes = slot_bytes;
+    atomic_init( &r->head, 0 );
+    atomic_init( &r->tail, 0 );
+    return 0;
+}
+
+
+void ring_release( struct ring *r )
+{
+    free( r->data );
+    r->data = NULL;
+}
+
+
+static void *ring_slot( struct ring *r, unsigned index )
+{
+    return r->data + (index % r->slots) * r->slot_bytes;
+}
+
+
+void *ring_write_slot( struct ring *r )
+{
+    unsigned head = atomic_load_explicit( &r->head, memory_order_relaxed );
+    unsigned tail = atomic_load_explicit( &r->tail, memory_order_acquire );
+
+    if (head - tail >= r->slots) {
+        r->overruns++;
+        return NULL;
+    }
+    return ring_slot( r, head );
+}
+
+
+void ring_write_commit( struct ring *r )
+{
+    unsigned head = atomic_load_explicit( &r->head, memory_order_relaxed ) + 1;
+    unsigned occupancy = head - atomic_load_explicit( &r->tail, memory_order_relaxed );
+
+    if (occupancy > r->max_occupancy)
+        r->max_occupancy = occupancy;
+    /* publish the slot content along with the new head */
+    atomic_store_explicit( &r->head, head, memory_order_release );
+}
+
+
+void *ring_read_slot( struct ring *r )
+{
+    unsigned tail = atomic_load_explicit( &r->tail, memory_order_relaxed );
+    unsigned head = atomic_load_explicit( &r->head, memory_order_acquire );
+
+    if (head == tail)
+        return NULL;
+    return ring_slot( r, tail );
+}
+
+
+void ring_read_release( struct ring *r )
+{
+    unsigned tail = atomic_load_explicit( &r->tail, memory_order_relaxed );
+    atomic_store_explicit( &r->tail, tail + 1, memory_order_release );
+}
+
+
+unsigned ring_occupancy( struct ring *r )
+{
+    return atomic_load( &r->head ) - atomic_load( &r->tail );
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef __ring_h__
+#define __ring_h__
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Lock free single producer / single consumer ring of fixed size slots.
+ * The producer and the consumer may run on different threads, and never
+ * block each other: when the ring is full, ring_write_slot() fails.
+ *
+ * head and tail are free running counters. Only the producer writes 'head',
+ * only the consumer writes 'tail'.
+ */
+struct ring {
+    unsigned slots;
+    size_t slot_bytes;
+    unsigned char *data;
+
+    atomic_uint head;
+    atomic_uint tail;
+
+    /* producer side statistics */
+    unsigned max_occupancy;
+    unsigned overruns;      /* ring_write_slot() failed on full ring */
+};
+
+/* 'slots' is rounded up to a power of 2. return 0 on success */
+int ring_init( struct ring *r, unsigned slots, size_t slot_bytes );
+void ring_release( struct ring *r );
+
+/*
+ * producer side:
+ * ring_write_slot() returns the next free slot, or NULL if the ring is full.
+ * ring_write_commit() gives the slot to the consumer.
+ */
+void *ring_write_slot( struct ring *r );
+void ring_write_commit( struct ring *r );
+
+/*
+ * consumer side:
+ * ring_read_slot() returns the oldest committed slot, or NULL if the ring is empty.
+ * ring_read_release() gives the slot back to the producer.
+ */
+void *ring_read_slot( struct ring *r );
+void ring_read_release( struct ring *r );
+
+/* number of committed slots not released yet */
+unsigned ring_occupancy( struct ring *r );
+
+#endif //__ring_h__
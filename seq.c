@@ -15,205 +15,1011 @@
 #include "seq.h"
 #include "log.h"
 
-unsigned seq_errors_total = 0;
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+atomic_uint seq_errors_total = 0;
 void (*seq_error_notify)(void) = NULL;
 unsigned seq_consecutive_invalid_frames_log = 1;
 unsigned seq_max_consecutive_invalid_frames_before_null_warning = 4;
+int seq_channel_tracking = 0;
+int seq_long_position = 0;
+
+
+/*
+ * SIMD helpers used by the seq_check_frames() fast path.
+ * Selected at build time (use CFLAGS=-mavx2 to get the AVX2 flavor on x86).
+ *
+ * seq_vec_t holds SEQ_VEC_BYTES bytes of samples.
+ *   vec_load()      unaligned load
+ *   vec_equal()     true if both vectors are identical
+ *   vec_is_null()   true if every byte is 0x00 or 0xFF
+ */
+#if defined(__AVX2__)
+#define SEQ_VEC_BYTES 32
+typedef __m256i seq_vec_t;
+static inline seq_vec_t vec_load( const void *p ) { return _mm256_loadu_si256( (const __m256i *)p ); }
+static inline int vec_equal( seq_vec_t a, seq_vec_t b ) {
+    return _mm256_movemask_epi8( _mm256_cmpeq_epi8( a, b )) == -1;
+}
+static inline int vec_is_null( seq_vec_t a ) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i ones = _mm256_cmpeq_epi8( zero, zero );
+    return _mm256_movemask_epi8( _mm256_or_si256( _mm256_cmpeq_epi8( a, zero ), _mm256_cmpeq_epi8( a, ones ))) == -1;
+}
+
+#elif defined(__SSE2__)
+#define SEQ_VEC_BYTES 16
+typedef __m128i seq_vec_t;
+static inline seq_vec_t vec_load( const void *p ) { return _mm_loadu_si128( (const __m128i *)p ); }
+static inline int vec_equal( seq_vec_t a, seq_vec_t b ) {
+    return _mm_movemask_epi8( _mm_cmpeq_epi8( a, b )) == 0xFFFF;
+}
+static inline int vec_is_null( seq_vec_t a ) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i ones = _mm_cmpeq_epi8( zero, zero );
+    return _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( a, zero ), _mm_cmpeq_epi8( a, ones ))) == 0xFFFF;
+}
+
+#elif defined(__ARM_NEON)
+#define SEQ_VEC_BYTES 16
+typedef uint8x16_t seq_vec_t;
+static inline int vec_all_ones( uint8x16_t m ) {
+    uint64x2_t m64 = vreinterpretq_u64_u8( m );
+    return (vgetq_lane_u64( m64, 0 ) & vgetq_lane_u64( m64, 1 )) == ~0ULL;
+}
+static inline seq_vec_t vec_load( const void *p ) { return vld1q_u8( (const uint8_t *)p ); }
+static inline int vec_equal( seq_vec_t a, seq_vec_t b ) { return vec_all_ones( vceqq_u8( a, b )); }
+static inline int vec_is_null( seq_vec_t a ) {
+    return vec_all_ones( vorrq_u8( vceqq_u8( a, vdupq_n_u8( 0 )), vceqq_u8( a, vdupq_n_u8( 0xFF ))));
+}
+#endif
+
+
+/*
+ * compare the frame with a Null frame (full of 0x00 or 0xFF)
+ * return 1 if this is the case, 0 otherwise
+ */
+static inline int is_null_frame( const void *frame, int byte_size ) {
+    const unsigned char *b = (const unsigned char *)frame;
+    while (byte_size-- > 0) {
+        if ((*b != 0) && (*b != 0xFF)) return 0;
+        b++;
+    }
+    return 1;
+}
+
+
+/*
+ * Sample codecs.
+ * The pattern of the sequence is stored in the MSBs of the sample, so it
+ * is not altered by a codec truncating the LSBs. The unused LSBs are zero.
+ *
+ * Codecs work on 'values': the sample content aligned on the MSBs of a 32 bits word
+ * put_xxx() store a value into a sample (the bits below the sample width are lost)
+ * get_xxx() extract the value of a sample. return 0 if the sample can't hold a value
+ */
+static inline uint32_t get_le32( const unsigned char *p ) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void put_le32( unsigned char *p, uint32_t v ) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline void put_s16( unsigned char *p, uint32_t value ) {
+    p[0] = value >> 16;
+    p[1] = value >> 24;
+}
 
-#define FRAME_NUM_MASK   0x7FF
-#define FRAME_NUM_SHIFT  5
-#define CHANNEL_MASK     0x1F  /* up to 32 channels */
+static inline int get_s16( const unsigned char *p, uint32_t *value ) {
+    *value = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 24);
+    return 1;
+}
+
+/* 24 bits in the LSBs of a 32 bits word, sign extended */
+static inline void put_s24( unsigned char *p, uint32_t value ) {
+    put_le32( p, (value >> 8) | ((value & 0x80000000u) ? 0xff000000u : 0) );
+}
+
+static inline int get_s24( const unsigned char *p, uint32_t *value ) {
+    /* the MSB is ignored: some controllers don't sign extend */
+    *value = ((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24);
+    return 1;
+}
 
-void seq_init( struct seq_info *seq, unsigned channels, snd_pcm_format_t format )
+static inline void put_s32( unsigned char *p, uint32_t value ) {
+    put_le32( p, value );
+}
+
+static inline int get_s32( const unsigned char *p, uint32_t *value ) {
+    *value = get_le32( p );
+    return 1;
+}
+
+static inline void put_s24_3( unsigned char *p, uint32_t value ) {
+    p[0] = value >> 8;
+    p[1] = value >> 16;
+    p[2] = value >> 24;
+}
+
+static inline int get_s24_3( const unsigned char *p, uint32_t *value ) {
+    *value = ((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24);
+    return 1;
+}
+
+/*
+ * the value as a signed 32 bits integer, scaled in [-1.0, 1.0[
+ * (exact in a float up to 24 significant bits)
+ */
+static inline void put_float( unsigned char *p, uint32_t value ) {
+    float f = (int32_t)value / 2147483648.0f;
+    uint32_t v;
+    memcpy( &v, &f, sizeof(v) );
+    put_le32( p, v );
+}
+
+static inline int get_float( const unsigned char *p, uint32_t *value ) {
+    uint32_t v = get_le32( p );
+    float f;
+    double d;
+    int32_t i;
+    memcpy( &f, &v, sizeof(f) );
+    d = f * 2147483648.0;
+    if (!(d >= -2147483648.0 && d < 2147483648.0))
+        return 0;
+    i = (int32_t)d;
+    *value = (uint32_t)i;
+    return d == (double)i;
+}
+
+
+typedef enum seq_stat_e (*seq_classify_t)( const struct seq_info *seq, const unsigned char *frame, unsigned *frame_seq );
+
+/*
+ * Frame classification kernels.
+ * SEQ_CLASSIFY_KERNEL() generates the kernel of a given format, for a channel count
+ * known at compile time, so the compiler can unroll the channel loop.
+ * The '_n' flavor is the generic one, for any channel count.
+ *
+ * return the kind of frame. For a VALID_FRAME, *frame_seq is the frame number.
+ */
+#define SEQ_CLASSIFY_KERNEL(name, suffix, sample_bytes, get_value, CHANNELS)                         \
+static enum seq_stat_e classify_##name##_##suffix( const struct seq_info *seq,                      \
+        const unsigned char *frame, unsigned *frame_seq )                                           \
+{                                                                                                   \
+    const unsigned channels = (CHANNELS);                                                           \
+    unsigned ch;                                                                                    \
+    uint32_t value, pattern;                                                                        \
+                                                                                                    \
+    if (is_null_frame( frame, channels * (sample_bytes) ))                                          \
+        return NULL_FRAME;                                                                          \
+                                                                                                    \
+    for (ch = 0; ch < channels; ch++) {                                                             \
+        if (!get_value( frame + ch * (sample_bytes), &value ) ||                                    \
+            (value & seq->value_lsb_mask))                                                          \
+            return INVALID_FRAME;                                                                   \
+        pattern = seq_value_pattern( seq, value );                                                  \
+        if (ch == 0)                                                                                \
+            *frame_seq = pattern >> seq->channel_bits;                                              \
+        if (((pattern & seq->channel_mask) != ch) ||                                                \
+            ((pattern >> seq->channel_bits) != *frame_seq))                                         \
+            return INVALID_FRAME;                                                                   \
+    }                                                                                               \
+    return VALID_FRAME;                                                                             \
+}
+
+#define SEQ_FORMAT_KERNELS(name, sample_bytes, get_value)                                           \
+    SEQ_CLASSIFY_KERNEL(name, 2, sample_bytes, get_value, 2)                                        \
+    SEQ_CLASSIFY_KERNEL(name, 4, sample_bytes, get_value, 4)                                        \
+    SEQ_CLASSIFY_KERNEL(name, 8, sample_bytes, get_value, 8)                                        \
+    SEQ_CLASSIFY_KERNEL(name, 16, sample_bytes, get_value, 16)                                      \
+    SEQ_CLASSIFY_KERNEL(name, 32, sample_bytes, get_value, 32)                                      \
+    SEQ_CLASSIFY_KERNEL(name, n, sample_bytes, get_value, seq->channels)                            \
+    static const seq_classify_t classify_##name[] = {                                               \
+        classify_##name##_2, classify_##name##_4, classify_##name##_8,                              \
+        classify_##name##_16, classify_##name##_32, classify_##name##_n                             \
+    };
+
+SEQ_FORMAT_KERNELS(s16, 2, get_s16)
+SEQ_FORMAT_KERNELS(s24, 4, get_s24)
+SEQ_FORMAT_KERNELS(s32, 4, get_s32)
+SEQ_FORMAT_KERNELS(s24_3, 3, get_s24_3)
+SEQ_FORMAT_KERNELS(float, 4, get_float)
+
+
+static const struct seq_format {
+    snd_pcm_format_t format;
+    unsigned sample_bytes;
+    unsigned value_bits;            /* significant bits of a value */
+    void (*put)( unsigned char *p, uint32_t value );
+    int (*get)( const unsigned char *p, uint32_t *value );
+    const seq_classify_t *classify; /* for 2, 4, 8, 16, 32 and any channels */
+} seq_formats[] = {
+    { SND_PCM_FORMAT_S16_LE,   2, 16, put_s16,   get_s16,   classify_s16 },
+    { SND_PCM_FORMAT_S24_LE,   4, 24, put_s24,   get_s24,   classify_s24 },
+    { SND_PCM_FORMAT_S32_LE,   4, 32, put_s32,   get_s32,   classify_s32 },
+    { SND_PCM_FORMAT_S24_3LE,  3, 24, put_s24_3, get_s24_3, classify_s24_3 },
+    { SND_PCM_FORMAT_FLOAT_LE, 4, 24, put_float, get_float, classify_float },
+};
+
+
+/*
+ * address of the sample of channel 'ch', frame 'i' of a non interleaved table
+ */
+static inline unsigned char *table_sample( const struct seq_info *seq, unsigned ch, unsigned i ) {
+    return (unsigned char *)seq->table + (ch * 2 * seq->table_frames + i) * seq->sample_bytes;
+}
+
+
+int seq_format_supported( snd_pcm_format_t format )
+{
+    int i;
+    for (i = 0; i < sizeof(seq_formats)/sizeof(seq_formats[0]); i++) {
+        if (seq_formats[i].format == format)
+            return 1;
+    }
+    return 0;
+}
+
+
+int seq_init( struct seq_info *seq, unsigned channels, snd_pcm_format_t format, int interleaved )
 {
+    const struct seq_format *f = NULL;
+    unsigned char *frame;
+    unsigned i, ch;
+
     memset( seq, 0, sizeof(*seq));
     seq->channels = channels;
     seq->format = format;
+    seq->interleaved = interleaved;
     seq->frame_num = 0;
+
+    for (i = 0; i < sizeof(seq_formats)/sizeof(seq_formats[0]); i++) {
+        if (seq_formats[i].format == format)
+            f = &seq_formats[i];
+    }
+    if (!f) {
+        err("seq_init: format %s not supported", snd_pcm_format_name( format ));
+        return -1;
+    }
+    if ((channels == 0) || (channels > SEQ_MAX_CHANNELS)) {
+        err("seq_init: %u channels not supported (max %u)", channels, SEQ_MAX_CHANNELS);
+        return -1;
+    }
+
+    seq->sample_bytes = f->sample_bytes;
+    seq->frame_bytes = channels * f->sample_bytes;
+
+    /*
+     * pattern layout: up to 32 channels, the historical 16 bits pattern (5 bits of channel,
+     * 11 bits of frame number). Above, the channel field grows, and the pattern is made
+     * wider as far as the format allows, to keep up to 11 bits of frame number.
+     */
+    seq->channel_bits = 5;
+    while ((1u << seq->channel_bits) < channels)
+        seq->channel_bits++;
+    seq->pattern_bits = 16;
+    if (channels > 32) {
+        seq->pattern_bits = seq->channel_bits + SEQ_FRAME_NUM_BITS;
+        if (seq->pattern_bits > f->value_bits)
+            seq->pattern_bits = f->value_bits;
+    }
+    seq->frame_num_bits = seq->pattern_bits - seq->channel_bits;
+
+    /* long sequence: one more bit, on top of the frame number */
+    if (seq_long_position) {
+        if (seq->pattern_bits < f->value_bits)
+            seq->pattern_bits++;
+        else
+            seq->frame_num_bits--;
+        seq->long_bits = 64 - seq->frame_num_bits;
+        seq->long_flag = 1u << (seq->channel_bits + seq->frame_num_bits);
+    }
+    seq->channel_mask = (1u << seq->channel_bits) - 1;
+    seq->value_lsb_mask = (uint32_t)(((uint64_t)1 << (32 - seq->pattern_bits)) - 1);
+    seq->put = f->put;
+    seq->get = f->get;
+    seq->channel_tracking = seq_channel_tracking;
+    seq_events_init( &seq->events );
+    switch (channels) {
+    case 2:  seq->classify = f->classify[0]; break;
+    case 4:  seq->classify = f->classify[1]; break;
+    case 8:  seq->classify = f->classify[2]; break;
+    case 16: seq->classify = f->classify[3]; break;
+    case 32: seq->classify = f->classify[4]; break;
+    default: seq->classify = f->classify[5]; break;
+    }
+
+    /*
+     * pre-generate the sequence. The table holds two full cycles of frame numbers,
+     * so any run of up to 'table_frames' frames can be copied (or used in place) at once.
+     * In non interleaved mode, each channel has its own contiguous row of samples.
+     */
+    seq->table_frames = 1u << seq->frame_num_bits;
+    seq->frame_num_mask = seq->table_frames - 1;
+    seq->table = malloc( 2 * seq->table_frames * seq->frame_bytes );
+    if (!seq->table) {
+        err("seq_init: can't allocate the sequence table");
+        return -1;
+    }
+
+    /*
+     * The fast path of seq_check_frames() accepts any frame identical to the table.
+     * This is only right if the checker would consider every frames of the table as
+     * valid, which is not the case with null frames (ie. frame #0 of a mono stream).
+     */
+    seq->check_fast = 1;
+    frame = seq->frame_tmp;
+    for (i = 0; i < 2 * seq->table_frames; i++) {
+        for (ch = 0; ch < channels; ch++)
+            f->put( frame + ch * f->sample_bytes, seq_pattern_value( seq, seq_table_pattern( seq, ch, i ) ) );
+
+        if (is_null_frame( frame, seq->frame_bytes ))
+            seq->check_fast = 0;
+
+        if (interleaved) {
+            memcpy( (unsigned char *)seq->table + i * seq->frame_bytes, frame, seq->frame_bytes );
+        } else {
+            for (ch = 0; ch < channels; ch++)
+                memcpy( table_sample( seq, ch, i ), frame + ch * f->sample_bytes, f->sample_bytes );
+        }
+    }
+    seq->check_table = seq->table;
+    return 0;
+}
+
+
+void seq_release( struct seq_info *seq )
+{
+    free( seq->table );
+    free( seq->skew_table );
+    seq_events_release( &seq->events );
+    seq->table = NULL;
+    seq->skew_table = NULL;
+    seq->check_table = NULL;
 }
 
 
 void seq_reset( struct seq_info *seq )
 {
     seq->frame_num = 0;
+    seq->position = 0;
+    seq->pos_locked = 0;
+    seq->pos_bits_valid = 0;
     seq->state = NULL_FRAME;
     seq->prev_state = NULL_FRAME;
 }
 
 
-void seq_fill_frames( struct seq_info *seq, void *buff, int frame_count ) {
-    int16_t *s16;
-
-    switch (seq->format) {
-    case SND_PCM_FORMAT_S16_LE:
-        s16 = (int16_t *)buff;
-        while (frame_count--) {
-            int ch;
-            for (ch = 0; ch < seq->channels; ch++) {
-                *s16++ = (ch & CHANNEL_MASK) | ((seq->frame_num & FRAME_NUM_MASK) << FRAME_NUM_SHIFT);
-            }
-            seq->frame_num++;
+/*
+ * long sequence: set the position bits of the 'n' frames copied from the table,
+ * starting at seq->position. At most one cycle, so only 'long_bits' frames to look at
+ * (the cycle marker is already in the table).
+ * With interleaved frames, bufs[0] is the first frame. Otherwise bufs[ch] is the
+ * first sample of the channel.
+ */
+static void long_position_fill( struct seq_info *seq, unsigned char * const *bufs, int n ) {
+    unsigned first = seq->position & seq->frame_num_mask;
+    unsigned offset, ch;
+
+    for (offset = 1; offset <= seq->long_bits; offset++) {
+        unsigned i = (offset - first) & seq->frame_num_mask;
+        uint64_t position = seq->position + i;
+        if ((i >= n) || !seq_long_bit( seq, position ))
+            continue;
+        for (ch = 0; ch < seq->channels; ch++) {
+            unsigned char *p = seq->interleaved ?
+                bufs[0] + i * seq->frame_bytes + ch * seq->sample_bytes :
+                bufs[ch] + i * seq->sample_bytes;
+            seq->put( p, seq_pattern_value( seq, seq_position_pattern( seq, ch, position ) ) );
         }
-        break;
+    }
+}
 
-    default:
-        /* format not implemented yet */
-        break;
+
+void seq_fill_frames( struct seq_info *seq, void *buff, int frame_count ) {
+    unsigned char *dst = (unsigned char *)buff;
+
+    /* copy from the pre-generated table, by runs of at most one full cycle */
+    while (frame_count > 0) {
+        int n = frame_count < seq->table_frames ? frame_count : seq->table_frames;
+        unsigned first = seq->frame_num & seq->frame_num_mask;
+
+        memcpy( dst, (const unsigned char *)seq->table + first * seq->frame_bytes, n * seq->frame_bytes );
+        if (seq->long_bits)
+            long_position_fill( seq, &dst, n );
+        dst += n * seq->frame_bytes;
+        seq->frame_num += n;
+        seq->position += n;
+        frame_count -= n;
+    }
+}
+
+
+const void *seq_frames_ptr( struct seq_info *seq, int frame_count ) {
+    const unsigned char *frames;
+
+    if ((frame_count > seq->table_frames) || seq->long_bits)
+        return NULL;
+
+    frames = (const unsigned char *)seq->table + (seq->frame_num & seq->frame_num_mask) * seq->frame_bytes;
+    seq->frame_num += frame_count;
+    seq->position += frame_count;
+    return frames;
+}
+
+
+void seq_fill_channels( struct seq_info *seq, void * const *bufs, int frame_count ) {
+    int done = 0;
+
+    while (done < frame_count) {
+        int n = frame_count - done < seq->table_frames ? frame_count - done : seq->table_frames;
+        unsigned first = seq->frame_num & seq->frame_num_mask;
+        unsigned char *dst[SEQ_MAX_CHANNELS];
+        unsigned ch;
+
+        for (ch = 0; ch < seq->channels; ch++) {
+            dst[ch] = (unsigned char *)bufs[ch] + done * seq->sample_bytes;
+            memcpy( dst[ch], table_sample( seq, ch, first ), n * seq->sample_bytes );
+        }
+        if (seq->long_bits)
+            long_position_fill( seq, dst, n );
+        seq->frame_num += n;
+        seq->position += n;
+        done += n;
     }
 }
 
+
+int seq_channels_ptr( struct seq_info *seq, const void **bufs, int frame_count ) {
+    unsigned first = seq->frame_num & seq->frame_num_mask;
+    unsigned ch;
+
+    if ((frame_count > seq->table_frames) || seq->long_bits)
+        return -1;
+
+    for (ch = 0; ch < seq->channels; ch++)
+        bufs[ch] = table_sample( seq, ch, first );
+    seq->frame_num += frame_count;
+    seq->position += frame_count;
+    return 0;
+}
+
+
+void seq_fill_rewind( struct seq_info *seq, int frame_count ) {
+    seq->frame_num -= frame_count;
+    seq->position -= frame_count;
+}
+
+
 /*
- * compare the frame with a Null frame (full of 0x00 or 0xFF)
- * return 1 if this is the case, 0 otherwise
+ * log the frame content (formatted by the log thread with -L)
  */
-static int is_null_frame( const void *frame, int byte_size ) {
-    const unsigned char *b = (const unsigned char *)frame;
-    while (byte_size-- > 0) {
-        if ((*b != 0) && (*b != 0xFF)) return 0;
-        b++;
+static void log_frame( enum log_level level, struct seq_info *seq, const void *frame ) {
+    log_samples( level, frame, seq->sample_bytes, seq->channels );
+}
+
+
+/*
+ * long sequence: the position bits of a full cycle were received (ie. the frames
+ * #0 to #long_bits of the cycle starting at 'cycle_position')
+ * return the number of errors
+ */
+static int long_position_check( struct seq_info *seq, uint64_t cycle_position ) {
+    uint64_t expected = cycle_position >> seq->frame_num_bits;
+    int64_t delta = (int64_t)((seq->pos_bits - expected) << seq->frame_num_bits);
+
+    if (!seq->pos_locked) {
+        seq->pos_locked = 1;
+        seq->position += delta;
+        dbg("frame position locked at %llu", (unsigned long long)(cycle_position + delta));
+        return 0;
     }
+    if (!delta)
+        return 0;
+
+    err("frame position %llu received instead of %llu",
+            (unsigned long long)(cycle_position + delta), (unsigned long long)cycle_position);
+    seq_event_position_jump( seq, delta );
+    seq->position += delta;
+    seq->error_count++;
+    seq_errors_total++;
     return 1;
 }
 
+/*
+ * advance the position of the checker over 'n' contiguous frames accepted with the
+ * expected frame number. 'bit' is the long sequence bit of the first one, or -1 if
+ * the frames are identical to the pre-generated table (the bit is only set on the
+ * cycle marker).
+ * return the number of errors
+ */
+static int seq_position_advance( struct seq_info *seq, unsigned n, int bit ) {
+    int errors = 0;
+
+    while (seq->long_bits && n) {
+        unsigned offset = seq->position & seq->frame_num_mask;
+        unsigned k = seq->table_frames - offset;
+        int b = bit < 0 ? offset == 0 : bit;
+        if (k > n)
+            k = n;
+
+        if (offset == 0) {
+            seq->pos_bits = 0;
+            seq->pos_bits_valid = b;
+        } else if (b && (offset <= seq->long_bits)) {
+            seq->pos_bits |= 1ull << (offset - 1);
+        }
+        bit = -1;
+        if (seq->pos_bits_valid && (offset <= seq->long_bits) && (offset + k > seq->long_bits)) {
+            seq->pos_bits_valid = 0;
+            errors += long_position_check( seq, seq->position - offset );
+        }
+        seq->position += k;
+        n -= k;
+    }
+    seq->position += n;
+    return errors;
+}
 
 /*
- * log the frame content
+ * the checker receives the frame number 'frame_seq' instead of the expected one.
+ * 'jump' is true in the middle of valid frames: the position moves backward or
+ * forward, by less than half a cycle. Otherwise, the frames in between were not
+ * valid frames: like the frame number, the position is not checked across such a gap,
+ * and is locked again on the next cycle.
  */
-static void log_frame( enum log_level level, struct seq_info *seq, const void *frame ) {
-    const int16_t *s16 = (const int16_t *)frame;
-    int ch;
-    char line[16*10];
-    int pos;
+static void seq_position_resync( struct seq_info *seq, unsigned frame_seq, int jump ) {
+    int cycle = seq->table_frames;
+    int n = (frame_seq - seq->position) & seq->frame_num_mask;
 
-    strcpy( line, "  "); /* indentation */
-    pos = strlen(line);
-    for (ch = 0; ch < seq->channels; ch++) {
-        if (pos < sizeof(line)-1)
-            pos += snprintf(line + pos, sizeof(line) - pos - 1, "%04x ", (unsigned)(*s16) & 0xFFFF);
-        s16++;
+    if (jump && (n >= cycle / 2))
+        n -= cycle;
+    if (!jump)
+        seq->pos_locked = 0;
+    seq->position += n;
+    seq->pos_bits_valid = 0;
+}
+
+
+#ifdef SEQ_VEC_BYTES
+/*
+ * return how many leading bytes of 'a' and 'b' are identical,
+ * by steps of SEQ_VEC_BYTES (or 'byte_size' if everything matches)
+ */
+static int vec_match_bytes( const unsigned char *a, const unsigned char *b, int byte_size ) {
+    int pos = 0;
+
+    while ((pos + SEQ_VEC_BYTES <= byte_size) && vec_equal( vec_load( a + pos ), vec_load( b + pos )))
+        pos += SEQ_VEC_BYTES;
+
+    /* check the remaining bytes at once, overlapping the last matching vector */
+    if ((pos < byte_size) && (byte_size >= SEQ_VEC_BYTES) && (pos + SEQ_VEC_BYTES > byte_size)) {
+        int last = byte_size - SEQ_VEC_BYTES;
+        if (vec_equal( vec_load( a + last ), vec_load( b + last )))
+            pos = byte_size;
+    }
+    return pos;
+}
+
+/*
+ * return how many leading frames of 'buff' match exactly the sequence starting at seq->frame_num
+ */
+static int fast_valid_frames( const struct seq_info *seq, const unsigned char *buff, int frame_count ) {
+    int done = 0;
+
+    while (done < frame_count) {
+        int n = frame_count - done < seq->table_frames ? frame_count - done : seq->table_frames;
+        const unsigned char *expected = (const unsigned char *)seq->check_table +
+            ((seq->frame_num + done) & seq->frame_num_mask) * seq->frame_bytes;
+        int bytes = vec_match_bytes( buff, expected, n * seq->frame_bytes );
+
+        done += bytes / seq->frame_bytes;
+        if (bytes < n * seq->frame_bytes)
+            break;
+        buff += bytes;
     }
-    log( level, "%s", line);
+    return done;
 }
 
+/*
+ * return how many leading frames of 'buff' are null frames
+ */
+static int fast_null_frames( const struct seq_info *seq, const unsigned char *buff, int frame_count ) {
+    int byte_size = frame_count * seq->frame_bytes;
+    int pos = 0;
+
+    while ((pos + SEQ_VEC_BYTES <= byte_size) && vec_is_null( vec_load( buff + pos )))
+        pos += SEQ_VEC_BYTES;
+    return pos / seq->frame_bytes;
+}
+
+/*
+ * non interleaved flavors: the number of frames accepted is the
+ * smallest number of samples accepted among the channels
+ */
+static int fast_valid_channels( const struct seq_info *seq, const unsigned char * const *bufs, int pos, int frame_count ) {
+    int done = 0;
+
+    while (done < frame_count) {
+        int n = frame_count - done < seq->table_frames ? frame_count - done : seq->table_frames;
+        unsigned first = (seq->frame_num + done) & seq->frame_num_mask;
+        unsigned ch;
+        int valid = n;
+
+        for (ch = 0; (ch < seq->channels) && valid; ch++) {
+            /* each row is compared from the channel own frame number (see ch_offset) */
+            int bytes = vec_match_bytes( bufs[ch] + (pos + done) * seq->sample_bytes,
+                    table_sample( seq, ch, (first - seq->ch_offset[ch]) & seq->frame_num_mask ),
+                    valid * seq->sample_bytes );
+            valid = bytes / seq->sample_bytes;
+        }
+        done += valid;
+        if (valid < n)
+            break;
+    }
+    return done;
+}
+
+static int fast_null_channels( const struct seq_info *seq, const unsigned char * const *bufs, int pos, int frame_count ) {
+    unsigned ch;
+    int null_frames = frame_count;
+
+    for (ch = 0; (ch < seq->channels) && null_frames; ch++) {
+        const unsigned char *b = bufs[ch] + pos * seq->sample_bytes;
+        int byte_size = null_frames * seq->sample_bytes;
+        int bytes = 0;
+
+        while ((bytes + SEQ_VEC_BYTES <= byte_size) && vec_is_null( vec_load( b + bytes )))
+            bytes += SEQ_VEC_BYTES;
+        null_frames = bytes / seq->sample_bytes;
+    }
+    return null_frames;
+}
+
+/*
+ * Steady state fast path: skip the frames which would go through the state
+ * machine without any log nor state change, ie. the expected valid frames
+ * while in VALID_FRAME state, and the null frames while in NULL_FRAME state.
+ *
+ * return the number of frames consumed. *errors is increased by the number of errors
+ * detected on the way (long sequence position)
+ */
+static int seq_check_fast_path( struct seq_info *seq, const unsigned char * const *bufs, int pos, int frame_count, int *errors ) {
+    int n = 0;
+
+    switch (seq->state) {
+    case VALID_FRAME:
+        if (!seq->check_fast)
+            break;
+        if (seq->interleaved)
+            n = fast_valid_frames( seq, bufs[0] + pos * seq->frame_bytes, frame_count );
+        else
+            n = fast_valid_channels( seq, bufs, pos, frame_count );
+        seq->frame_num = (seq->frame_num + n) & seq->frame_num_mask;
+        *errors += seq_position_advance( seq, n, -1 );
+        break;
+    case NULL_FRAME:
+        if (seq->interleaved)
+            n = fast_null_frames( seq, bufs[0] + pos * seq->frame_bytes, frame_count );
+        else
+            n = fast_null_channels( seq, bufs, pos, frame_count );
+        seq->frame_num += n;
+        break;
+    case INVALID_FRAME:
+        break;
+    }
+    return n;
+}
+#endif
+
 
 void seq_check_jump_notify( struct seq_info *seq ) {
     seq->state = NULL_FRAME;
     seq->frame_num = 0;
+    seq->pos_locked = 0;
+    seq_event_burst_abort( seq );
 }
 
-int seq_check_frames( struct seq_info *seq, const void *buff, int frame_count ) {
-    const int16_t *s16;
-    s16 = (const int16_t *)buff;
 
-    int frame_byte_size = seq->channels * sizeof(int16_t);
-    unsigned current_frame_seq;
+/*
+ * per channel tracking mode: regenerate the reference of the fast path with
+ * the channel offsets, so the shifted channels are still compared in one pass
+ * over the frames (the cost doesn't depend on the number of shifted channels).
+ * Non interleaved rows are simply compared from another position (see fast_valid_channels()).
+ */
+static void seq_skew_table_build( struct seq_info *seq ) {
+    unsigned char frame[SEQ_MAX_CHANNELS * 4];
+    unsigned i, ch;
+
+    if (seq->interleaved && !seq->skew_table) {
+        seq->skew_table = malloc( 2 * seq->table_frames * seq->frame_bytes );
+        if (!seq->skew_table) {
+            err("seq: can't allocate the channel offsets table. fast path disabled");
+            seq->check_fast = 0;
+            return;
+        }
+    }
+
+    seq->check_fast = 1;
+    for (i = 0; i < 2 * seq->table_frames; i++) {
+        for (ch = 0; ch < seq->channels; ch++)
+            seq->put( frame + ch * seq->sample_bytes,
+                    seq_pattern_value( seq, seq_table_pattern( seq, ch, i - seq->ch_offset[ch] ) ) );
+        if (is_null_frame( frame, seq->frame_bytes ))
+            seq->check_fast = 0;
+        if (seq->interleaved)
+            memcpy( (unsigned char *)seq->skew_table + i * seq->frame_bytes, frame, seq->frame_bytes );
+    }
+    if (seq->interleaved)
+        seq->check_table = seq->skew_table;
+}
+
+
+/*
+ * per channel tracking mode: update the channel offsets with the frame numbers
+ * of a valid frame. A shifted channel is reported once when the offsets are
+ * first measured, then only when its offset changes.
+ * return the number of errors
+ */
+static int seq_track_channels( struct seq_info *seq, const unsigned *frame_seq ) {
+    int cycle = seq->table_frames;
+    int changed = 0;
     int errors = 0;
+    unsigned ch;
+
+    for (ch = 1; ch < seq->channels; ch++) {
+        int offset = (frame_seq[0] - frame_seq[ch]) & seq->frame_num_mask;
+        if (offset >= cycle / 2)
+            offset -= cycle;
 
-    while (frame_count--) {
-        /* what kind of frame is it */
-        enum seq_stat_e next_state;
-        if (is_null_frame( s16, frame_byte_size )) {
-            next_state = NULL_FRAME;
+        if (offset == seq->ch_offset[ch])
+            continue;
+        if (seq->ch_locked) {
+            err("channel %u offset changed: %d -> %d frames", ch, seq->ch_offset[ch], offset);
+            seq->ch_drifts[ch]++;
         } else {
-            int ch;
-            const int16_t *s = s16;
-            /* check samples one by one */
-            next_state = VALID_FRAME;
-            current_frame_seq = (*s16 >> FRAME_NUM_SHIFT) & FRAME_NUM_MASK;
-            for (ch=0; ch < seq->channels; ch++) {
-                if (((*s & CHANNEL_MASK) != ch) || (current_frame_seq != ((*s >> FRAME_NUM_SHIFT) & FRAME_NUM_MASK))) {
-                    next_state = INVALID_FRAME;
-                    break;
+            err("channel %u lags channel 0 by %d frames", ch, offset);
+        }
+        seq->ch_offset[ch] = offset;
+        changed = 1;
+        errors++;
+    }
+    seq->ch_locked = 1;
+
+    if (changed)
+        seq_skew_table_build( seq );
+    seq->error_count += errors;
+    seq_errors_total += errors;
+    return errors;
+}
+
+
+/*
+ * per channel tracking mode classification: each channel holds its own frame number.
+ * *frame_seq is the frame number of channel 0
+ */
+static enum seq_stat_e classify_channels( struct seq_info *seq, const unsigned char *frame,
+        unsigned *frame_seq, int *errors ) {
+    unsigned channel_seq[SEQ_MAX_CHANNELS];
+    uint32_t value, pattern;
+    unsigned ch;
+
+    if (is_null_frame( frame, seq->frame_bytes ))
+        return NULL_FRAME;
+
+    for (ch = 0; ch < seq->channels; ch++) {
+        if (!seq->get( frame + ch * seq->sample_bytes, &value ) ||
+            (value & seq->value_lsb_mask))
+            return INVALID_FRAME;
+        pattern = seq_value_pattern( seq, value );
+        if ((pattern & seq->channel_mask) != ch)
+            return INVALID_FRAME;
+        channel_seq[ch] = pattern >> seq->channel_bits;
+    }
+    *frame_seq = channel_seq[0];
+    *errors += seq_track_channels( seq, channel_seq );
+    return VALID_FRAME;
+}
+
+
+void seq_channels_print( const struct seq_info *seq, const char *prefix ) {
+    unsigned ch, shifted = 0, drifted = 0;
+
+    if (!seq->channel_tracking)
+        return;
+    if (!seq->ch_locked) {
+        printf("%s: channel offsets: not measured\n", prefix);
+        return;
+    }
+    for (ch = 1; ch < seq->channels; ch++) {
+        if (seq->ch_offset[ch]) shifted++;
+        if (seq->ch_drifts[ch]) drifted++;
+    }
+    printf("%s: channel offsets relative to channel 0: %u shifted, %u drifted\n", prefix, shifted, drifted);
+    for (ch = 1; ch < seq->channels; ch++) {
+        if (seq->ch_offset[ch] || seq->ch_drifts[ch])
+            printf("%s:   channel %u: %+d frames, %u changes\n", prefix, ch, seq->ch_offset[ch], seq->ch_drifts[ch]);
+    }
+}
+
+/*
+ * true if the current burst of invalid frames is not counted as an error: a few invalid
+ * frames after valid ones, ie. the stream stopped on the remote side
+ */
+static inline int invalid_frames_benign( const struct seq_info *seq ) {
+    return (seq->prev_state == VALID_FRAME) &&
+        (seq->frame_num <= seq_max_consecutive_invalid_frames_before_null_warning);
+}
+
+/*
+ * run the state machine with the next frame
+ * return 1 if an error is detected, 0 otherwise
+ */
+static int check_frame( struct seq_info *seq, const unsigned char *frame ) {
+    unsigned current_frame_seq = 0;
+    int errors = 0;
+    int long_bit = 0;
+    enum seq_stat_e next_state;
+
+    /* what kind of frame is it */
+    if (seq->channel_tracking)
+        next_state = classify_channels( seq, frame, &current_frame_seq, &errors );
+    else
+        next_state = seq->classify( seq, frame, &current_frame_seq );
+
+    /* the long sequence bit is above the frame number */
+    long_bit = current_frame_seq >> seq->frame_num_bits;
+    current_frame_seq &= seq->frame_num_mask;
+
+    if (seq->state == next_state) {
+        switch (seq->state) {
+        case NULL_FRAME:
+            /* simply increase the record count of those frames */
+            seq->frame_num++;
+            break;
+
+        case INVALID_FRAME:
+            /* simply increase the record count of those frames */
+            seq->frame_num++;
+            seq_event_burst_frame( seq, frame );
+            if ((seq->frame_num <= seq_max_consecutive_invalid_frames_before_null_warning) && (seq->prev_state == VALID_FRAME)) {
+                log_frame( LOG_WARN, seq, frame );
+            } else {
+                if (seq->frame_num <= (seq_consecutive_invalid_frames_log+1)) {
+                    log_frame( LOG_ERR, seq, frame );
                 }
-                s++;
+                errors++;
+                seq->error_count++;
+                seq_errors_total++;
             }
+            break;
+        case VALID_FRAME:
+            /* check the frame sequence to see if there is no jump */
+            if (seq->frame_num != current_frame_seq) {
+                err("frame 0x%04x received instead of 0x%04x", current_frame_seq, seq->frame_num);
+                seq_event_jump( seq, seq->frame_num, current_frame_seq );
+                seq_position_resync( seq, current_frame_seq, 1 );
+                errors++;
+                seq->error_count++;
+                seq_errors_total++;
+            }
+            errors += seq_position_advance( seq, 1, long_bit );
+            seq->frame_num = (current_frame_seq + 1) & seq->frame_num_mask;
+            break;
         }
+    } else {
+        switch (next_state) {
+        case INVALID_FRAME:
+            if (seq->state == VALID_FRAME) {
+                /* this may not be an error if the stream is stopped on remote side
+                 * in this case we should receive only a short number of invalid frames
+                 * followed by some null frames
+                 */
+                warn("first invalid frame while expecting frame 0x%04x", seq->frame_num);
+                log_frame( LOG_WARN, seq, frame );
+            } else {
+                err("invalid frame after %u null frames", seq->frame_num);
+                log_frame( LOG_ERR, seq, frame );
+                errors++;
+                seq->error_count++;
+                seq_errors_total++;
+            }
+            seq_event_burst_start( seq, seq->state == VALID_FRAME, seq->frame_num );
+            seq_event_burst_frame( seq, frame );
+            seq->frame_num = 1;
+            break;
 
-        if (seq->state == next_state) {
-            switch (seq->state) {
-            case NULL_FRAME:
-                /* simply increase the record count of those frames */
-                seq->frame_num++;
-                break;
-
-            case INVALID_FRAME:
-                /* simply increase the record count of those frames */
-                seq->frame_num++;
-                if ((seq->frame_num <= seq_max_consecutive_invalid_frames_before_null_warning) && (seq->prev_state == VALID_FRAME)) {
-                    log_frame( LOG_WARN, seq, s16 );
-                } else {
-                    if (seq->frame_num <= (seq_consecutive_invalid_frames_log+1)) {
-                        log_frame( LOG_ERR, seq, s16 );
-                    }
+        case NULL_FRAME:
+            if (seq->state == VALID_FRAME) {
+                warn("Null frame (%02X) while expecting frame 0x%04x", frame[0], seq->frame_num);
+            } else {
+                seq_event_burst_end( seq, 0, 0, invalid_frames_benign( seq ) );
+                if (seq->frame_num > seq_max_consecutive_invalid_frames_before_null_warning) {
+                    err("Null frame (%02X) after %u invalid frames", frame[0], seq->frame_num);
                     errors++;
                     seq->error_count++;
                     seq_errors_total++;
-                }
-                break;
-            case VALID_FRAME:
-                /* check the frame sequence to see if there is no jump */
-                if (seq->frame_num != current_frame_seq) {
-                    err("frame 0x%04x received instead of 0x%04x", current_frame_seq, seq->frame_num);
-                    errors++;
-                    seq->error_count++;
-                    seq_errors_total++;
-                }
-                seq->frame_num = (current_frame_seq + 1) & FRAME_NUM_MASK;
-                break;
-            }
-        } else {
-            switch (next_state) {
-            case INVALID_FRAME:
-                if (seq->state == VALID_FRAME) {
-                    /* this may not be an error if the stream is stopped on remote side
-                     * in this case we should receive only a short number of invalid frames
-                     * followed by some null frames
-                     */
-                    warn("first invalid frame while expecting frame 0x%04x", seq->frame_num);
-                    log_frame( LOG_WARN, seq, s16 );
                 } else {
-                    err("invalid frame after %u null frames", seq->frame_num);
-                    log_frame( LOG_ERR, seq, s16 );
-                    errors++;
-                    seq->error_count++;
-                    seq_errors_total++;
+                    warn("Null frame (%02X) after %u invalid frames", frame[0], seq->frame_num);
                 }
-                seq->frame_num = 1;
-                break;
+            }
+            seq->frame_num = 1;
+            break;
 
-            case NULL_FRAME:
-                if (seq->state == VALID_FRAME) {
-                    warn("Null frame (%02X) while expecting frame 0x%04x", (*s16 & 0xFF), seq->frame_num);
-                } else {
-                    if (seq->frame_num > seq_max_consecutive_invalid_frames_before_null_warning) {
-                        err("Null frame (%02X) after %u invalid frames", (*s16 & 0xFF), seq->frame_num);
-                        errors++;
-                        seq->error_count++;
-                        seq_errors_total++;
-                    } else {
-                        warn("Null frame (%02X) after %u invalid frames", (*s16 & 0xFF), seq->frame_num);
-                    }
-                }
-                seq->frame_num = 1;
-                break;
-
-            case VALID_FRAME:
-                if (seq->state == NULL_FRAME) {
-                    if (seq->frame_num > 0)
-                        warn("Valid frame after %u null frames", seq->frame_num);
-                    else
-                        warn("First valid frame");
-                } else {
-                    warn("Valid frame after %u invalid frames", seq->frame_num);
-                }
-                log_frame( LOG_WARN, seq, s16 );
-                seq->frame_num = (current_frame_seq + 1) & FRAME_NUM_MASK;
-                break;
+        case VALID_FRAME:
+            if (seq->state == NULL_FRAME) {
+                if (seq->frame_num > 0)
+                    warn("Valid frame after %u null frames", seq->frame_num);
+                else
+                    warn("First valid frame");
+            } else {
+                warn("Valid frame after %u invalid frames", seq->frame_num);
+                seq_event_burst_end( seq, 1, current_frame_seq, invalid_frames_benign( seq ) );
             }
-            seq->prev_state = seq->state;
-            seq->state = next_state;
+            log_frame( LOG_WARN, seq, frame );
+            seq_position_resync( seq, current_frame_seq, 0 );
+            errors += seq_position_advance( seq, 1, long_bit );
+            seq->frame_num = (current_frame_seq + 1) & seq->frame_num_mask;
+            break;
+        }
+        seq->prev_state = seq->state;
+        seq->state = next_state;
+    }
+    return errors;
+}
+
+
+int seq_check_frames( struct seq_info *seq, const void *buff, int frame_count ) {
+    const unsigned char *frame = (const unsigned char *)buff;
+    int errors = 0;
+
+    while (frame_count > 0) {
+#ifdef SEQ_VEC_BYTES
+        int n = seq_check_fast_path( seq, &frame, 0, frame_count, &errors );
+        if (n > 0) {
+            frame += n * seq->frame_bytes;
+            frame_count -= n;
+            continue;
+        }
+#endif
+        errors += check_frame( seq, frame );
+        frame += seq->frame_bytes;
+        frame_count--;
+    }
+    if (errors && seq_error_notify) seq_error_notify();
+    return errors;
+}
+
+
+int seq_check_channels( struct seq_info *seq, const void * const *bufs, int frame_count ) {
+    const unsigned char * const *chan = (const unsigned char * const *)bufs;
+    int pos = 0;
+    int errors = 0;
+
+    while (pos < frame_count) {
+        unsigned ch;
+#ifdef SEQ_VEC_BYTES
+        int n = seq_check_fast_path( seq, chan, pos, frame_count - pos, &errors );
+        if (n > 0) {
+            pos += n;
+            continue;
         }
-        s16 += seq->channels;
+#endif
+        /* gather the samples of the frame, for the state machine */
+        for (ch = 0; ch < seq->channels; ch++)
+            memcpy( seq->frame_tmp + ch * seq->sample_bytes, chan[ch] + pos * seq->sample_bytes, seq->sample_bytes );
+        errors += check_frame( seq, seq->frame_tmp );
+        pos++;
     }
     if (errors && seq_error_notify) seq_error_notify();
     return errors;
@@ -12,8 +12,13 @@
 #ifndef __seq_h__
 #define __seq_h__
 
-/* total number of sequence errors detected among every sequence checkers */
-extern unsigned seq_errors_total;
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "seq_event.h"
+
+/* total number of sequence errors detected among every sequence checkers (and threads) */
+extern atomic_uint seq_errors_total;
 
 /* if not NULL, called when a new error is detected */
 extern void (*seq_error_notify)(void);
@@ -25,6 +30,30 @@ extern void (*seq_error_notify)(void);
  */
 extern unsigned seq_consecutive_invalid_frames_log;
 
+/*
+ * if not 0, the sequences initialized after are checked in per channel tracking
+ * mode: each channel is locked on its own frame number, and a channel shifted by
+ * N frames is reported once (with its offset relative to channel 0) instead of
+ * making every frame invalid.
+ */
+extern int seq_channel_tracking;
+
+/*
+ * if not 0, the sequences initialized after are long sequences: the frame number
+ * only cycles over 'table_frames' frames, so a drop of a multiple of this cycle is
+ * invisible. A long sequence carries a 64 bits frame position (see seq_init()),
+ * which is checked once per cycle.
+ * Both sides (play and capture) must use the same mode.
+ */
+extern int seq_long_position;
+
+
+/* maximum number of channels of a sequence */
+#define SEQ_MAX_CHANNELS  256
+
+/* frame number bits of the pattern, if the sample is wide enough (see seq_init()) */
+#define SEQ_FRAME_NUM_BITS 11
+
 
 enum seq_stat_e {
     NULL_FRAME = 0,
@@ -36,6 +65,7 @@ enum seq_stat_e {
 struct seq_info {
     unsigned channels;
     snd_pcm_format_t format;
+    int interleaved;
 
     /*
      * fill:
@@ -48,21 +78,172 @@ struct seq_info {
      */
     unsigned frame_num;
 
+    /*
+     * 64 bits frame position of the next frame (fill), or of the next expected frame
+     * (check, valid in VALID_FRAMES state). frame_num is the same modulo table_frames.
+     * check: the position is relative to the first valid frame, until it is locked on the
+     * position carried by a long sequence ('pos_locked'). 'pos_bits' gathers the position
+     * bits of the current cycle, while 'pos_bits_valid'.
+     */
+    uint64_t position;
+    int pos_locked;
+    uint64_t pos_bits;
+    int pos_bits_valid;
+
     enum seq_stat_e state;
     enum seq_stat_e prev_state;
     unsigned error_count;
+
+    /*
+     * the whole sequence pre-generated by seq_init(): the 'table_frames' frames
+     * of a full frame number cycle, followed by a copy of the same frames so that
+     * any run of up to 'table_frames' frames is contiguous in memory.
+     * In non interleaved mode, the table is made of one such row of samples per channel.
+     */
+    void *table;
+    unsigned table_frames;
+    unsigned sample_bytes;
+    unsigned frame_bytes;
+
+    /* frame classification kernel, specialized for the format and channel count */
+    enum seq_stat_e (*classify)( const struct seq_info *seq, const unsigned char *frame, unsigned *frame_seq );
+
+    /* true if the SIMD fast path of seq_check_frames() can compare frames with the table */
+    int check_fast;
+
+    /*
+     * pattern layout: the channel in the 'channel_bits' LSBs, then the frame number
+     * (modulo 'table_frames'), stored in the 'pattern_bits' MSBs of the samples.
+     */
+    unsigned pattern_bits;
+    unsigned channel_bits;
+    uint32_t channel_mask;
+    unsigned frame_num_bits;
+    uint32_t frame_num_mask;    /* table_frames - 1 */
+    /*
+     * long sequence: the pattern bit above the frame number ('long_flag') is set on the
+     * frame #0 of every cycle (cycle marker), and is the bit #N-1 of
+     * 'position >> frame_num_bits' for the frame #N, 0 < N <= 'long_bits'.
+     * It is zero for the other frames. long_bits is 0 if not a long sequence.
+     */
+    unsigned long_bits;
+    uint32_t long_flag;
+    uint32_t value_lsb_mask;    /* bits of a value below the pattern, always 0 */
+
+    /* the sample codec of the format, see seq_pattern_value() */
+    void (*put)( unsigned char *p, uint32_t value );
+    int (*get)( const unsigned char *p, uint32_t *value );
+
+    /*
+     * per channel tracking mode (see seq_channel_tracking)
+     *   ch_offset[ch]: number of frames channel 'ch' lags behind channel 0
+     *   ch_drifts[ch]: number of times this offset changed once measured
+     * The fast path compares the interleaved frames with 'check_table': the
+     * pre-generated table, or 'skew_table' (the same with the channel offsets applied)
+     */
+    int channel_tracking;
+    int ch_locked;
+    int ch_offset[SEQ_MAX_CHANNELS];
+    unsigned ch_drifts[SEQ_MAX_CHANNELS];
+    void *skew_table;
+    const void *check_table;
+
+    /* classification of the errors (check) */
+    struct seq_events events;
+
+    /* one frame, used to gather the samples of a non interleaved frame */
+    unsigned char frame_tmp[SEQ_MAX_CHANNELS * 4];
 };
 
 
-void seq_init( struct seq_info *seq, unsigned channels, snd_pcm_format_t format );
+/* the pattern of the sample of channel 'ch' in the frame #fn */
+static inline uint32_t seq_pattern( const struct seq_info *seq, unsigned ch, unsigned fn ) {
+    return (ch & seq->channel_mask) | ((fn & seq->frame_num_mask) << seq->channel_bits);
+}
+
+/* the pattern of the pre-generated table: the frame #0 of a long sequence cycle has the marker */
+static inline uint32_t seq_table_pattern( const struct seq_info *seq, unsigned ch, unsigned fn ) {
+    uint32_t pattern = seq_pattern( seq, ch, fn );
+    if (seq->long_bits && !(fn & seq->frame_num_mask))
+        pattern |= seq->long_flag;
+    return pattern;
+}
+
+/* long sequence: the long_flag bit of the frame at 'position' */
+static inline int seq_long_bit( const struct seq_info *seq, uint64_t position ) {
+    unsigned offset = position & seq->frame_num_mask;
+    if (!seq->long_bits)
+        return 0;
+    if (offset == 0)
+        return 1; /* cycle marker */
+    return (offset <= seq->long_bits) && (((position >> seq->frame_num_bits) >> (offset - 1)) & 1);
+}
+
+/* the pattern of the sample of channel 'ch' in the frame at 'position' */
+static inline uint32_t seq_position_pattern( const struct seq_info *seq, unsigned ch, uint64_t position ) {
+    uint32_t pattern = seq_pattern( seq, ch, position );
+    if (seq_long_bit( seq, position ))
+        pattern |= seq->long_flag;
+    return pattern;
+}
+
+/* pattern <-> value of a sample (see the sample codecs) */
+static inline uint32_t seq_pattern_value( const struct seq_info *seq, uint32_t pattern ) {
+    return pattern << (32 - seq->pattern_bits);
+}
+
+static inline uint32_t seq_value_pattern( const struct seq_info *seq, uint32_t value ) {
+    return (uint32_t)((uint64_t)value >> (32 - seq->pattern_bits));
+}
+
+
+/*
+ * supported formats are S16_LE, S24_LE, S32_LE, S24_3LE and FLOAT_LE
+ * return 1 if 'format' is one of them
+ */
+int seq_format_supported( snd_pcm_format_t format );
+
+/*
+ * seq_init() prepares the sequence for interleaved frames if 'interleaved' is not zero,
+ * or for non interleaved buffers (one contiguous array of samples per channel).
+ * It returns 0 on success, -1 if the format or channel count is not supported, or if the
+ * memory for the pre-generated sequence can't be allocated.
+ * seq_release() frees the resources allocated by seq_init()
+ */
+int seq_init( struct seq_info *seq, unsigned channels, snd_pcm_format_t format, int interleaved );
+void seq_release( struct seq_info *seq );
 void seq_reset( struct seq_info *seq );
 
 /*
- * each sample of the frame sequence #N has the expected value
- * (channel & 15) | (N << 4), with channel starting from zero for the first sample of the frame
+ * each sample of the frame sequence #N has the expected pattern
+ * channel | (N << channel_bits), with channel starting from zero for the first sample of the frame
+ * and N modulo table_frames.
+ *
+ * Up to 32 channels, the pattern is 16 bits wide, with 5 bits of channel and 11 bits of
+ * frame number. Above, channel_bits grows up to 8 (256 channels), and the pattern
+ * is widened to keep 11 bits of frame number, as far as the format allows: S16_LE keeps
+ * a 16 bits pattern (and a shorter frame number cycle), S24_LE, S24_3LE and FLOAT_LE
+ * go up to 24 bits, S32_LE up to 32 bits.
+ *
+ * The pattern is stored in the MSBs of the sample (the LSBs are zero). With FLOAT_LE,
+ * the sample is the pattern in the MSBs of a signed 32 bits value, divided by 2^31.
+ *
+ * A long sequence (seq_long_position) has one more pattern bit, above the frame number
+ * (or taken from the frame number if the format has no room for it): the frames
+ * at the start of each cycle carry the upper bits of the 64 bits frame position,
+ * one bit per frame, after a cycle marker. Those frames are not in the pre-generated table, so
+ * seq_frames_ptr() and seq_channels_ptr() are not available.
  *
  * seq_fill_frames() generates 'frame_count' frames with this expected sequence
  *
+ * seq_frames_ptr() is the zero copy flavor of seq_fill_frames(): it returns a pointer
+ *    on the next 'frame_count' frames of the sequence directly inside the pre-generated
+ *    table (valid until seq_release()). 'frame_count' must not exceed seq->table_frames.
+ *    Return NULL if this is not possible.
+ *
+ * seq_fill_rewind() gives back the last 'frame_count' generated frames, which will be
+ *    generated again by the next call (ie. frames which could not be written)
+ *
  * seq_check_frames() check the content of the received frames
  *    - frames filled with 0x00 or 0xFF are not consider as errors. only a warning is
  *      printed with the number of such frames detected.
@@ -71,12 +252,22 @@ void seq_reset( struct seq_info *seq );
  *
  *    - return 0 when no error is detected
  *      otherwise return 1
+ *
+ * seq_fill_frames(), seq_frames_ptr() and seq_check_frames() work on interleaved frames.
+ * seq_fill_channels(), seq_channels_ptr() and seq_check_channels() are the non interleaved
+ * flavors, where bufs[ch] is the array of samples of channel 'ch'.
  */
 
 
 void seq_fill_frames( struct seq_info *seq, void *buff, int frame_count );
+const void *seq_frames_ptr( struct seq_info *seq, int frame_count );
+void seq_fill_rewind( struct seq_info *seq, int frame_count );
 int seq_check_frames( struct seq_info *seq, const void *buff, int frame_count );
 
+void seq_fill_channels( struct seq_info *seq, void * const *bufs, int frame_count );
+int seq_channels_ptr( struct seq_info *seq, const void **bufs, int frame_count );
+int seq_check_channels( struct seq_info *seq, const void * const *bufs, int frame_count );
+
 /*
  * when a xrun or a stream start/stop is detected, we are sure to have a sequence number jump
  * and it should not be consider as an error.
@@ -85,5 +276,11 @@ int seq_check_frames( struct seq_info *seq, const void *buff, int frame_count );
  */
 void seq_check_jump_notify( struct seq_info *seq );
 
+/*
+ * per channel tracking mode: print the offset of every channel
+ * relative to channel 0, and how many channels drifted
+ */
+void seq_channels_print( const struct seq_info *seq, const char *prefix );
+
 
 #endif //__seq_h__
@@ -0,0 +1,339 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <alsa/asoundlib.h>
+
+#include "seq.h"
+#include "log.h"
+
+
+static const char * const seq_event_names[SEQ_EVENT_TYPES] = {
+    [SEQ_EVENT_DROPPED] = "dropped frames",
+    [SEQ_EVENT_REPEATED] = "repeated frames",
+    [SEQ_EVENT_CHANNEL_ROTATION] = "channel rotation",
+    [SEQ_EVENT_BYTE_SWAP] = "byte swap",
+    [SEQ_EVENT_WORD_SWAP] = "word swap",
+    [SEQ_EVENT_STUCK_BITS] = "stuck bits",
+    [SEQ_EVENT_TRUNCATION] = "truncation",
+    [SEQ_EVENT_CORRUPTED] = "corrupted frames",
+};
+
+
+static double events_now( void ) {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+void seq_events_init( struct seq_events *ev )
+{
+    memset( ev, 0, sizeof(*ev) );
+    ev->t0 = events_now();
+    ev->burst_type = -1;
+}
+
+
+void seq_events_release( struct seq_events *ev )
+{
+    free( ev->window );
+    ev->window = NULL;
+}
+
+
+static void seq_event_param( enum seq_event_type type, uint64_t param, char *s, size_t size )
+{
+    switch (type) {
+    case SEQ_EVENT_CHANNEL_ROTATION:
+        snprintf( s, size, "%llu slots", (unsigned long long)param );
+        break;
+    case SEQ_EVENT_TRUNCATION:
+        snprintf( s, size, "%llu LSBs", (unsigned long long)param );
+        break;
+    case SEQ_EVENT_STUCK_BITS:
+        snprintf( s, size, "bits 0x%x, at 1: 0x%x", (unsigned)param, (unsigned)(param >> 32) );
+        break;
+    default:
+        /* nothing more than the number of frames */
+        s[0] = '\0';
+        break;
+    }
+}
+
+
+static void seq_event_record( struct seq_events *ev, enum seq_event_type type, unsigned long long frames, uint64_t param )
+{
+    struct seq_event_stats *s = &ev->types[type];
+    double now = events_now() - ev->t0;
+    char p[48];
+
+    if (!s->count)
+        s->first_time = now;
+    s->count++;
+    s->frames += frames;
+    s->last_time = now;
+    s->param = param;
+
+    seq_event_param( type, param, p, sizeof(p) );
+    warn("event: %s, %llu frames%s%s", seq_event_names[type], frames, p[0] ? ", " : "", p);
+}
+
+
+void seq_event_jump( struct seq_info *seq, unsigned expected, unsigned received )
+{
+    int cycle = seq->table_frames;
+    int n = (received - expected) & seq->frame_num_mask;
+
+    if (n < cycle / 2)
+        seq_event_record( &seq->events, SEQ_EVENT_DROPPED, n, n );
+    else
+        seq_event_record( &seq->events, SEQ_EVENT_REPEATED, cycle - n, cycle - n );
+}
+
+
+void seq_event_position_jump( struct seq_info *seq, long long frames )
+{
+    if (frames > 0)
+        seq_event_record( &seq->events, SEQ_EVENT_DROPPED, frames, frames );
+    else
+        seq_event_record( &seq->events, SEQ_EVENT_REPEATED, -frames, -frames );
+}
+
+
+static uint32_t sample_raw( const unsigned char *p, unsigned bytes )
+{
+    uint32_t v = 0;
+    while (bytes--)
+        v = (v << 8) | p[bytes];
+    return v;
+}
+
+
+/*
+ * decode every sample of the frame.
+ * return 1 if the samples carry the same frame number, with the channels in order
+ * or rotated by the same number of slots (*rotation, 0 if in order)
+ */
+static int frame_decode( const struct seq_info *seq, const unsigned char *frame, unsigned *rotation )
+{
+    unsigned ch, frame_seq = 0, k = 0;
+    uint32_t value, pattern;
+
+    for (ch = 0; ch < seq->channels; ch++) {
+        unsigned id;
+        if (!seq->get( frame + ch * seq->sample_bytes, &value ) || (value & seq->value_lsb_mask))
+            return 0;
+        pattern = seq_value_pattern( seq, value );
+        id = pattern & seq->channel_mask;
+        if (id >= seq->channels)
+            return 0;
+        if (ch == 0) {
+            frame_seq = pattern >> seq->channel_bits;
+            k = id;
+        } else if (((pattern >> seq->channel_bits) != frame_seq) ||
+                (id != (ch + k) % seq->channels)) {
+            return 0;
+        }
+    }
+    *rotation = k;
+    return 1;
+}
+
+
+/* reverse the bytes of every sample */
+static void frame_byte_swap( const struct seq_info *seq, const unsigned char *frame, unsigned char *out )
+{
+    unsigned i, b;
+    for (i = 0; i < seq->frame_bytes; i += seq->sample_bytes) {
+        for (b = 0; b < seq->sample_bytes; b++)
+            out[i + b] = frame[i + seq->sample_bytes - 1 - b];
+    }
+}
+
+
+/* swap the 16 bits halves of every 32 bits sample */
+static void frame_word_swap( const struct seq_info *seq, const unsigned char *frame, unsigned char *out )
+{
+    unsigned i;
+    for (i = 0; i < seq->frame_bytes; i += 4) {
+        memcpy( out + i, frame + i + 2, 2 );
+        memcpy( out + i + 2, frame + i, 2 );
+    }
+}
+
+
+/*
+ * find the single explanation of every frame of the window.
+ * The bit level checks (truncation, stuck bits) need the expected frames.
+ */
+static enum seq_event_type burst_classify( struct seq_info *seq, uint64_t *param )
+{
+    struct seq_events *ev = &seq->events;
+    unsigned char tmp[SEQ_MAX_CHANNELS * 4];
+    int rotated = seq->channels > 1;
+    int byte_swap = seq->sample_bytes > 1;
+    int word_swap = seq->sample_bytes == 4;
+    uint32_t diff = 0, and_all = ~0u, or_all = 0;
+    unsigned i, ch, k, rotation = 0;
+
+    for (i = 0; i < ev->window_frames; i++) {
+        const unsigned char *frame = ev->window + i * seq->frame_bytes;
+
+        if (rotated) {
+            if (!frame_decode( seq, frame, &k ) || !k || (i && k != rotation))
+                rotated = 0;
+            rotation = k;
+        }
+        if (byte_swap) {
+            frame_byte_swap( seq, frame, tmp );
+            if (!frame_decode( seq, tmp, &k ) || k)
+                byte_swap = 0;
+        }
+        if (word_swap) {
+            frame_word_swap( seq, frame, tmp );
+            if (!frame_decode( seq, tmp, &k ) || k)
+                word_swap = 0;
+        }
+        if (ev->expected_known) {
+            for (ch = 0; ch < seq->channels; ch++) {
+                unsigned char *e = tmp + ch * seq->sample_bytes;
+                uint32_t r = sample_raw( frame + ch * seq->sample_bytes, seq->sample_bytes );
+                seq->put( e, seq_pattern_value( seq, ev->position_known ?
+                        seq_position_pattern( seq, ch, ev->expected_position + i ) :
+                        seq_table_pattern( seq, ch, ev->expected + i ) ) );
+                diff |= r ^ sample_raw( e, seq->sample_bytes );
+                and_all &= r;
+                or_all |= r;
+            }
+        }
+    }
+
+    if (rotated) {
+        *param = rotation;
+        return SEQ_EVENT_CHANNEL_ROTATION;
+    }
+    if (byte_swap)
+        return SEQ_EVENT_BYTE_SWAP;
+    if (word_swap)
+        return SEQ_EVENT_WORD_SWAP;
+
+    if (ev->expected_known && diff) {
+        uint32_t low = diff, stuck1, stuck0;
+
+        /* every bit below the highest wrong one */
+        low |= low >> 1;
+        low |= low >> 2;
+        low |= low >> 4;
+        low |= low >> 8;
+        low |= low >> 16;
+        if (!(or_all & low)) {
+            *param = __builtin_popcount( low );
+            return SEQ_EVENT_TRUNCATION;
+        }
+
+        stuck1 = diff & and_all;
+        stuck0 = diff & ~or_all;
+        if (!(diff & ~(stuck1 | stuck0))) {
+            *param = ((uint64_t)stuck1 << 32) | diff;
+            return SEQ_EVENT_STUCK_BITS;
+        }
+    }
+    return SEQ_EVENT_CORRUPTED;
+}
+
+
+void seq_event_burst_start( struct seq_info *seq, int expected_known, unsigned expected )
+{
+    struct seq_events *ev = &seq->events;
+
+    if (!ev->window) {
+        ev->window = malloc( SEQ_EVENT_WINDOW * seq->frame_bytes );
+        if (!ev->window)
+            return;
+    }
+    ev->burst = 1;
+    ev->burst_frames = 0;
+    ev->burst_type = -1;
+    ev->expected_known = expected_known;
+    ev->expected = expected;
+    ev->position_known = expected_known;
+    ev->expected_position = seq->position;
+    ev->window_frames = 0;
+}
+
+
+void seq_event_burst_frame( struct seq_info *seq, const unsigned char *frame )
+{
+    struct seq_events *ev = &seq->events;
+
+    if (!ev->burst)
+        return;
+    ev->burst_frames++;
+    if (ev->burst_type >= 0) {
+        /* already classified */
+        ev->types[ev->burst_type].frames++;
+        return;
+    }
+
+    memcpy( ev->window + ev->window_frames * seq->frame_bytes, frame, seq->frame_bytes );
+    if (++ev->window_frames == SEQ_EVENT_WINDOW) {
+        uint64_t param = 0;
+        ev->burst_type = burst_classify( seq, &param );
+        seq_event_record( ev, ev->burst_type, ev->burst_frames, param );
+    }
+}
+
+
+void seq_event_burst_end( struct seq_info *seq, int next_valid, unsigned next_frame_seq, int benign )
+{
+    struct seq_events *ev = &seq->events;
+
+    if (!ev->burst)
+        return;
+    ev->burst = 0;
+    if (ev->burst_type >= 0 || benign)
+        return;
+
+    /* the frames of the burst were expected just before the next valid one */
+    if (!ev->expected_known && next_valid) {
+        ev->expected_known = 1;
+        ev->expected = next_frame_seq - ev->burst_frames;
+    }
+    uint64_t param = 0;
+    enum seq_event_type type = burst_classify( seq, &param );
+    seq_event_record( ev, type, ev->burst_frames, param );
+}
+
+
+void seq_event_burst_abort( struct seq_info *seq )
+{
+    seq->events.burst = 0;
+}
+
+
+void seq_events_print( const struct seq_events *ev, const char *prefix )
+{
+    unsigned i;
+
+    for (i = 0; i < SEQ_EVENT_TYPES; i++) {
+        const struct seq_event_stats *s = &ev->types[i];
+        char p[48];
+
+        if (!s->count)
+            continue;
+        seq_event_param( i, s->param, p, sizeof(p) );
+        printf("%s: %s: %u events, %llu frames, first at %.3f s, last at %.3f s%s%s\n",
+                prefix, seq_event_names[i], s->count, s->frames, s->first_time, s->last_time,
+                p[0] ? ", last: " : "", p);
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef __seq_event_h__
+#define __seq_event_h__
+
+#include <stdint.h>
+
+/*
+ * Classification of the sequence errors into typed events.
+ *
+ * The sequence checker reports the frame number jumps, and gives the frames of
+ * every burst of invalid frames. The first SEQ_EVENT_WINDOW frames of the burst
+ * are buffered, and classified once (window full or end of the burst).
+ * This only runs on the slow path of the checker: a healthy stream pays nothing.
+ */
+#define SEQ_EVENT_WINDOW 32     /* frames */
+
+enum seq_event_type {
+    SEQ_EVENT_DROPPED = 0,      /* frame number jump forward: N frames missing */
+    SEQ_EVENT_REPEATED,         /* frame number jump backward: N frames received again (stale DMA buffer) */
+    SEQ_EVENT_CHANNEL_ROTATION, /* the samples of every frame rotated by k slots */
+    SEQ_EVENT_BYTE_SWAP,        /* samples with the wrong endianness */
+    SEQ_EVENT_WORD_SWAP,        /* 32 bits samples with their 16 bits halves swapped */
+    SEQ_EVENT_STUCK_BITS,       /* the same bits always at 0 or at 1 */
+    SEQ_EVENT_TRUNCATION,       /* the N LSBs of the samples cleared */
+    SEQ_EVENT_CORRUPTED,        /* none of the above */
+    SEQ_EVENT_TYPES
+};
+
+struct seq_event_stats {
+    unsigned count;             /* events */
+    unsigned long long frames;  /* frames involved in those events */
+    double first_time;          /* seconds since seq_events_init() */
+    double last_time;
+    uint64_t param;             /* of the last event: frames, slots, bit mask... */
+};
+
+struct seq_events {
+    double t0;
+    struct seq_event_stats types[SEQ_EVENT_TYPES];
+
+    /* the burst of invalid frames in progress */
+    int burst;
+    unsigned burst_frames;
+    int burst_type;             /* -1 while not classified */
+    int expected_known;         /* frame number expected for the first frame of the burst */
+    unsigned expected;
+    int position_known;         /* and its 64 bits position (long sequence) */
+    uint64_t expected_position;
+    unsigned char *window;      /* first SEQ_EVENT_WINDOW frames of the burst */
+    unsigned window_frames;
+};
+
+struct seq_info;
+
+void seq_events_init( struct seq_events *ev );
+void seq_events_release( struct seq_events *ev );
+
+/* frame number 'received' instead of 'expected', in the middle of valid frames */
+void seq_event_jump( struct seq_info *seq, unsigned expected, unsigned received );
+
+/* long sequence: the position moved by 'frames' (a multiple of the frame number cycle) */
+void seq_event_position_jump( struct seq_info *seq, long long frames );
+
+/*
+ * burst of invalid frames:
+ * seq_event_burst_frame() is called for every invalid frame, after
+ * seq_event_burst_start() for the first one (with the expected frame number if known).
+ * seq_event_burst_end() is called on the next valid (next_valid is true, next_frame_seq
+ * being its frame number) or null frame. A burst marked 'benign' is not recorded.
+ * seq_event_burst_abort() forgets the current burst (expected sequence break)
+ */
+void seq_event_burst_start( struct seq_info *seq, int expected_known, unsigned expected );
+void seq_event_burst_frame( struct seq_info *seq, const unsigned char *frame );
+void seq_event_burst_end( struct seq_info *seq, int next_valid, unsigned next_frame_seq, int benign );
+void seq_event_burst_abort( struct seq_info *seq );
+
+/* print the summary of every type of event */
+void seq_events_print( const struct seq_events *ev, const char *prefix );
+
+#endif //__seq_event_h__
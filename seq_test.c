@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+/*
+ * 'make check': the sequence generator and checker, without any hardware.
+ * Every supported format, channel count class, buffer layout and sequence mode
+ * is filled then checked back, and a drop, a repeat and a channel slip are
+ * injected to verify what the checker reports.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <alsa/asoundlib.h>
+
+#include "seq.h"
+#include "log.h"
+
+
+#define CHECK_PERIOD 97    /* frames per seq_check_*() call, not aligned on the cycle */
+
+#define DROP_FRAMES   7
+#define REPEAT_FRAMES 5
+#define SLIP_FRAMES   3
+
+static const snd_pcm_format_t formats[] = {
+    SND_PCM_FORMAT_S16_LE,
+    SND_PCM_FORMAT_S24_LE,
+    SND_PCM_FORMAT_S32_LE,
+    SND_PCM_FORMAT_S24_3LE,
+    SND_PCM_FORMAT_FLOAT_LE,
+};
+
+static const unsigned channels_list[] = { 1, 2, 32, 33, 256 };
+
+static unsigned failures;
+
+
+/*
+ * the frames received by the checker: interleaved, or one row of 'capacity'
+ * samples per channel
+ */
+struct stream {
+    struct seq_info *seq;
+    unsigned char *buff;
+    unsigned capacity;
+    unsigned frames;
+};
+
+
+static unsigned char *stream_sample( struct stream *st, unsigned frame, unsigned ch ) {
+    const struct seq_info *seq = st->seq;
+    if (seq->interleaved)
+        return st->buff + frame * seq->frame_bytes + ch * seq->sample_bytes;
+    return st->buff + (ch * st->capacity + frame) * seq->sample_bytes;
+}
+
+
+/* append the next 'n' frames generated by 'gen' */
+static void stream_fill( struct stream *st, struct seq_info *gen, unsigned n ) {
+    void *bufs[SEQ_MAX_CHANNELS];
+    unsigned ch;
+
+    if (gen->interleaved) {
+        seq_fill_frames( gen, stream_sample( st, st->frames, 0 ), n );
+    } else {
+        for (ch = 0; ch < gen->channels; ch++)
+            bufs[ch] = stream_sample( st, st->frames, ch );
+        seq_fill_channels( gen, bufs, n );
+    }
+    st->frames += n;
+}
+
+
+/* check every frame of the stream, one period at a time. return the number of errors */
+static int stream_check( struct stream *st, struct seq_info *chk ) {
+    const void *bufs[SEQ_MAX_CHANNELS];
+    unsigned i, n, ch;
+    int errors = 0;
+
+    for (i = 0; i < st->frames; i += n) {
+        n = st->frames - i < CHECK_PERIOD ? st->frames - i : CHECK_PERIOD;
+        if (chk->interleaved) {
+            errors += seq_check_frames( chk, stream_sample( st, i, 0 ), n );
+        } else {
+            for (ch = 0; ch < chk->channels; ch++)
+                bufs[ch] = stream_sample( st, i, ch );
+            errors += seq_check_channels( chk, bufs, n );
+        }
+    }
+    return errors;
+}
+
+
+struct test_case {
+    snd_pcm_format_t format;
+    unsigned channels;
+    int interleaved;
+    int long_position;
+    char name[64];
+};
+
+
+static void fail( const struct test_case *tc, const char *what ) {
+    printf("FAIL: %s: %s\n", tc->name, what);
+    failures++;
+}
+
+
+/* return 1 if 'type' is the only event type recorded, once, with 'param' */
+static int single_event( const struct seq_info *chk, enum seq_event_type type, uint64_t param ) {
+    int i;
+    for (i = 0; i < SEQ_EVENT_TYPES; i++) {
+        if (i != type && chk->events.types[i].count)
+            return 0;
+    }
+    return chk->events.types[type].count == 1 && chk->events.types[type].param == param;
+}
+
+
+/*
+ * 'scenario': 0 clean, 1 drop, 2 repeat, 3 channel slip
+ */
+static void run_scenario( const struct test_case *tc, int scenario ) {
+    struct seq_info gen, chk;
+    struct stream st;
+    unsigned cycle, before, ch;
+    int errors;
+
+    seq_long_position = tc->long_position;
+    seq_channel_tracking = scenario == 3;
+    if (seq_init( &gen, tc->channels, tc->format, tc->interleaved ) ||
+        seq_init( &chk, tc->channels, tc->format, tc->interleaved )) {
+        fail( tc, "seq_init failed" );
+        return;
+    }
+
+    /*
+     * the injection lands after two full cycles (the long sequence position is locked),
+     * away from the start of the cycle (the long sequence position bits)
+     */
+    cycle = gen.table_frames;
+    before = 2 * cycle + cycle * 3 / 4;
+
+    memset( &st, 0, sizeof(st) );
+    st.seq = &gen;
+    st.capacity = before + 2 * cycle + DROP_FRAMES;
+    st.buff = malloc( st.capacity * gen.frame_bytes );
+    if (!st.buff) {
+        fail( tc, "can't allocate the frames" );
+        goto out;
+    }
+
+    stream_fill( &st, &gen, before );
+    switch (scenario) {
+    case 1:
+        /* the next frames are overwritten: lost */
+        stream_fill( &st, &gen, DROP_FRAMES );
+        st.frames -= DROP_FRAMES;
+        break;
+    case 2:
+        /* the last frames are generated again: received twice */
+        seq_fill_rewind( &gen, REPEAT_FRAMES );
+        break;
+    }
+    stream_fill( &st, &gen, 2 * cycle );
+    if (scenario == 3) {
+        /* the last channel lags behind the others from 'before' */
+        unsigned i;
+        ch = tc->channels - 1;
+        for (i = st.frames - 1; i >= before; i--)
+            memcpy( stream_sample( &st, i, ch ), stream_sample( &st, i - SLIP_FRAMES, ch ), gen.sample_bytes );
+    }
+
+    errors = stream_check( &st, &chk );
+
+    switch (scenario) {
+    case 0:
+        if (errors || chk.error_count)
+            fail( tc, "errors on a clean sequence" );
+        break;
+    case 1:
+        if (!single_event( &chk, SEQ_EVENT_DROPPED, DROP_FRAMES ))
+            fail( tc, "drop not reported as a single 7 frames drop" );
+        break;
+    case 2:
+        if (!single_event( &chk, SEQ_EVENT_REPEATED, REPEAT_FRAMES ))
+            fail( tc, "repeat not reported as a single 5 frames repeat" );
+        break;
+    case 3:
+        for (ch = 1; ch < tc->channels - 1; ch++) {
+            if (chk.ch_offset[ch] || chk.ch_drifts[ch])
+                break;
+        }
+        if (ch < tc->channels - 1)
+            fail( tc, "channel slip reported on an untouched channel" );
+        else if (chk.ch_offset[ch] != SLIP_FRAMES || chk.ch_drifts[ch] != 1)
+            fail( tc, "channel slip not reported as a single 3 frames lag" );
+        break;
+    }
+
+out:
+    free( st.buff );
+    seq_release( &gen );
+    seq_release( &chk );
+}
+
+
+int main( int argc, char *argv[] )
+{
+    struct test_case tc;
+    unsigned f, c, count = 0;
+
+    /* the injected errors are expected: only keep a few of their messages */
+    log_rate_limit = 10;
+
+    for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+        for (c = 0; c < sizeof(channels_list) / sizeof(channels_list[0]); c++) {
+            for (tc.interleaved = 1; tc.interleaved >= 0; tc.interleaved--) {
+                for (tc.long_position = 0; tc.long_position <= 1; tc.long_position++) {
+                    int scenario;
+
+                    tc.format = formats[f];
+                    tc.channels = channels_list[c];
+                    snprintf( tc.name, sizeof(tc.name), "%s, %u channels, %s, %s sequence",
+                            snd_pcm_format_name( tc.format ), tc.channels,
+                            tc.interleaved ? "interleaved" : "non interleaved",
+                            tc.long_position ? "long" : "short" );
+
+                    for (scenario = 0; scenario <= 3; scenario++) {
+                        /* no slip with a single channel */
+                        if (scenario == 3 && tc.channels == 1)
+                            continue;
+                        run_scenario( &tc, scenario );
+                        count++;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%u scenarios, %u failed\n", count, failures);
+    return failures ? 1 : 0;
+}
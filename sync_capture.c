@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "sync_capture.h"
+#include "io.h"
+#include "log.h"
+
+
+/*
+ * start every stream. Linked streams are started at once.
+ */
+static int sync_capture_run( struct test_sync_capture *tp ) {
+    unsigned i;
+    int r;
+
+    for (i = 0; i < tp->streams_count; i++) {
+        struct sync_capture_stream *s = &tp->streams[i];
+        if (tp->linked && i > 0)
+            continue;
+        r = snd_pcm_start( s->pcm );
+        if (r < 0) {
+            err("%s: capture start failed: %s", s->device, snd_strerror(r));
+            return -1;
+        }
+    }
+    for (i = 0; i < tp->streams_count; i++)
+        ev_io_start( tp->t.loop, &tp->streams[i].io_watcher );
+    return 0;
+}
+
+
+/*
+ * a stream failed: restart every stream, so they keep the same start time,
+ * and measure the skews again.
+ */
+static int sync_capture_restart( struct test_sync_capture *tp ) {
+    unsigned i;
+
+    tp->restarts++;
+    for (i = 0; i < tp->streams_count; i++) {
+        struct sync_capture_stream *s = &tp->streams[i];
+        ev_io_stop( tp->t.loop, &s->io_watcher );
+        snd_pcm_drop( s->pcm );
+    }
+    for (i = 0; i < tp->streams_count; i++) {
+        struct sync_capture_stream *s = &tp->streams[i];
+        snd_pcm_prepare( s->pcm );
+        seq_check_jump_notify( &s->seq );
+        stream_stats_break( &s->stats );
+        s->captured_frames = 0;
+        s->aligned = 0;
+        s->skew_valid = 0;
+    }
+    return sync_capture_run( tp );
+}
+
+
+/*
+ * update the alignment of the stream with the period just read,
+ * and its skew with the first stream
+ */
+static void sync_capture_track( struct test_sync_capture *tp, struct sync_capture_stream *s ) {
+    struct sync_capture_stream *ref = &tp->streams[0];
+    unsigned cycle = s->seq.table_frames;
+    int skew;
+
+    s->aligned = s->seq.state == VALID_FRAME;
+    if (!s->aligned)
+        return;
+    s->offset = (s->captured_frames - s->seq.frame_num) % cycle;
+
+    if (s == ref || !ref->aligned)
+        return;
+
+    skew = (s->offset + cycle - ref->offset) % cycle;
+    if (skew >= (int)cycle / 2)
+        skew -= cycle;
+
+    if (!s->skew_valid) {
+        if (!s->skew_periods) {
+            warn("%s: skew with %s: %d frames", s->device, ref->device, skew);
+            s->first_skew = skew;
+            s->min_skew = s->max_skew = skew;
+        } else if (skew != s->first_skew) {
+            warn("%s: [%.3f s] skew with %s after restart: %d frames (%d at first)", s->device,
+                    ev_now( tp->t.loop ) - tp->start_time, ref->device, skew, s->first_skew);
+            s->restart_changes++;
+        }
+        s->skew_valid = 1;
+        s->skew = skew;
+    } else if (skew != s->skew) {
+        warn("%s: [%.3f s] skew with %s changed: %d -> %d frames", s->device,
+                ev_now( tp->t.loop ) - tp->start_time, ref->device, s->skew, skew);
+        s->skew_changes++;
+        s->skew = skew;
+    } else {
+        s->skew_periods++;
+        return;
+    }
+
+    if (tp->opts.assert_skew && abs(skew) > tp->opts.max_skew) {
+        err("assert: %s skew %d exceeds %d frames", s->device, skew, tp->opts.max_skew);
+        tp->skew_errors++;
+    }
+    if (skew < s->min_skew) s->min_skew = skew;
+    if (skew > s->max_skew) s->max_skew = skew;
+    s->skew_periods++;
+}
+
+
+static void sync_capture_io_job( struct ev_loop *loop, struct ev_io *w, int revents ) {
+    struct sync_capture_stream *s = (struct sync_capture_stream *)(w->data);
+    struct test_sync_capture *tp = s->tp;
+    snd_pcm_sframes_t frames;
+
+    stream_stats_wakeup( &s->stats, s->pcm );
+
+    frames = io_read_seq_avail( s->pcm, &s->config, &s->seq, s->periof_buff, s->config.period );
+    stream_stats_transfer( &s->stats, frames );
+    if (frames < 0) {
+        warn("%s: capture read failed: %s", s->device, snd_strerror(frames));
+        if (frames == -EBADFD) {
+            err("unrecoverable alsa error");
+            ev_unloop(loop, EVUNLOOP_ALL);
+            return;
+        }
+        if (sync_capture_restart( tp ) < 0)
+            ev_unloop(loop, EVUNLOOP_ALL);
+        return;
+    }
+    s->captured_frames += frames;
+    sync_capture_track( tp, s );
+    stream_stats_done( &s->stats );
+}
+
+
+static int sync_capture_start(struct test *t) {
+    struct test_sync_capture *tp = (struct test_sync_capture *)t;
+    dbg("%s: sync_capture_start", tp->t.device);
+
+    tp->start_time = ev_now( tp->t.loop );
+    return sync_capture_run( tp );
+}
+
+
+static void sync_capture_report(struct test *t) {
+    struct test_sync_capture *tp = (struct test_sync_capture *)t;
+    struct sync_capture_stream *ref = &tp->streams[0];
+    unsigned i;
+
+    for (i = 0; i < tp->streams_count; i++) {
+        stream_stats_print( &tp->streams[i].stats );
+        seq_channels_print( &tp->streams[i].seq, tp->streams[i].stats.name );
+        seq_events_print( &tp->streams[i].seq.events, tp->streams[i].stats.name );
+    }
+
+    printf("%s: %u streams, %s, %u restarts\n", tp->t.device, tp->streams_count,
+            tp->linked ? "linked" : "not linked", tp->restarts);
+    for (i = 1; i < tp->streams_count; i++) {
+        struct sync_capture_stream *s = &tp->streams[i];
+        if (!s->skew_periods) {
+            printf("%s: skew with %s: not measured\n", s->device, ref->device);
+            continue;
+        }
+        printf("%s: skew with %s: %d frames, min %d max %d, %u changes over %u periods, %u restarts with another skew\n",
+                s->device, ref->device, s->first_skew, s->min_skew, s->max_skew,
+                s->skew_changes, s->skew_periods, s->restart_changes);
+    }
+}
+
+
+static void sync_capture_stream_release( struct sync_capture_stream *s ) {
+    if (s->pcm) snd_pcm_close( s->pcm );
+    stream_stats_release( &s->stats );
+    seq_release( &s->seq );
+    free( s->periof_buff );
+}
+
+
+static int sync_capture_close(struct test *t) {
+    struct test_sync_capture *tp = (struct test_sync_capture *)t;
+    int exit_status = tp->skew_errors != 0;
+    unsigned i;
+
+    for (i = 0; i < tp->streams_count; i++)
+        ev_io_stop( tp->t.loop, &tp->streams[i].io_watcher );
+    for (i = 0; i < tp->streams_count; i++)
+        sync_capture_stream_release( &tp->streams[i] );
+    free( tp );
+    return exit_status;
+}
+
+
+
+const struct test_ops sync_capture_ops = {
+        .start = sync_capture_start,
+        .close = sync_capture_close,
+        .report = sync_capture_report,
+};
+
+
+/*
+ * open and setup one of the captured PCMs
+ */
+static int sync_capture_stream_open( struct test_sync_capture *tp, struct sync_capture_stream *s, const char *device ) {
+    char name[96];
+    int r;
+
+    s->tp = tp;
+    snprintf( s->device, sizeof(s->device), "%s", device );
+    s->config = tp->t.config;
+    if (s->config.timer_sched) {
+        warn("%s: timer scheduled mode not supported by sync_capture: using the period wake ups", s->device);
+        s->config.timer_sched = 0;
+    }
+
+    r = alsa_device_open( s->device, &s->config, &s->pcm, NULL );
+    if (r) {
+        s->pcm = NULL;
+        return -1;
+    }
+    if (s == &tp->streams[0]) {
+        /* the first stream may adjust the config: the others must follow */
+        tp->t.config = s->config;
+    } else if (s->config.rate != tp->t.config.rate || s->config.period != tp->t.config.period) {
+        err("%s: %u Hz / %u frames periods, while %s runs at %u Hz / %u frames periods", s->device,
+                s->config.rate, s->config.period, tp->streams[0].device,
+                tp->t.config.rate, tp->t.config.period);
+        return -1;
+    }
+
+    if (seq_init( &s->seq, s->config.channels, s->config.format,
+            alsa_access_is_interleaved( s->config.access ))) return -1;
+    s->periof_buff = malloc( snd_pcm_frames_to_bytes( s->pcm, s->config.period ));
+    if (!s->periof_buff) return -1;
+
+    r = snd_pcm_poll_descriptors_count(s->pcm);
+    if (r != 1) {
+        err("sync_capture_create: expect only 1 fd to monitor (snd_pcm_poll_descriptors_count)");
+        return -1;
+    }
+    r = snd_pcm_poll_descriptors(s->pcm, &s->pollfd, 1);
+    if (r < 0) {
+        err("%s: snd_pcm_poll_descriptors failed", s->device);
+        return -1;
+    }
+
+    ev_io_init( &s->io_watcher, sync_capture_io_job,
+            s->pollfd.fd,
+            ((s->pollfd.events & POLLIN) ? EV_READ : 0) |
+            ((s->pollfd.events & POLLOUT) ? EV_WRITE : 0)
+            );
+    s->io_watcher.data = s;
+
+    snprintf( name, sizeof(name), "%s sync capture", s->device );
+    return stream_stats_init( &s->stats, s->pcm, s->config.rate, name );
+}
+
+
+/*
+ * do a sync_capture test:
+ * - capture from several PCMs fed with the same sequence (ie. several ports
+ *   of a TDM bus, sharing the same clock)
+ * - check the sequence of every PCM, and measure the frame alignment of every
+ *   PCM against the first one
+ */
+struct test *sync_capture_create(struct alsa_config *config, struct sync_capture_create_opts *opts) {
+    struct test_sync_capture *tp = calloc( 1, sizeof(*tp));
+    unsigned i;
+    int r;
+
+    if (!tp) return NULL;
+
+    tp->t.name = "sync_capture";
+    memcpy( &tp->t.config, config, sizeof(*config));
+    memcpy( tp->t.device, config->device, sizeof(tp->t.device) );
+    tp->opts = *opts;
+
+    if (sync_capture_stream_open( tp, &tp->streams[0], tp->t.config.device ) < 0)
+        goto failed;
+    tp->streams_count = 1;
+    for (i = 0; i < tp->opts.devices_count; i++) {
+        if (sync_capture_stream_open( tp, &tp->streams[i+1], tp->opts.devices[i] ) < 0)
+            goto failed;
+        tp->streams_count++;
+    }
+
+    if (tp->opts.link) {
+        tp->linked = 1;
+        for (i = 1; i < tp->streams_count; i++) {
+            r = snd_pcm_link( tp->streams[0].pcm, tp->streams[i].pcm );
+            if (r) {
+                warn("%s: snd_pcm_link with %s failed: %s. starting the streams one after the other",
+                        tp->t.device, tp->streams[i].device, snd_strerror(r));
+                tp->linked = 0;
+                break;
+            }
+        }
+        if (!tp->linked) {
+            for (i = 1; i < tp->streams_count; i++)
+                snd_pcm_unlink( tp->streams[i].pcm );
+        }
+    }
+
+    tp->t.ops = &sync_capture_ops;
+
+    return &tp->t;
+
+failed:
+    /* including the stream which failed to open */
+    for (i = 0; i <= tp->streams_count && i < SYNC_CAPTURE_MAX_STREAMS; i++)
+        sync_capture_stream_release( &tp->streams[i] );
+    free(tp);
+    return NULL;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+
+#ifndef __sync_capture_h__
+#define __sync_capture_h__
+
+#include <poll.h>
+#include <ev.h>
+
+#include "test.h"
+#include "seq.h"
+#include "hist.h"
+
+/* maximum number of PCMs captured by one sync_capture test */
+#define SYNC_CAPTURE_MAX_STREAMS 8
+
+struct sync_capture_create_opts {
+    /* the other PCMs, captured with the test PCM */
+    char devices[SYNC_CAPTURE_MAX_STREAMS - 1][64];
+    unsigned devices_count;
+
+    int link;       /* start every PCM at once with snd_pcm_link() */
+
+    /*
+     * if assert_skew is not zero, a skew larger than max_skew frames
+     * (in absolute value) is considered as an error
+     */
+    int assert_skew;
+    int max_skew;
+};
+
+
+struct test_sync_capture;
+
+struct sync_capture_stream {
+    struct test_sync_capture *tp;
+    char device[64];
+    struct alsa_config config;
+
+    snd_pcm_t *pcm;
+    struct seq_info seq;
+    void *periof_buff;
+
+    struct pollfd pollfd;
+    struct ev_io io_watcher;
+    struct stream_stats stats;
+
+    /*
+     * alignment of the stream: 'captured_frames - seq.frame_num' (modulo the
+     * sequence cycle), valid while the sequence is received.
+     */
+    unsigned long long captured_frames; /* frames read since the (re)start */
+    int aligned;
+    unsigned offset;
+
+    /*
+     * skew with the first stream, in frames. Positive if this stream receives
+     * the same frame later than the first one.
+     */
+    int skew_valid;
+    int skew;
+    int first_skew;
+    int min_skew;
+    int max_skew;
+    unsigned skew_periods;
+    unsigned skew_changes;      /* while running */
+    unsigned restart_changes;   /* measured again after a restart, and different */
+};
+
+
+struct test_sync_capture {
+    struct test t;
+
+    struct sync_capture_stream streams[SYNC_CAPTURE_MAX_STREAMS];
+    unsigned streams_count;
+
+    int linked;             /* every stream is linked to the first one */
+    unsigned restarts;
+    unsigned skew_errors;   /* skew assertions failed */
+    ev_tstamp start_time;
+
+    struct sync_capture_create_opts opts;
+};
+
+struct test *sync_capture_create(struct alsa_config *config, struct sync_capture_create_opts *opts);
+
+#endif //__sync_capture_h__
@@ -12,15 +12,28 @@
 
 #include "alsa.h"
 
-extern struct ev_loop *loop; /* this is the event loop */
+extern struct ev_loop *loop; /* this is the main event loop */
 
 struct test;
 
 struct test_ops {
     int (*start)(struct test *t);
 
+    /*
+     * optional: stop the I/O and the helper threads of the test, once its loop is
+     * over, so the final report sees its last state
+     */
+    void (*stop)(struct test *t);
+
     /* stop and return the test exit status */
     int (*close)(struct test *t);
+
+    /*
+     * optional: print the test statistics.
+     * Called at exit after stop, and on demand from the thread running the
+     * test loop (see worker_report())
+     */
+    void (*report)(struct test *t);
 };
 
 /*
@@ -31,6 +44,9 @@ struct test {
     char device[64];
     struct alsa_config config;
 
+    /* the event loop running this test: the main loop, or a worker loop (see -j) */
+    struct ev_loop *loop;
+
     const struct test_ops *ops;
 };
 
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <ev.h>
+
+#include "worker.h"
+#include "log.h"
+
+
+void (*worker_exit_notify)(void) = NULL;
+
+
+int thread_set_priority( pthread_t thread, const char *priority )
+{
+    struct sched_param param;
+    int policy;
+    int p, r;
+
+    if (sscanf(priority, "fifo,%d", &p )==1) {
+        policy = SCHED_FIFO;
+        dbg("priority: fifo,%d", p);
+    } else if (sscanf(priority, "rr,%d", &p )==1) {
+        policy = SCHED_RR;
+        dbg("priority: rr,%d", p);
+    } else if (sscanf(priority, "other,%d", &p )==1) {
+        policy = SCHED_OTHER;
+        dbg("priority: other,%d", p);
+    } else {
+        printf("Invalid priority '%s'\n", priority);
+        return -1;
+    }
+
+    param.sched_priority = p;
+    r = pthread_setschedparam( thread, policy, &param );
+    if (r) {
+        err("pthread_setschedparam: %s", strerror(r));
+        return -1;
+    }
+    return 0;
+}
+
+
+static void on_worker_stop( struct ev_loop *loop, struct ev_async *w, int revents ) {
+    ev_unloop( loop, EVUNLOOP_ALL );
+}
+
+
+/* the tests are only touched from the worker thread while it runs */
+static void on_worker_report( struct ev_loop *loop, struct ev_async *a, int revents ) {
+    struct worker *w = (struct worker *)a->data;
+    int i;
+
+    for (i = 0; i < w->tests_count; i++) {
+        struct test *t = w->tests[i];
+        if (t->ops->report)
+            t->ops->report( t );
+    }
+}
+
+
+static void *worker_thread( void *arg ) {
+    struct worker *w = (struct worker *)arg;
+    int i;
+
+    if (w->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO( &cpus );
+        CPU_SET( w->cpu, &cpus );
+        if (pthread_setaffinity_np( pthread_self(), sizeof(cpus), &cpus ))
+            warn("worker %d: can't pin the thread to CPU %d", w->index, w->cpu);
+    }
+    if (w->priority && w->priority[0])
+        thread_set_priority( pthread_self(), w->priority );
+
+    for (i = 0; i < w->tests_count; i++) {
+        struct test *t = w->tests[i];
+        if (t->ops->start( t ) < 0) {
+            err("starting test %s failed", t->name );
+            w->start_failed = 1;
+            if (worker_exit_notify) worker_exit_notify();
+            return NULL;
+        }
+    }
+
+    dbg("worker %d: running %d tests on CPU %d", w->index, w->tests_count, w->cpu);
+    ev_run( w->loop, 0 );
+
+    /* the loop exits on stop request, or on fatal error of a test */
+    if (worker_exit_notify) worker_exit_notify();
+    return NULL;
+}
+
+
+int worker_init( struct worker *w, int index, int cpu, const char *priority )
+{
+    memset( w, 0, sizeof(*w) );
+    w->index = index;
+    w->cpu = cpu;
+    w->priority = priority;
+
+    w->loop = ev_loop_new( EVFLAG_AUTO );
+    if (!w->loop) {
+        err("worker %d: can't create the event loop", index);
+        return -1;
+    }
+    ev_async_init( &w->stop_watcher, on_worker_stop );
+    ev_async_start( w->loop, &w->stop_watcher );
+    ev_async_init( &w->report_watcher, on_worker_report );
+    w->report_watcher.data = w;
+    ev_async_start( w->loop, &w->report_watcher );
+    return 0;
+}
+
+
+int worker_add_test( struct worker *w, struct test *t )
+{
+    struct test **tests = realloc( w->tests, (w->tests_count + 1) * sizeof(*tests) );
+    if (!tests)
+        return -1;
+    w->tests = tests;
+    w->tests[w->tests_count++] = t;
+    t->loop = w->loop;
+    return 0;
+}
+
+
+int worker_start( struct worker *w )
+{
+    int r = pthread_create( &w->thread, NULL, worker_thread, w );
+    if (r) {
+        err("worker %d: pthread_create: %s", w->index, strerror(r));
+        return -1;
+    }
+    w->running = 1;
+    return 0;
+}
+
+
+void worker_report( struct worker *w )
+{
+    if (w->running)
+        ev_async_send( w->loop, &w->report_watcher );
+}
+
+
+void worker_stop( struct worker *w )
+{
+    if (!w->running)
+        return;
+    ev_async_send( w->loop, &w->stop_watcher );
+    pthread_join( w->thread, NULL );
+    w->running = 0;
+}
+
+
+void worker_release( struct worker *w )
+{
+    if (w->loop) {
+        ev_async_stop( w->loop, &w->stop_watcher );
+        ev_async_stop( w->loop, &w->report_watcher );
+        ev_loop_destroy( w->loop );
+        w->loop = NULL;
+    }
+    free( w->tests );
+    w->tests = NULL;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2015 Arnaud Mouiche <arnaud.mouiche@invoxia.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#ifndef __worker_h__
+#define __worker_h__
+
+#include <pthread.h>
+#include <ev.h>
+
+#include "test.h"
+
+/*
+ * A worker thread, running its own event loop for a subset of the tests.
+ * The tests are started from the worker thread, once its affinity and
+ * scheduling priority are set.
+ */
+struct worker {
+    int index;
+    pthread_t thread;
+    int running;
+    int start_failed;     /* one of the tests failed to start */
+
+    struct ev_loop *loop;
+    struct ev_async stop_watcher; /* break the worker loop, from any thread */
+    struct ev_async report_watcher; /* report the worker tests, from any thread */
+
+    struct test **tests;
+    int tests_count;
+
+    int cpu;              /* CPU the thread is pinned to. -1 for no affinity */
+    const char *priority; /* scheduling priority, see alsa_config.priority */
+};
+
+/* if not NULL, called from the worker thread when its event loop exits */
+extern void (*worker_exit_notify)(void);
+
+
+/*
+ * set the scheduling priority of 'thread'
+ * priority is "fifo,N", "rr,N" or "other,N"
+ * return 0 on success
+ */
+int thread_set_priority( pthread_t thread, const char *priority );
+
+
+/*
+ * worker_init() returns 0 on success
+ * worker_add_test() attaches the test to the worker loop (t->loop)
+ * worker_start() creates the thread which starts the tests and runs the loop
+ * worker_report() asks the worker to print the report of its tests, from its own
+ * thread (thread safe, doesn't wait)
+ * worker_stop() asks the worker loop to exit (thread safe) and waits for the thread
+ * worker_release() frees the worker resources, once its tests are closed
+ */
+int worker_init( struct worker *w, int index, int cpu, const char *priority );
+int worker_add_test( struct worker *w, struct test *t );
+int worker_start( struct worker *w );
+void worker_report( struct worker *w );
+void worker_stop( struct worker *w );
+void worker_release( struct worker *w );
+
+#endif //__worker_h__